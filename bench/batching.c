@@ -0,0 +1,200 @@
+/* Write batching under a busy group chat: senders post to a large group at once and every member reads
+ * it all. Prints the TCP segments per delivered message from /proc/net/snmp, run it against the server
+ * with and without -k. Given the server's pid it sends SIGUSR1 before and after, so the server's
+ * Outbound writes lines bracket the run with its sendmsg calls. Start the server in a scratch
+ * directory whose groups.txt has a default group, then build with make bench and run
+ * ./bench/batching <port> [members] [senders] [messages] [server pid] */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "../protocol.h"
+
+typedef struct {
+	int fd;
+	long got;
+	frame_parser_t parser;
+	char buf[FRAME_HDR + FRAME_MAX_PAYLOAD];
+} conn_t;
+
+int port;
+int messages;
+pthread_barrier_t start;
+
+double now_s(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Tcp OutSegs, the segments sent on every interface, loopback included */
+long out_segs(void){
+	FILE *f = fopen("/proc/net/snmp", "r");
+	char line[1024];
+	long segs = -1;
+
+	if(f == NULL) {
+		return -1;
+	}
+	/* The Tcp: header line names the fields, the next one holds the values */
+	while(fgets(line, sizeof(line), f) != NULL) {
+		if(strncmp(line, "Tcp:", 4) != 0 || fgets(line, sizeof(line), f) == NULL) {
+			continue;
+		}
+		char *field = strtok(line, " ");
+		for(int i=0; field != NULL && i<11; i++) {
+			field = strtok(NULL, " ");
+		}
+		if(field != NULL) {
+			segs = atol(field);
+		}
+		break;
+	}
+	fclose(f);
+	return segs;
+}
+
+/* Connect and register a member of the default group */
+int conn_open(conn_t *c, const char *name){
+	struct sockaddr_in addr;
+	frame_t f;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+	c->fd = socket(AF_INET, SOCK_STREAM, 0);
+	c->got = 0;
+	if(connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("ERROR: connect");
+		return -1;
+	}
+	frame_parser_init(&c->parser, c->buf, sizeof(c->buf));
+
+	if(frame_send(c->fd, OP_REGISTER, "", 0) < 0 || frame_send(c->fd, OP_NAME, name, strlen(name)) < 0
+		|| frame_send(c->fd, OP_PASSWORD, "pswd", 4) < 0 || frame_recv(c->fd, &c->parser, &f) <= 0
+		|| frame_send(c->fd, OP_GROUPS, "default", 7) < 0 || frame_recv(c->fd, &c->parser, &f) <= 0
+		|| f.opcode != OP_OK) {
+		fprintf(stderr, "ERROR: %s could not register\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+/* One sender: short chat lines to the group as fast as the socket takes them */
+void *sender(void *arg){
+	conn_t *c = (conn_t *)arg;
+	char text[64];
+
+	pthread_barrier_wait(&start);
+	for(int i=0; i<messages; i++) {
+		int len = snprintf(text, sizeof(text), "default batch %d", i);
+		if(frame_send(c->fd, OP_GROUP_MESSAGE, text, len) < 0) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Read whatever arrived for a member and count its group messages, -1 once it is gone */
+int conn_read(conn_t *c){
+	frame_t f;
+	size_t space;
+	char *dst = frame_space(&c->parser, &space);
+	ssize_t n = recv(c->fd, dst, space, MSG_DONTWAIT);
+
+	if(n <= 0) {
+		return n < 0 ? 0 : -1;
+	}
+	frame_commit(&c->parser, n);
+	while(frame_next(&c->parser, &f) > 0) {
+		if(f.opcode == OP_SEQ_TEXT && memmem(f.payload, f.len, " batch ", 7) != NULL) {
+			c->got++;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv){
+	char name[32];
+
+	port = argc > 1 ? atoi(argv[1]) : 0;
+	int member_count = argc > 2 ? atoi(argv[2]) : 200;
+	int sender_count = argc > 3 ? atoi(argv[3]) : 8;
+	messages = argc > 4 ? atoi(argv[4]) : 300;
+	pid_t server = argc > 5 ? atoi(argv[5]) : 0;
+	if(port < 1 || sender_count < 1 || member_count < sender_count || messages < 1 || argc > 6) {
+		printf("Usage: %s <port> [members] [senders] [messages] [server pid]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	conn_t *members = (conn_t *)malloc(member_count * sizeof(conn_t));
+	struct pollfd *fds = (struct pollfd *)malloc(member_count * sizeof(struct pollfd));
+	pthread_t *threads = (pthread_t *)malloc(sender_count * sizeof(pthread_t));
+
+	for(int i=0; i<member_count; i++) {
+		snprintf(name, sizeof(name), "b%d_%d", getpid(), i);
+		if(conn_open(&members[i], name) < 0) {
+			return EXIT_FAILURE;
+		}
+		fds[i].fd = members[i].fd;
+		fds[i].events = POLLIN;
+	}
+
+	/* The first members send, each gets everybody's messages but its own */
+	long want = (long)sender_count * messages * (member_count - 1);
+	long got = 0;
+
+	pthread_barrier_init(&start, NULL, sender_count + 1);
+	for(int i=0; i<sender_count; i++) {
+		pthread_create(&threads[i], NULL, sender, &members[i]);
+	}
+	if(server > 0) {
+		kill(server, SIGUSR1);
+		usleep(100000);
+	}
+
+	long segs = out_segs();
+	double begin = now_s();
+	pthread_barrier_wait(&start);
+	while(got < want) {
+		if(poll(fds, member_count, 5000) <= 0) {
+			printf("Stalled with %ld of %ld messages delivered\n", got, want);
+			break;
+		}
+		got = 0;
+		for(int i=0; i<member_count; i++) {
+			if((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && conn_read(&members[i]) < 0) {
+				fds[i].fd = -1;
+			}
+			got += members[i].got;
+		}
+	}
+	double elapsed = now_s() - begin;
+	segs = out_segs() - segs;
+
+	for(int i=0; i<sender_count; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	if(server > 0) {
+		kill(server, SIGUSR1);
+	}
+
+	printf("%d senders x %d messages to %d members: %ld deliveries in %.2f s, %.0f per second\n",
+		sender_count, messages, member_count, got, elapsed, got / elapsed);
+	if(segs >= 0 && got > 0) {
+		printf("TCP segments: %ld, %.3f per delivery\n", segs, (double)segs / got);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,154 @@
+/* Deliveries with many senders at once, the case the read-mostly client table and directory are for:
+ * every client registers into one group, then all of them send at the same moment, each from its own
+ * thread, while reading everybody else's messages. Run it against the server in each mode and with
+ * different -w. Start the server in a scratch directory whose groups.txt has a default group, then
+ * build with make bench and run ./bench/contention <port> [clients] [messages] [group|chat] */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "../protocol.h"
+
+#define RECV_TIMEOUT_S 5
+
+typedef struct {
+	int fd;
+	int id;
+	long got;
+	double last;  /* when the latest message arrived */
+	frame_parser_t parser;
+	char buf[FRAME_HDR + FRAME_MAX_PAYLOAD];
+} conn_t;
+
+int port;
+int client_count;
+int messages;
+int group = 1;  /* group messages, or chat lines broadcast to everybody online */
+pthread_barrier_t start;
+
+double now_s(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Connect and register a member of the default group */
+int conn_open(conn_t *c, const char *name){
+	struct sockaddr_in addr;
+	struct timeval tv = { RECV_TIMEOUT_S, 0 };
+	frame_t f;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+	c->fd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if(connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("ERROR: connect");
+		return -1;
+	}
+	frame_parser_init(&c->parser, c->buf, sizeof(c->buf));
+
+	if(frame_send(c->fd, OP_REGISTER, "", 0) < 0 || frame_send(c->fd, OP_NAME, name, strlen(name)) < 0
+		|| frame_send(c->fd, OP_PASSWORD, "pswd", 4) < 0 || frame_recv(c->fd, &c->parser, &f) <= 0
+		|| frame_send(c->fd, OP_GROUPS, "default", 7) < 0 || frame_recv(c->fd, &c->parser, &f) <= 0
+		|| f.opcode != OP_OK) {
+		fprintf(stderr, "ERROR: %s could not register\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+/* All senders start together and send as fast as their sockets take it */
+void *writer(void *arg){
+	conn_t *c = (conn_t *)arg;
+	char text[64];
+
+	pthread_barrier_wait(&start);
+	for(int i=0; i<messages; i++) {
+		int len = group ? snprintf(text, sizeof(text), "default busy %d.%d", c->id, i)
+			: snprintf(text, sizeof(text), "c%d: busy %d.%d\n", c->id, c->id, i);
+		if(frame_send(c->fd, group ? OP_GROUP_MESSAGE : OP_CHAT, text, len) < 0) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Everybody else's messages. Under the server's default -o drop a member that falls behind loses
+ * some, the reader gives up RECV_TIMEOUT_S after the last one */
+void *reader(void *arg){
+	conn_t *c = (conn_t *)arg;
+	long want = (long)(client_count - 1) * messages;
+	frame_t f;
+
+	while(c->got < want && frame_recv(c->fd, &c->parser, &f) > 0) {
+		if(memmem(f.payload, f.len, " busy ", 6) != NULL) {
+			c->got++;
+			c->last = now_s();
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv){
+	char name[32];
+
+	port = argc > 1 ? atoi(argv[1]) : 0;
+	client_count = argc > 2 ? atoi(argv[2]) : 32;
+	messages = argc > 3 ? atoi(argv[3]) : 2000;
+	if(argc > 4) {
+		group = strcmp(argv[4], "group") == 0;
+	}
+	if(port < 1 || client_count < 2 || messages < 1 || argc > 5 || (argc > 4 && !group && strcmp(argv[4], "chat") != 0)) {
+		printf("Usage: %s <port> [clients] [messages] [group|chat]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	conn_t *clients = (conn_t *)calloc(client_count, sizeof(conn_t));
+	pthread_t *threads = (pthread_t *)malloc(2 * client_count * sizeof(pthread_t));
+
+	for(int i=0; i<client_count; i++) {
+		snprintf(name, sizeof(name), "c%d_%d", getpid(), i);
+		clients[i].id = i;
+		if(conn_open(&clients[i], name) < 0) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	pthread_barrier_init(&start, NULL, client_count + 1);
+	for(int i=0; i<client_count; i++) {
+		pthread_create(&threads[2 * i], NULL, writer, &clients[i]);
+		pthread_create(&threads[2 * i + 1], NULL, reader, &clients[i]);
+	}
+	double begin = now_s();
+	pthread_barrier_wait(&start);
+	for(int i=0; i<2 * client_count; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	/* The rate up to the last delivery */
+	long total = 0;
+	double end = begin;
+	for(int i=0; i<client_count; i++) {
+		total += clients[i].got;
+		if(clients[i].last > end) {
+			end = clients[i].last;
+		}
+	}
+	long want = (long)client_count * (client_count - 1) * messages;
+
+	printf("%d clients x %d %s messages: %ld of %ld delivered in %.2f s, %.0f per second\n", client_count, messages,
+		group ? "group" : "chat", total, want, end - begin, end > begin ? total / (end - begin) : 0);
+	return EXIT_SUCCESS;
+}
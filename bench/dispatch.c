@@ -0,0 +1,152 @@
+/* Per-message dispatch cost: the strncmp chain handle_client used to walk against the opcode table
+ * client_process indexes now. Build with make bench, run ./bench/dispatch [messages] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../protocol.h"
+
+static const char CREATE_GROUP[] = "cgroup";
+static const char DELETE_GROUP[] = "dgroup";
+static const char ENTER_GROUP[] = "egroup";
+static const char SHOW_GROUPS[] = "sgroups";
+static const char ADD_CONTACT[] = "acontact";
+static const char DELETE_CONTACT[] = "dcontact";
+static const char CONTACT_LIST[] = "clist";
+static const char PERSONAL_MESSAGE[] = "pm ";
+static const char GROUP_MESSAGE[] = "mgroup";
+
+typedef struct {
+	uint8_t opcode;
+	const char *line;
+} sample_t;
+
+/* Mostly chat, as on a live server, with one of each command mixed in */
+static const sample_t samples[] = {
+	{OP_CHAT, "john: hello everyone\n"},
+	{OP_CHAT, "mary: did anyone see the game last night?\n"},
+	{OP_CHAT, "john: yes, what a finish\n"},
+	{OP_CHAT, "mary: pmsl, that last minute goal\n"},
+	{OP_CHAT, "bob: shall we meet at eight\n"},
+	{OP_CHAT, "john: fine by me\n"},
+	{OP_CHAT, "mary: see you there\n"},
+	{OP_CHAT, "bob: bring the tickets\n"},
+	{OP_CHAT, "john: ok\n"},
+	{OP_PERSONAL_MESSAGE, "pm mary are you coming?"},
+	{OP_GROUP_MESSAGE, "mgroup default hello group"},
+	{OP_CONTACT_LIST, "clist"},
+};
+#define SAMPLES (sizeof(samples) / sizeof(samples[0]))
+
+static unsigned long handled[256];
+
+typedef void (*command_fn)(const char *);
+
+static void cmd_create_group(const char *args){ handled[OP_CREATE_GROUP] += args[0]; }
+static void cmd_delete_group(const char *args){ handled[OP_DELETE_GROUP] += args[0]; }
+static void cmd_enter_group(const char *args){ handled[OP_ENTER_GROUP] += args[0]; }
+static void cmd_show_groups(const char *args){ handled[OP_SHOW_GROUPS] += args[0]; }
+static void cmd_add_contact(const char *args){ handled[OP_ADD_CONTACT] += args[0]; }
+static void cmd_delete_contact(const char *args){ handled[OP_DELETE_CONTACT] += args[0]; }
+static void cmd_contact_list(const char *args){ handled[OP_CONTACT_LIST] += args[0]; }
+static void cmd_personal_message(const char *args){ handled[OP_PERSONAL_MESSAGE] += args[0]; }
+static void cmd_group_message(const char *args){ handled[OP_GROUP_MESSAGE] += args[0]; }
+static void cmd_chat(const char *args){ handled[OP_CHAT] += args[0]; }
+
+static command_fn commands[256] = {
+	[OP_CHAT] = cmd_chat,
+	[OP_CREATE_GROUP] = cmd_create_group,
+	[OP_DELETE_GROUP] = cmd_delete_group,
+	[OP_ENTER_GROUP] = cmd_enter_group,
+	[OP_SHOW_GROUPS] = cmd_show_groups,
+	[OP_ADD_CONTACT] = cmd_add_contact,
+	[OP_DELETE_CONTACT] = cmd_delete_contact,
+	[OP_CONTACT_LIST] = cmd_contact_list,
+	[OP_PERSONAL_MESSAGE] = cmd_personal_message,
+	[OP_GROUP_MESSAGE] = cmd_group_message,
+};
+
+/* The old way: every line is compared against each keyword in turn, chat falls through all of them */
+static void dispatch_chain(const char *buff_out){
+	if(strncmp(buff_out,CREATE_GROUP,strlen(CREATE_GROUP)) == 0) {
+		cmd_create_group(buff_out);
+	} else if(strncmp(buff_out,DELETE_GROUP,strlen(DELETE_GROUP)) == 0) {
+		cmd_delete_group(buff_out);
+	} else if(strncmp(buff_out,ENTER_GROUP, strlen(ENTER_GROUP)) == 0) {
+		cmd_enter_group(buff_out);
+	} else if(strcmp(buff_out,SHOW_GROUPS) == 0) {
+		cmd_show_groups(buff_out);
+	} else if(strncmp(buff_out,ADD_CONTACT,strlen(ADD_CONTACT)) == 0) {
+		cmd_add_contact(buff_out);
+	} else if(strncmp(buff_out,DELETE_CONTACT,strlen(DELETE_CONTACT)) == 0) {
+		cmd_delete_contact(buff_out);
+	} else if (strcmp(buff_out,CONTACT_LIST) == 0) {
+		cmd_contact_list(buff_out);
+	} else if(strncmp(buff_out,PERSONAL_MESSAGE, strlen(PERSONAL_MESSAGE)) == 0) {
+		cmd_personal_message(buff_out);
+	} else if(strncmp(buff_out,GROUP_MESSAGE,strlen(GROUP_MESSAGE)) == 0) {
+		cmd_group_message(buff_out);
+	} else if(strlen(buff_out) > 0){
+		cmd_chat(buff_out);
+	}
+}
+
+/* The new way: the opcode picks the handler */
+static void dispatch_table(uint8_t opcode, const char *payload){
+	if(commands[opcode] != NULL) {
+		commands[opcode](payload);
+	}
+}
+
+static double now_ns(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Volatile so the compiler cannot hoist the dispatch out of the loop */
+static void (*volatile chain_fn)(const char *) = dispatch_chain;
+static void (*volatile table_fn)(uint8_t, const char *) = dispatch_table;
+
+int main(int argc, char **argv){
+	long messages = argc > 1 ? atol(argv[1]) : 20000000;
+
+	if(messages < 1) {
+		printf("Usage: %s [messages]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	double start = now_ns();
+	for(long i=0; i<messages; i++) {
+		chain_fn(samples[i % SAMPLES].line);
+	}
+	double chain = (now_ns() - start) / messages;
+
+	start = now_ns();
+	for(long i=0; i<messages; i++) {
+		const sample_t *s = &samples[i % SAMPLES];
+		table_fn(s->opcode, s->line);
+	}
+	double table = (now_ns() - start) / messages;
+
+	/* Chat alone, the case that walked the whole chain */
+	start = now_ns();
+	for(long i=0; i<messages; i++) {
+		chain_fn(samples[0].line);
+	}
+	double chain_chat = (now_ns() - start) / messages;
+
+	start = now_ns();
+	for(long i=0; i<messages; i++) {
+		table_fn(OP_CHAT, samples[0].line);
+	}
+	double table_chat = (now_ns() - start) / messages;
+
+	printf("%ld messages, %zu%% chat\n", messages, (SAMPLES - 3) * 100 / SAMPLES);
+	printf("strncmp chain: %6.2f ns per message, %6.2f ns per chat message\n", chain, chain_chat);
+	printf("opcode table:  %6.2f ns per message, %6.2f ns per chat message\n", table, table_chat);
+	return EXIT_SUCCESS;
+}
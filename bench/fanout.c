@@ -0,0 +1,160 @@
+/* Group fan-out latency to members that read, before and after members that never read join the group:
+ * with per-connection queues it should stay flat under -o drop and -o disconnect, under -o pause the
+ * sender is held back instead. Start the server in a scratch directory whose groups.txt has a
+ * default group, then build with make bench and run ./bench/fanout <port> [members] [stalled] [messages] */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "../protocol.h"
+
+#define RECV_TIMEOUT_S 5
+
+typedef struct {
+	int fd;
+	frame_parser_t parser;
+	char buf[FRAME_HDR + FRAME_MAX_PAYLOAD];
+} conn_t;
+
+int port;
+
+double now_us(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Connect and register a member of the default group. A stalled one gets a small receive buffer */
+int conn_open(conn_t *c, const char *name, int stalled){
+	struct sockaddr_in addr;
+	struct timeval tv = { RECV_TIMEOUT_S, 0 };
+	frame_t f;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+	c->fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(stalled) {
+		int size = 4096;
+		setsockopt(c->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	}
+	setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if(connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("ERROR: connect");
+		return -1;
+	}
+	frame_parser_init(&c->parser, c->buf, sizeof(c->buf));
+
+	if(frame_send(c->fd, OP_REGISTER, "", 0) < 0 || frame_send(c->fd, OP_NAME, name, strlen(name)) < 0
+		|| frame_send(c->fd, OP_PASSWORD, "pswd", 4) < 0 || frame_recv(c->fd, &c->parser, &f) <= 0
+		|| frame_send(c->fd, OP_GROUPS, "default", 7) < 0 || frame_recv(c->fd, &c->parser, &f) <= 0
+		|| f.opcode != OP_OK) {
+		fprintf(stderr, "ERROR: %s could not register\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+/* Read until the group message with mark arrives, -1 if it did not within RECV_TIMEOUT_S */
+int conn_wait(conn_t *c, const char *mark){
+	frame_t f;
+
+	while(frame_recv(c->fd, &c->parser, &f) > 0) {
+		if(f.opcode == OP_SEQ_TEXT && memmem(f.payload, f.len, mark, strlen(mark)) != NULL) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int cmp_double(const void *a, const void *b){
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Send messages one at a time and time each until every member has it */
+void run(const char *label, conn_t *sender, conn_t *members, int member_count, int messages, int *next){
+	double *lat = (double *)malloc(messages * sizeof(double));
+	char text[1100], mark[32];
+	int done = 0;
+
+	for(; done<messages; done++) {
+		snprintf(mark, sizeof(mark), "<%d>", (*next)++);
+		int len = snprintf(text, sizeof(text), "default %s ", mark);
+		memset(text + len, 'x', 1000);
+		len += 1000;
+
+		double start = now_us();
+		frame_send(sender->fd, OP_GROUP_MESSAGE, text, len);
+		int i;
+		for(i=0; i<member_count && conn_wait(&members[i], mark) == 0; i++);
+		if(i < member_count) {
+			break;
+		}
+		lat[done] = now_us() - start;
+	}
+
+	if(done == 0) {
+		printf("%-24s no message reached every member within %d s\n", label, RECV_TIMEOUT_S);
+	} else {
+		qsort(lat, done, sizeof(double), cmp_double);
+		printf("%-24s p50 %8.1f us  p99 %8.1f us  max %8.1f us", label,
+			lat[done / 2], lat[done * 99 / 100], lat[done - 1]);
+		if(done < messages) {
+			printf("  (stopped after %d, the sender is held back)", done);
+		}
+		printf("\n");
+	}
+	free(lat);
+}
+
+int main(int argc, char **argv){
+	char name[32];
+
+	port = argc > 1 ? atoi(argv[1]) : 0;
+	int member_count = argc > 2 ? atoi(argv[2]) : 20;
+	int stalled_count = argc > 3 ? atoi(argv[3]) : 4;
+	int messages = argc > 4 ? atoi(argv[4]) : 5000;
+	if(port < 1 || member_count < 1 || stalled_count < 0 || messages < 1 || argc > 5) {
+		printf("Usage: %s <port> [members] [stalled] [messages]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	conn_t *sender = (conn_t *)malloc(sizeof(conn_t));
+	conn_t *members = (conn_t *)malloc(member_count * sizeof(conn_t));
+	conn_t *stalled = (conn_t *)malloc((stalled_count + 1) * sizeof(conn_t));
+	int next = 0;
+
+	snprintf(name, sizeof(name), "fs%d", getpid());
+	if(conn_open(sender, name, 0) < 0) {
+		return EXIT_FAILURE;
+	}
+	for(int i=0; i<member_count; i++) {
+		snprintf(name, sizeof(name), "fm%d_%d", getpid(), i);
+		if(conn_open(&members[i], name, 0) < 0) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("%d members, %d messages of 1 KB each run\n", member_count, messages);
+	run("every member reads", sender, members, member_count, messages, &next);
+
+	for(int i=0; i<stalled_count; i++) {
+		snprintf(name, sizeof(name), "fx%d_%d", getpid(), i);
+		if(conn_open(&stalled[i], name, 1) < 0) {
+			return EXIT_FAILURE;
+		}
+	}
+	snprintf(name, sizeof(name), "%d never read", stalled_count);
+	run(name, sender, members, member_count, messages, &next);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,144 @@
+/* Cost of one contact mutation: rewriting the whole users file the way save_users did before the
+ * journal, against appending one record to the journal. Runs in a scratch directory under /tmp.
+ * Build with make bench, run ./bench/journal [-s] [users] [mutations], -s syncs after every mutation */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#define STR_SIZE 32
+#define CONTACTS 8
+#define GROUPS 4
+
+typedef struct {
+	char name[STR_SIZE];
+	char pswd[STR_SIZE];
+	char contacts[CONTACTS][STR_SIZE];
+	char groups[GROUPS][STR_SIZE];
+} user_t;
+
+user_t *users;
+int user_count;
+int sync_each = 0;
+
+/* The old save_users: the whole directory goes to a temp file that replaces users.txt */
+int save_users(const char *fname){
+	char tmp_name[256];
+	FILE *file;
+
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", fname);
+	if((file = fopen(tmp_name, "w")) == NULL) {
+		perror(tmp_name);
+		return -1;
+	}
+
+	for(int i=0; i<user_count; i++) {
+		user_t *u = &users[i];
+
+		fprintf(file, "%s:%s\ncontacts:", u->name, u->pswd);
+		for(int j=0; j<CONTACTS; j++) {
+			fprintf(file, ":%s", u->contacts[j]);
+		}
+		fputs("\ngroups:", file);
+		for(int j=0; j<GROUPS; j++) {
+			fprintf(file, ":%s", u->groups[j]);
+		}
+		fputs("\n", file);
+	}
+
+	if(fflush(file) != 0 || (sync_each && fsync(fileno(file)) < 0) || fclose(file) != 0) {
+		perror(tmp_name);
+		return -1;
+	}
+	return rename(tmp_name, fname);
+}
+
+/* The journal: one short record per mutation */
+int journal_append(int fd, const char *name, const char *contact){
+	char record[3 * STR_SIZE];
+	int len = snprintf(record, sizeof(record), "acontact:%s:%s\n", name, contact);
+
+	if(write(fd, record, len) != len || (sync_each && fdatasync(fd) < 0)) {
+		perror("journal");
+		return -1;
+	}
+	return 0;
+}
+
+double now_us(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int main(int argc, char **argv){
+	char dir[] = "/tmp/chatroom-journal-XXXXXX";
+	int arg = 1;
+
+	if(arg < argc && strcmp(argv[arg], "-s") == 0) {
+		sync_each = 1;
+		arg++;
+	}
+	user_count = arg < argc ? atoi(argv[arg++]) : 100000;
+	int mutations = arg < argc ? atoi(argv[arg++]) : 200;
+	if(user_count < 1 || mutations < 1 || arg != argc) {
+		printf("Usage: %s [-s] [users] [mutations]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	users = (user_t *)calloc(user_count, sizeof(user_t));
+	if(users == NULL || mkdtemp(dir) == NULL || chdir(dir) < 0) {
+		perror("ERROR: setup failed");
+		return EXIT_FAILURE;
+	}
+
+	for(int i=0; i<user_count; i++) {
+		snprintf(users[i].name, STR_SIZE, "user%d", i);
+		snprintf(users[i].pswd, STR_SIZE, "pswd%d", i);
+		for(int j=0; j<CONTACTS; j++) {
+			snprintf(users[i].contacts[j], STR_SIZE, "user%d", (i + j + 1) % user_count);
+		}
+		for(int j=0; j<GROUPS; j++) {
+			snprintf(users[i].groups[j], STR_SIZE, "group%d", (i + j) % 100);
+		}
+	}
+
+	double start = now_us();
+	for(int i=0; i<mutations; i++) {
+		user_t *u = &users[i % user_count];
+		snprintf(u->contacts[0], STR_SIZE, "user%d", (i * 7) % user_count);
+		if(save_users("users.txt") < 0) {
+			return EXIT_FAILURE;
+		}
+	}
+	double rewrite = (now_us() - start) / mutations;
+
+	int fd = open("journal.txt", O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if(fd < 0) {
+		perror("journal.txt");
+		return EXIT_FAILURE;
+	}
+	start = now_us();
+	for(int i=0; i<mutations; i++) {
+		user_t *u = &users[i % user_count];
+		snprintf(u->contacts[0], STR_SIZE, "user%d", (i * 7) % user_count);
+		if(journal_append(fd, u->name, u->contacts[0]) < 0) {
+			return EXIT_FAILURE;
+		}
+	}
+	double journal = (now_us() - start) / mutations;
+	close(fd);
+
+	unlink("users.txt");
+	unlink("journal.txt");
+	chdir("/");
+	rmdir(dir);
+
+	printf("%d users, %d mutations%s\n", user_count, mutations, sync_each ? ", synced each time" : "");
+	printf("rewrite users.txt: %10.1f us per mutation\n", rewrite);
+	printf("journal append:    %10.1f us per mutation\n", journal);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,278 @@
+/* The serving modes side by side: starts ./server in thread, epoll and uring mode in turn, each in a
+ * scratch directory under /tmp, and has clients chat in one group at a steady pace. Prints deliveries
+ * per second and the latency from send to delivery. Build with make bench, run from the directory
+ * holding the server: ./bench/modes [clients] [messages] [interval_us] [workers] */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "../protocol.h"
+
+#define RECV_TIMEOUT_S 5
+
+typedef struct {
+	int fd;
+	int id;
+	long got;
+	double last;  /* when the latest message arrived */
+	double *lat;
+	frame_parser_t parser;
+	char buf[FRAME_HDR + FRAME_MAX_PAYLOAD];
+} conn_t;
+
+static const char *modes[] = { "thread", "epoll", "uring" };
+
+int port;
+int client_count;
+int messages;
+int interval_us;
+pthread_barrier_t start;
+
+double now_us(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Connect and register a member of the default group, retrying while the server starts up */
+int conn_open(conn_t *c, const char *name){
+	struct sockaddr_in addr;
+	struct timeval tv = { RECV_TIMEOUT_S, 0 };
+	frame_t f;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+	for(int tries=0; ; tries++) {
+		c->fd = socket(AF_INET, SOCK_STREAM, 0);
+		setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		if(connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+			break;
+		}
+		close(c->fd);
+		if(tries == 50) {
+			perror("ERROR: connect");
+			return -1;
+		}
+		usleep(100000);
+	}
+	frame_parser_init(&c->parser, c->buf, sizeof(c->buf));
+
+	if(frame_send(c->fd, OP_REGISTER, "", 0) < 0 || frame_send(c->fd, OP_NAME, name, strlen(name)) < 0
+		|| frame_send(c->fd, OP_PASSWORD, "pswd", 4) < 0 || frame_recv(c->fd, &c->parser, &f) <= 0
+		|| frame_send(c->fd, OP_GROUPS, "default", 7) < 0 || frame_recv(c->fd, &c->parser, &f) <= 0
+		|| f.opcode != OP_OK) {
+		fprintf(stderr, "ERROR: %s could not register\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+/* Each message carries the time it was sent */
+void *writer(void *arg){
+	conn_t *c = (conn_t *)arg;
+	char text[64];
+
+	pthread_barrier_wait(&start);
+	double next = now_us();
+	for(int i=0; i<messages; i++) {
+		int len = snprintf(text, sizeof(text), "default t=%.1f", now_us());
+		if(frame_send(c->fd, OP_GROUP_MESSAGE, text, len) < 0) {
+			break;
+		}
+		next += interval_us;
+		double wait = next - now_us();
+		if(wait > 0) {
+			usleep((useconds_t)wait);
+		}
+	}
+	return NULL;
+}
+
+/* Everybody else's messages, each one's latency noted. Under the server's default -o drop a member
+ * that falls behind loses some, the reader gives up RECV_TIMEOUT_S after the last one */
+void *reader(void *arg){
+	conn_t *c = (conn_t *)arg;
+	long want = (long)(client_count - 1) * messages;
+	frame_t f;
+
+	while(c->got < want && frame_recv(c->fd, &c->parser, &f) > 0) {
+		char *t = f.opcode == OP_SEQ_TEXT ? memmem(f.payload, f.len, " t=", 3) : NULL;
+		if(t != NULL) {
+			c->last = now_us();
+			c->lat[c->got++] = c->last - strtod(t + 3, NULL);
+		}
+	}
+	return NULL;
+}
+
+int cmp_double(const void *a, const void *b){
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Start the server in a scratch directory, its output goes to server.log there */
+pid_t server_start(const char *server, const char *mode, const char *workers, char *dir){
+	strcpy(dir, "/tmp/chatroom-modes-XXXXXX");
+	if(mkdtemp(dir) == NULL) {
+		return -1;
+	}
+
+	pid_t pid = fork();
+	if(pid == 0) {
+		char port_arg[16];
+		snprintf(port_arg, sizeof(port_arg), "%d", port);
+		if(chdir(dir) < 0) {
+			_exit(1);
+		}
+		FILE *f = fopen("groups.txt", "w");
+		fputs("default:admin\n", f);
+		fclose(f);
+		close(creat("users.txt", 0644));
+		int log = creat("server.log", 0644);
+		dup2(log, STDOUT_FILENO);
+		dup2(log, STDERR_FILENO);
+		execl(server, server, "-m", mode, "-w", workers, port_arg, (char *)NULL);
+		_exit(1);
+	}
+	return pid;
+}
+
+/* Stop the server and tell which mode it served with, io_uring falls back to epoll when it must */
+void server_stop(pid_t pid, const char *dir, char *serving, size_t size){
+	char path[PATH_MAX], line[256];
+
+	/* The stats flush the server's output, which goes to a file */
+	kill(pid, SIGUSR1);
+	usleep(200000);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+
+	serving[0] = '\0';
+	snprintf(path, sizeof(path), "%s/server.log", dir);
+	FILE *f = fopen(path, "r");
+	while(f != NULL && fgets(line, sizeof(line), f) != NULL) {
+		if(strncmp(line, "Serving with", 12) == 0 || strncmp(line, "Accepting on", 12) == 0) {
+			line[strcspn(line, "\n")] = '\0';
+			snprintf(serving, size, "%s", line);
+		}
+	}
+	if(f != NULL) {
+		fclose(f);
+	}
+
+	/* Everything the server left behind, then the directory */
+	char cmd[PATH_MAX + 16];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	if(system(cmd) != 0) {
+		fprintf(stderr, "ERROR: could not remove %s\n", dir);
+	}
+}
+
+/* One mode: every client chats at the pace asked for, until everybody has everything */
+int run(const char *server, const char *mode, const char *workers){
+	char dir[64], name[32], serving[128];
+	conn_t *clients = (conn_t *)calloc(client_count, sizeof(conn_t));
+	pthread_t *threads = (pthread_t *)malloc(2 * client_count * sizeof(pthread_t));
+	long want = (long)(client_count - 1) * messages;
+
+	pid_t pid = server_start(server, mode, workers, dir);
+	if(pid < 0) {
+		return -1;
+	}
+	for(int i=0; i<client_count; i++) {
+		snprintf(name, sizeof(name), "m%d", i);
+		clients[i].id = i;
+		clients[i].lat = (double *)malloc(want * sizeof(double));
+		if(conn_open(&clients[i], name) < 0) {
+			kill(pid, SIGTERM);
+			return -1;
+		}
+	}
+
+	pthread_barrier_init(&start, NULL, client_count + 1);
+	for(int i=0; i<client_count; i++) {
+		pthread_create(&threads[2 * i], NULL, writer, &clients[i]);
+		pthread_create(&threads[2 * i + 1], NULL, reader, &clients[i]);
+	}
+	double begin = now_us();
+	pthread_barrier_wait(&start);
+	for(int i=0; i<2 * client_count; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	/* All the latencies together, the rate up to the last delivery */
+	long total = 0;
+	double end = begin;
+	for(int i=0; i<client_count; i++) {
+		total += clients[i].got;
+		if(clients[i].last > end) {
+			end = clients[i].last;
+		}
+	}
+	double elapsed = (end - begin) / 1e6;
+	double *lat = (double *)malloc((total + 1) * sizeof(double));
+	long n = 0;
+	for(int i=0; i<client_count; i++) {
+		memcpy(lat + n, clients[i].lat, clients[i].got * sizeof(double));
+		n += clients[i].got;
+		close(clients[i].fd);
+		free(clients[i].lat);
+	}
+	qsort(lat, total, sizeof(double), cmp_double);
+
+	server_stop(pid, dir, serving, sizeof(serving));
+	printf("%-7s %10.0f deliveries/s  p50 %8.1f us  p99 %8.1f us  max %9.1f us  (%s)\n", mode,
+		elapsed > 0 ? total / elapsed : 0, total ? lat[total / 2] : 0, total ? lat[total * 99 / 100] : 0, total ? lat[total - 1] : 0, serving);
+	if(total < want * client_count) {
+		printf("        only %ld of %ld messages arrived\n", total, want * client_count);
+	}
+
+	free(lat);
+	free(threads);
+	free(clients);
+	port++;
+	return 0;
+}
+
+int main(int argc, char **argv){
+	char server[PATH_MAX];
+
+	client_count = argc > 1 ? atoi(argv[1]) : 50;
+	messages = argc > 2 ? atoi(argv[2]) : 200;
+	interval_us = argc > 3 ? atoi(argv[3]) : 20000;
+	const char *workers = argc > 4 ? argv[4] : "2";
+	if(client_count < 2 || messages < 1 || interval_us < 0 || atoi(workers) < 1 || argc > 5) {
+		printf("Usage: %s [clients] [messages] [interval_us] [workers]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if(realpath("./server", server) == NULL) {
+		perror("ERROR: ./server");
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	port = 20000 + getpid() % 20000;
+	printf("%d clients in one group, %d messages each, one every %d us, %s workers\n",
+		client_count, messages, interval_us, workers);
+	for(size_t i=0; i<sizeof(modes) / sizeof(modes[0]); i++) {
+		if(run(server, modes[i], workers) < 0) {
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
@@ -9,17 +9,15 @@
 #include <arpa/inet.h>
 #include <pthread.h>
 
+#include "protocol.h"
+
 #define LENGTH 2048
 #define BUFFER_SZ 2048
 #define STR_SIZE 32
+#define MAX_CONVERSATIONS 64
+#define RECONNECT_TRIES 5
 
 // Global variables
-static const char USERNAME_ERROR[] = "Username already exists.\n";
-static const char REGISTER_SUCCESS[] = "Registered successfully.\n";
-static const char LOGIN_ERROR[] = "Log in failed.\n";
-static const char LOGIN_SUCCESS[] = "Logged in successfully.\n";
-static const char GROUP_ERROR[] = "No valid group names found.\n";
-
 static const char REGISTER[] = "R";
 static const char LOGIN[] = "L";
 
@@ -32,6 +30,33 @@ static const char DELETE_CONTACT[] = "dcontact";
 static const char CONTACT_LIST[] = "clist";
 static const char PERSONAL_MESSAGE[] = "pm";
 static const char GROUP_MESSAGE[] = "mgroup";
+static const char HISTORY[] = "history";
+
+/* Command keywords and the opcodes they are sent with */
+typedef struct {
+  const char *keyword;
+  uint8_t opcode;
+} command_t;
+
+static const command_t commands[] = {
+  {CREATE_GROUP, OP_CREATE_GROUP},
+  {DELETE_GROUP, OP_DELETE_GROUP},
+  {ENTER_GROUP, OP_ENTER_GROUP},
+  {SHOW_GROUPS, OP_SHOW_GROUPS},
+  {ADD_CONTACT, OP_ADD_CONTACT},
+  {DELETE_CONTACT, OP_DELETE_CONTACT},
+  {CONTACT_LIST, OP_CONTACT_LIST},
+  {PERSONAL_MESSAGE, OP_PERSONAL_MESSAGE},
+  {GROUP_MESSAGE, OP_GROUP_MESSAGE},
+  {HISTORY, OP_HISTORY},
+};
+
+/* The newest message seen in a conversation, acknowledged once nothing more is buffered */
+typedef struct {
+  char name[STR_SIZE + 1];
+  uint64_t seq;
+  uint64_t acked;
+} conversation_t;
 
 volatile sig_atomic_t flag = 0;
 int sockfd = 0;
@@ -39,9 +64,14 @@ char name[STR_SIZE];
 char pswd[STR_SIZE];
 char buff[64];
 char action[STR_SIZE];
-char status[STR_SIZE];
-char groups_list[2048];
 char groups[1024];
+char recv_buf[FRAME_HDR + FRAME_MAX_PAYLOAD];
+frame_parser_t parser;
+conversation_t conversations[MAX_CONVERSATIONS];
+int conversation_count = 0;
+char token[64];
+struct sockaddr_in server_addr;
+pthread_mutex_t send_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 void str_overwrite_stdout() {
   printf("%s", "> ");
@@ -73,6 +103,91 @@ void trim_trailing_spaces(char * str) {
     str[index + 1] = '\0';
 }
 
+/* Opcode of the command keyword the message starts with, 0 for plain chat */
+uint8_t command_opcode(char *message, char **args) {
+  size_t n = strcspn(message, " ");
+
+  for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+    if (strlen(commands[i].keyword) == n && strncmp(message, commands[i].keyword, n) == 0) {
+      *args = message[n] != '\0' ? message + n + 1 : message + n;
+      return commands[i].opcode;
+    }
+  }
+
+  return 0;
+}
+
+/* Both threads send once logged in, a frame has to go out whole */
+int send_frame(uint8_t opcode, const void *payload, size_t len) {
+  pthread_mutex_lock(&send_mutex);
+  int result = frame_send(sockfd, opcode, payload, len);
+  pthread_mutex_unlock(&send_mutex);
+  return result;
+}
+
+/* Remember the newest message seen in a conversation */
+void conversation_seen(const char *name, uint64_t seq) {
+  int i = 0;
+  while (i < conversation_count && strcmp(conversations[i].name, name) != 0) {
+    i++;
+  }
+  if (i == conversation_count) {
+    if (conversation_count == MAX_CONVERSATIONS) {
+      return;
+    }
+    snprintf(conversations[i].name, sizeof(conversations[i].name), "%s", name);
+    conversations[i].seq = 0;
+    conversations[i].acked = 0;
+    conversation_count++;
+  }
+  if (seq > conversations[i].seq) {
+    conversations[i].seq = seq;
+  }
+}
+
+/* Acknowledge the conversations with messages seen since the last time */
+void send_acks() {
+  char buffer[BUFFER_SZ];
+  size_t len = 0;
+
+  for (int i = 0; i < conversation_count; i++) {
+    conversation_t *c = &conversations[i];
+    if (c->seq == c->acked) {
+      continue;
+    }
+    if (len + STR_SIZE + 24 > sizeof(buffer)) {
+      send_frame(OP_ACK, buffer, len);
+      len = 0;
+    }
+    len += sprintf(buffer + len, "%s %llu\n", c->name, (unsigned long long)c->seq);
+    c->acked = c->seq;
+  }
+  if (len > 0) {
+    send_frame(OP_ACK, buffer, len);
+  }
+}
+
+/* Show a frame, a conversation message without its first line */
+void show_frame(frame_t *frame) {
+  char conv[STR_SIZE + 1];
+  uint64_t seq;
+  size_t text = 0;
+
+  if (frame->opcode == OP_TOKEN) {
+    snprintf(token, sizeof(token), "%.*s", (int)frame->len, frame->payload);
+    return;
+  }
+
+  if (frame->opcode == OP_SEQ_TEXT && frame_seq(frame->payload, frame->len, conv, sizeof(conv), &seq, &text) == 0) {
+    conversation_seen(conv, seq);
+    if (text == frame->len) {
+      return;
+    }
+  }
+  printf("%.*s", (int)(frame->len - text), frame->payload + text);
+  str_overwrite_stdout();
+}
+
 void catch_ctrl_c_and_exit(int sig) {
     flag = 1;
 }
@@ -86,21 +201,18 @@ void send_msg_handler() {
     fgets(message, LENGTH, stdin);
     str_trim_lf(message, LENGTH);
 
+    char *args;
+    uint8_t opcode = command_opcode(message, &args);
+
     if (strcmp(message, "exit") == 0) {
 			break;
-    } else if(strcmp(message, CONTACT_LIST) == 0 || strncmp(message, ADD_CONTACT, strlen(ADD_CONTACT)) == 0
-        || strncmp(message, DELETE_GROUP, strlen(DELETE_GROUP)) == 0
-        || strncmp(message, CREATE_GROUP, strlen(CREATE_GROUP)) == 0
-        || strncmp(message, ENTER_GROUP, strlen(ENTER_GROUP)) == 0
-        || strncmp(message, PERSONAL_MESSAGE, strlen(PERSONAL_MESSAGE)) == 0
-        || strncmp(message, DELETE_GROUP, strlen(DELETE_GROUP)) == 0
-        || strncmp(message, GROUP_MESSAGE, strlen(GROUP_MESSAGE)) == 0
-        || strncmp(message, DELETE_CONTACT, strlen(DELETE_CONTACT)) == 0
-        || strcmp(message, SHOW_GROUPS) == 0) {
-      send(sockfd, message, strlen(message), 0);
+    } else if(opcode != 0) {
+      send_frame(opcode, args, strlen(args));
     } else {
-      sprintf(buffer, "%s: %s\n", name, message);
-      send(sockfd, buffer, strlen(buffer), 0);
+      /* The server takes payloads of up to BUFFER_SZ bytes, a longer line is cut to fit */
+      int room = BUFFER_SZ - (int)strlen(name) - 3;
+      int len = snprintf(buffer, sizeof(buffer), "%s: %.*s\n", name, room, message);
+      send_frame(OP_CHAT, buffer, len);
     }
 
 		bzero(message, LENGTH);
@@ -109,19 +221,83 @@ void send_msg_handler() {
   catch_ctrl_c_and_exit(2);
 }
 
+/* The connection dropped: connect again and pick the session up with the token. The cursors tell
+ * the server what was shown already, so only the rest comes again. 0 once logged in */
+int reconnect() {
+  char buffer[BUFFER_SZ];
+  frame_t frame;
+
+  if (token[0] == '\0') {
+    return -1;
+  }
+
+  for (int attempt = 0; attempt < RECONNECT_TRIES && !flag; attempt++) {
+    if (attempt > 0) {
+      sleep(1);
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      continue;
+    }
+
+    size_t len = snprintf(buffer, sizeof(buffer), "%s\n", token);
+    for (int i = 0; i < conversation_count && len + STR_SIZE + 24 <= sizeof(buffer); i++) {
+      len += sprintf(buffer + len, "%s %llu\n", conversations[i].name, (unsigned long long)conversations[i].seq);
+    }
+    frame_parser_init(&parser, recv_buf, sizeof(recv_buf));
+    if (frame_send(fd, OP_SESSION, buffer, len) < 0 || frame_recv(fd, &parser, &frame) <= 0) {
+      close(fd);
+      continue;
+    }
+    if (frame.opcode != OP_OK) {
+      printf("%.*s", frame.len, frame.payload);
+      close(fd);
+      return -1;
+    }
+
+    pthread_mutex_lock(&send_mutex);
+    close(sockfd);
+    sockfd = fd;
+    pthread_mutex_unlock(&send_mutex);
+    printf("\nReconnected\n");
+    str_overwrite_stdout();
+    return 0;
+  }
+  return -1;
+}
+
 void recv_msg_handler() {
-	char message[LENGTH] = {};
+  frame_t frame;
+
   while (1) {
-		int receive = recv(sockfd, message, LENGTH, 0);
-    if (receive > 0) {
-      printf("%s", message);
-      str_overwrite_stdout();
-    } else if (receive == 0) {
-			break;
-    } else {
-			// -1
-		}
-		memset(message, 0, sizeof(message));
+    int ready = frame_next(&parser, &frame);
+    if (ready < 0) {
+      break;
+    }
+    if (ready > 0) {
+      show_frame(&frame);
+      continue;
+    }
+
+    /* Everything received so far is shown, acknowledge it before waiting for more */
+    send_acks();
+
+    size_t space;
+    char *dst = frame_space(&parser, &space);
+    ssize_t n = recv(sockfd, dst, space, 0);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (flag || reconnect() < 0) {
+        break;
+      }
+      continue;
+    }
+    frame_commit(&parser, n);
   }
 }
 
@@ -144,8 +320,6 @@ int main(int argc, char **argv){
 		return EXIT_FAILURE;
 	}
 
-  struct sockaddr_in server_addr;
-
 	/* Socket settings */
 	sockfd = socket(AF_INET, SOCK_STREAM, 0);
   server_addr.sin_family = AF_INET;
@@ -160,8 +334,11 @@ int main(int argc, char **argv){
 		return EXIT_FAILURE;
 	}
 
+  frame_parser_init(&parser, recv_buf, sizeof(recv_buf));
+  frame_t frame;
+
   // Sending action to server
-  send(sockfd, action, STR_SIZE, 0);
+  frame_send(sockfd, strcmp(action,REGISTER)==0 ? OP_REGISTER : OP_LOGIN, NULL, 0);
 
 	if (strcmp(action,REGISTER)==0){
 
@@ -179,7 +356,7 @@ int main(int argc, char **argv){
 			return EXIT_FAILURE;
 		}
 
-    send(sockfd, name, STR_SIZE, 0);
+    frame_send(sockfd, OP_NAME, name, strlen(name));
 
 		// password
 		printf("Please enter a password (max 30 characters)\n");
@@ -193,14 +370,18 @@ int main(int argc, char **argv){
 			return EXIT_FAILURE;
 		}
 
-    send(sockfd, pswd, STR_SIZE, 0);
+    frame_send(sockfd, OP_PASSWORD, pswd, strlen(pswd));
+
+    if(frame_recv(sockfd, &parser, &frame) <= 0) {
+      printf("ERROR: connection lost\n");
+      return EXIT_FAILURE;
+    }
 
-    recv(sockfd, groups_list, BUFFER_SZ, 0);
-    if(strcmp(groups_list,USERNAME_ERROR)!=0) {
+    if(frame.opcode == OP_GROUP_LIST) {
       printf("Please choose groups to join out of the following: \n");
       printf("(Type in names of groups, COMMA SEPARATED)\n");
 
-      printf("%s\n", groups_list);
+      printf("%.*s\n", frame.len, frame.payload);
   		fgets(groups, 1024, stdin);
 
     	str_trim_lf(groups, strlen(groups));
@@ -210,22 +391,20 @@ int main(int argc, char **argv){
         printf("Groups must be less than 1024 and more than 2 characters.\n");
         return EXIT_FAILURE;
       }
-      send(sockfd, groups, 1024, 0);
+      frame_send(sockfd, OP_GROUPS, groups, strlen(groups));
 
-      recv(sockfd, status, STR_SIZE, 0);
-    } else {
-      printf(USERNAME_ERROR);
-      printf("Register failed.\n");
-      return EXIT_FAILURE;
+      if(frame_recv(sockfd, &parser, &frame) <= 0) {
+        printf("ERROR: connection lost\n");
+        return EXIT_FAILURE;
+      }
     }
 
-    if(strcmp(status,GROUP_ERROR)==0){
-      printf(GROUP_ERROR);
+    if(frame.opcode != OP_OK){
+      printf("%.*s", frame.len, frame.payload);
       printf("Register failed.\n");
       return EXIT_FAILURE;
-    } else if(strncmp(status,REGISTER_SUCCESS,24)==0) {
-      printf("%s\n", status );
     }
+    printf("%.*s\n", frame.len, frame.payload);
 
 	}
 	else if (strcmp(action,LOGIN)==0){
@@ -244,7 +423,10 @@ int main(int argc, char **argv){
 			return EXIT_FAILURE;
 		}
 
-    send(sockfd, name, STR_SIZE, 0);
+    frame_send(sockfd, OP_NAME, name, strlen(name));
+
+    /* Resume without cursors of our own, from what this user acknowledged last time */
+    frame_send(sockfd, OP_RESUME, NULL, 0);
 
 		// password
 		printf("Please enter your password (max 30 characters)\n");
@@ -258,15 +440,16 @@ int main(int argc, char **argv){
 			return EXIT_FAILURE;
 		}
 
-    send(sockfd, pswd, STR_SIZE, 0);
+    frame_send(sockfd, OP_PASSWORD, pswd, strlen(pswd));
 
-    recv(sockfd, status, STR_SIZE, 0);
+    if(frame_recv(sockfd, &parser, &frame) <= 0) {
+      printf("ERROR: connection lost\n");
+      return EXIT_FAILURE;
+    }
 
-    if(strcmp(status,LOGIN_ERROR)==0) {
-      printf(LOGIN_ERROR);
+    printf("%.*s", frame.len, frame.payload);
+    if(frame.opcode != OP_OK) {
       return EXIT_FAILURE;
-    } else if(strcmp(status, LOGIN_SUCCESS)==0) {
-      printf(LOGIN_SUCCESS);
     }
 	}
 
@@ -282,6 +465,7 @@ int main(int argc, char **argv){
   printf("7. Show contact list (%s)\n", CONTACT_LIST);
   printf("8. Send personal message to contact (%s <contact_name> <message>)\n",PERSONAL_MESSAGE);
   printf("9. Send message to group (%s <group_name> <message>)\n",GROUP_MESSAGE);
+  printf("10. Show group history (%s <group_name> [N | since <n>], %s @ for personal messages)\n",HISTORY,HISTORY);
   printf("=================================================================\n");
 
 	pthread_t send_msg_thread;
@@ -0,0 +1,224 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ * Wire protocol shared by server and client.
+ *
+ * Every message is a frame: a 4 byte header followed by the payload.
+ *   byte 0    protocol version
+ *   byte 1    opcode
+ *   byte 2-3  payload length, network byte order
+ * Payloads are raw bytes, text is not NUL terminated on the wire.
+ *
+ * Group and personal messages come as OP_SEQ_TEXT: a first line "<conversation> <seq>", then the
+ * text. The conversation is "#<group>", or "@" for the personal messages a user receives, and seq
+ * goes up by one per message in it. A client acknowledges with OP_ACK lines of the same form, and
+ * may send them as OP_RESUME between OP_NAME and OP_PASSWORD to get what it missed replayed.
+ *
+ * After a login the server sends OP_TOKEN. A client that lost its connection may send OP_SESSION
+ * instead of OP_LOGIN, OP_NAME and OP_PASSWORD: the token on the first line, then cursors as in
+ * OP_RESUME. The reply is OP_OK, the token staying good for the new connection, or OP_ERROR if it
+ * is unknown or expired.
+ */
+
+#define PROTO_VERSION 1
+#define FRAME_HDR 4
+#define FRAME_MAX_PAYLOAD 65535
+
+/* Client to server */
+#define OP_REGISTER 1
+#define OP_LOGIN 2
+#define OP_NAME 3
+#define OP_PASSWORD 4
+#define OP_GROUPS 5
+#define OP_CHAT 6
+#define OP_CREATE_GROUP 7
+#define OP_DELETE_GROUP 8
+#define OP_ENTER_GROUP 9
+#define OP_SHOW_GROUPS 10
+#define OP_ADD_CONTACT 11
+#define OP_DELETE_CONTACT 12
+#define OP_CONTACT_LIST 13
+#define OP_PERSONAL_MESSAGE 14
+#define OP_GROUP_MESSAGE 15
+#define OP_HISTORY 16
+#define OP_ACK 17
+#define OP_RESUME 18
+#define OP_SESSION 19
+
+/* Server to client */
+#define OP_TEXT 64
+#define OP_GROUP_LIST 65
+#define OP_OK 66
+#define OP_ERROR 67
+#define OP_SEQ_TEXT 68
+#define OP_TOKEN 69
+
+/* One decoded frame, payload points into the parser buffer */
+typedef struct{
+	uint8_t opcode;
+	uint16_t len;
+	char *payload;
+} frame_t;
+
+/* Incremental parser, bytes are read straight into buf */
+typedef struct{
+	char *buf;
+	size_t cap;    /* header plus the largest payload accepted */
+	size_t start;  /* first byte not consumed yet */
+	size_t len;    /* bytes buffered after start */
+} frame_parser_t;
+
+static inline void frame_parser_init(frame_parser_t *p, char *buf, size_t cap){
+	p->buf = buf;
+	p->cap = cap;
+	p->start = 0;
+	p->len = 0;
+}
+
+/* Free space to recv() into, compacting consumed frames first */
+static inline char *frame_space(frame_parser_t *p, size_t *space){
+	if(p->start > 0) {
+		memmove(p->buf, p->buf + p->start, p->len);
+		p->start = 0;
+	}
+	*space = p->cap - p->len;
+	return p->buf + p->len;
+}
+
+/* Account for n bytes received into frame_space() */
+static inline void frame_commit(frame_parser_t *p, size_t n){
+	p->len += n;
+}
+
+/* Pop the next complete frame: 1 if one is ready, 0 if more bytes are needed, -1 on a bad frame */
+static inline int frame_next(frame_parser_t *p, frame_t *f){
+	unsigned char *hdr = (unsigned char *)p->buf + p->start;
+
+	if(p->len < FRAME_HDR) {
+		return 0;
+	}
+
+	size_t len = ((size_t)hdr[2] << 8) | hdr[3];
+	if(hdr[0] != PROTO_VERSION || FRAME_HDR + len > p->cap) {
+		return -1;
+	}
+	if(p->len < FRAME_HDR + len) {
+		return 0;
+	}
+
+	f->opcode = hdr[1];
+	f->len = len;
+	f->payload = p->buf + p->start + FRAME_HDR;
+
+	p->start += FRAME_HDR + len;
+	p->len -= FRAME_HDR + len;
+	if(p->len == 0) {
+		p->start = 0;
+	}
+	return 1;
+}
+
+/* Write a frame header for a payload of len bytes */
+static inline void frame_header(unsigned char *hdr, uint8_t opcode, size_t len){
+	hdr[0] = PROTO_VERSION;
+	hdr[1] = opcode;
+	hdr[2] = (len >> 8) & 0xff;
+	hdr[3] = len & 0xff;
+}
+
+/* Split an OP_SEQ_TEXT payload into its conversation, sequence number and the offset of the text.
+ * -1 if the first line is not a conversation and a number */
+static inline int frame_seq(const char *payload, size_t len, char *conv, size_t conv_size, uint64_t *seq, size_t *text){
+	const char *nl = (const char *)memchr(payload, '\n', len);
+	const char *sp = nl != NULL ? (const char *)memchr(payload, ' ', nl - payload) : NULL;
+
+	if(sp == NULL || sp == payload || sp + 1 == nl || (size_t)(sp - payload) >= conv_size) {
+		return -1;
+	}
+	*seq = 0;
+	for(const char *p = sp + 1; p < nl; p++) {
+		if(*p < '0' || *p > '9') {
+			return -1;
+		}
+		*seq = *seq * 10 + (*p - '0');
+	}
+	memcpy(conv, payload, sp - payload);
+	conv[sp - payload] = '\0';
+	*text = nl + 1 - payload;
+	return 0;
+}
+
+/* Send one whole frame, -1 on error */
+static inline int frame_send(int fd, uint8_t opcode, const void *payload, size_t len){
+	unsigned char hdr[FRAME_HDR];
+	struct iovec iov[2];
+	struct msghdr msg;
+
+	if(len > FRAME_MAX_PAYLOAD) {
+		len = FRAME_MAX_PAYLOAD;
+	}
+	frame_header(hdr, opcode, len);
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = FRAME_HDR;
+	iov[1].iov_base = (void *)payload;
+	iov[1].iov_len = len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	while(msg.msg_iovlen > 0) {
+		ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+
+		/* Short write, skip what went out */
+		while(msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+			n -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if(msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+			msg.msg_iov->iov_len -= n;
+		}
+	}
+
+	return 0;
+}
+
+/* Block until a whole frame has arrived, -1 on error or disconnect */
+static inline int frame_recv(int fd, frame_parser_t *p, frame_t *f){
+	while(1) {
+		int ready = frame_next(p, f);
+		if(ready != 0) {
+			return ready;
+		}
+
+		size_t space;
+		char *dst = frame_space(p, &space);
+		ssize_t n = recv(fd, dst, space, 0);
+		if(n <= 0) {
+			if(n < 0 && errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		frame_commit(p, n);
+	}
+}
+
+#endif
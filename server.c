@@ -1,5 +1,7 @@
+#define _GNU_SOURCE
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,58 +10,608 @@
 #include <string.h>
 #include <pthread.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
 #include <signal.h>
-
-#define MAX_CLIENTS 100
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/random.h>
+#include <poll.h>
+#include <dirent.h>
+#include <linux/io_uring.h>
+
+#include "protocol.h"
+
+#define MAX_CLIENTS 262144
+#define MAX_EVENTS 256
 #define BUFFER_SZ 2048
+#define GROUPS_SZ 1024
 #define STR_SIZE 32
-#define MAX_CONTACTS 32
-#define MAX_GROUPS 10
-#define MAX_CLIENTS_PER_GROUP 10
+#define COMPACT_RECORDS 10000
+#define COMPACT_INTERVAL 60
+#define MAX_PAUSE 8
+#define FLUSH_IOV 64 /* queued messages per sendmsg */
+#define URING_ENTRIES 1024
+#define URING_BUFS 512 /* receive buffers per ring, a power of two */
+#define URING_BUF_SZ BUFFER_SZ
+#define POOL_SLAB 65536 /* bytes a pool carves at once */
+#define POOL_CACHE 64 /* freed objects a thread keeps per pool at most */
+#define POOL_CACHE_BYTES 16384 /* and no more bytes than this, except for two objects */
+#define REPLAY_CHUNK 65536 /* frames read back from a history segment into one message on replay */
+#define HISTORY_RING 64 /* recent messages per group served from memory */
+#define HISTORY_SEGMENT (1024 * 1024) /* bytes of a group's history segment before the next one starts */
+#define HISTORY_SEGMENTS 16 /* segments a group keeps, the oldest goes when another starts */
+#define HISTORY_STRIDE 64 /* messages between two offsets in a segment's index */
+#define HISTORY_DEFAULT 20 /* messages a history command returns when it does not say */
+#define HISTORY_MAX 500 /* and at most */
+#define RESUME_MAX 65536 /* bytes of cursors a client may send with its login */
+#define RESUME_ROUNDS 4 /* replays from the logs before what is left in memory is queued with the users lock held */
+#define SESSION_TOKEN 16 /* random bytes in a session token, sent as hex */
+#define SESSION_BUCKETS 65536 /* hash buckets of the session cache, a power of two */
+#define SESSION_TTL 300 /* seconds a token stays good once its connection is gone */
+#define SESSION_LIFETIME 86400 /* seconds a token is good at most after it was issued, held or not */
+#define SESSION_SWEEP 60 /* seconds between sweeps of the expired tokens out of the session cache */
 
 static _Atomic unsigned int cli_count = 0;
 static _Atomic unsigned int group_count = 0;
-static int uid = 10;
+static _Atomic int uid = 10;
 
 static const char USERNAME_ERROR[] = "Username already exists.\n";
 static const char REGISTER_SUCCESS[] = "Registered successfully.\n";
 static const char LOGIN_ERROR[] = "Log in failed.\n";
 static const char LOGIN_SUCCESS[] = "Logged in successfully.\n";
+static const char SESSION_ERROR[] = "Session expired, log in again.\n";
 static const char GROUP_ERROR[] = "No valid group names found.\n";
 
-static const char REGISTER[] = "R";
-static const char LOGIN[] = "L";
+static const char JOURNAL_FILE[] = "journal.txt";
+static const char JOURNAL_OLD_FILE[] = "journal.txt.old";
+static const char ACKS_FILE[] = "acks.txt";
+static const char SNAPSHOT_FILE[] = "chatroom.snap";
+static const char SNAPSHOT_MAGIC[8] = "CHATSNAP";
+static const char HISTORY_DIR[] = "history";
+#define SNAPSHOT_VERSION 2
+
+static const char MODE_THREAD[] = "thread";
+static const char MODE_EPOLL[] = "epoll";
+static const char MODE_URING[] = "uring";
+
+/* Login dialogue states, the client sends one field frame per state */
+enum {
+	STATE_ACTION,
+	STATE_REGISTER_NAME,
+	STATE_REGISTER_PSWD,
+	STATE_REGISTER_GROUPS,
+	STATE_LOGIN_NAME,
+	STATE_LOGIN_PSWD,
+	STATE_CHAT
+};
+
+/* Set of user ids, open addressing with linear probing. Slots hold id + 1, 0 is free */
+typedef struct{
+	int *slots;
+	int cap;   /* a power of two, 0 until the first add */
+	int count;
+} id_set_t;
 
-static const char CREATE_GROUP[] = "cgroup";
-static const char DELETE_GROUP[] = "dgroup";
-static const char ENTER_GROUP[] = "egroup";
-static const char SHOW_GROUPS[] = "sgroups";
-static const char ADD_CONTACT[] = "acontact";
-static const char DELETE_CONTACT[] = "dcontact";
-static const char CONTACT_LIST[] = "clist";
-static const char PERSONAL_MESSAGE[] = "pm ";
-static const char GROUP_MESSAGE[] = "mgroup";
+/* Bitset over dense ids, grown on demand. Bits past the last word are clear */
+typedef struct{
+	uint64_t *words;
+	int nwords;
+} bitset_t;
 
-/* Client structure */
+/* The last message of a conversation a user acknowledged */
+typedef struct{
+	int group;    /* group id, -1 for the personal messages */
+	uint64_t seq;
+} ack_t;
+
+/* A user's acknowledgements, one per conversation */
+typedef struct{
+	ack_t *acks;
+	int count;
+} ack_list_t;
+
+/* Registered user, one directory record per line triple of users.txt */
+typedef struct user{
+	int id;
+	char name[STR_SIZE];
+	char pswd[STR_SIZE];
+	id_set_t contacts;
+	bitset_t groups; /* ids of the groups joined */
+	int group_count;
+	struct client *sessions; /* live connections, NULL while offline */
+	struct user *next;
+} user_t;
+
+/* A client found again later by its clients[] slot and uid, it may have left meanwhile */
+typedef struct{
+	int slot;
+	int uid;
+} client_ref_t;
+
+/* An encoded frame, header and payload. Immutable once built and shared by every queue it is on.
+ * A file message holds no bytes: it stands for len bytes of frames in fd, from the offset kept in data */
+typedef struct{
+	_Atomic int refs;
+	int pool;   /* the pool it came from, -1 if it was too big for any */
+	size_t len;
+	int fd;     /* -1 unless it is a file message, which owns the descriptor */
+	char data[];
+} msg_t;
+
+/* io_uring mode: the message header of a send in flight, it has to live until the send completes */
 typedef struct{
+	struct msghdr hdr;
+	struct iovec iov[FLUSH_IOV];
+} uring_send_t;
+
+/* Client structure */
+typedef struct client{
 	struct sockaddr_in address;
 	int sockfd;
 	int uid;
+	int slot;
 	char name[STR_SIZE];
-	char contacts[MAX_CONTACTS][STR_SIZE];
+	char pswd[STR_SIZE];
+	user_t *user;
+	int state;
+	frame_parser_t parser; /* its buffer is borrowed from a pool only while part of a frame is pending */
+
+	/* Outbound queue, a ring of message references drained with non-blocking writes.
+	 * EPOLLOUT is armed on epfd while it is not empty */
+	pthread_mutex_t out_mutex;
+	msg_t **out_ring;
+	unsigned int out_cap;
+	unsigned int out_first;
+	unsigned int out_count;
+	size_t out_off;       /* bytes of the first message already written */
+	size_t out_bytes;     /* bytes still to write */
+	int epfd;
+	uint32_t ev_base;     /* events wanted while the queue is empty */
+	int out_armed;
+	int flush_held;       /* on a thread's deferred list, written at the end of its batch */
+	int closing;
+	_Atomic int congested;
+
+	/* Pause policy: recipients this client overflowed, it is not served until they drain */
+	client_ref_t pause_on[MAX_PAUSE];
+	int pause_count;
+
+	/* Parked: its input is put aside until nothing holds it any more, see client_park() */
+	int parked;
+	struct catchup *catchup; /* what it is still due, see catchup_run() */
+	int catchup_wait;        /* its loop is posted once the queue is empty, guarded by out_mutex */
+	long sync_seq;      /* the journal record its replies wait for */
+	msg_t **replies;    /* replies held until then */
+	int reply_count;
+	int reply_cap;
+	struct client *reap_next;
+	struct client *session_next; /* next connection logged in as the same user */
+	char *resume;                /* cursors sent with the login, NULL unless the client resumes */
+	int acking;                  /* it acknowledges what it saw, see user_ack() */
+	char token[2 * SESSION_TOKEN + 1]; /* session token it got with its login, empty before */
+
+	/* Event modes: the loop serving it, NULL in thread mode. In io_uring mode it owns every operation
+	 * on the socket: a send in flight pins the first out_busy messages, a closed client is freed once
+	 * uring_ops is back to zero, and bytes received while it is parked wait in parked_in */
+	struct event_loop *loop;
+	uring_send_t *out_send;
+	unsigned int out_busy;
+	int uring_ops;
+	int uring_closed;
+	int uring_reading;  /* a receive is armed */
+	char *parked_in;
+	size_t parked_len;
 } client_t;
 
-/* Group structure */
+/*
+ * Group history: the last HISTORY_RING messages in memory, all of them in segment files in
+ * HISTORY_DIR/<group name in hex>/. A segment holds the frames exactly as they were sent and is
+ * named after the sequence number of its first message; its .idx file holds the offset of
+ * every HISTORY_STRIDE-th message, so older pages are found without reading the log.
+ * The history writer puts messages on disk, until then they wait in pending.
+ */
+typedef struct{
+	uint64_t first;
+	uint32_t count;
+	uint32_t size;      /* bytes of whole frames */
+	uint32_t *index;
+	uint32_t index_cap;
+} history_seg_t;
+
+typedef struct history{
+	pthread_mutex_t mutex;
+	char dir[sizeof(HISTORY_DIR) + 2 * STR_SIZE + 1];
+	uint64_t next;                        /* sequence number of the next message, the first is 1 */
+	uint64_t written;                     /* the messages before this one are in the segments */
+	msg_t *ring[HISTORY_RING];            /* message seq at seq % HISTORY_RING, NULL if not loaded */
+	msg_t **pending;                      /* messages written to next - 1, by reference */
+	int pending_count;
+	int pending_cap;
+	int queued;                           /* on the writer's list */
+	int removed;                          /* its group is gone, the writer frees it */
+	history_seg_t segs[HISTORY_SEGMENTS]; /* oldest first */
+	int seg_count;
+	int fd;                               /* the last segment and its index, the writer's */
+	int idx_fd;
+} history_t;
+
+/* Messages from..to-1 of a history planned for sending: older pages from the segments, which stay
+ * open until they are sent, the newest from the ring and what the writer has not got to by
+ * reference. It is queued a part at a time */
 typedef struct{
+	struct replay_page { int fd; off_t off; off_t end; int count; } pages[HISTORY_SEGMENTS];
+	int page_count;
+	msg_t **recent;
+	int recent_count;
+	int page_next;    /* the first page and recent message not queued yet */
+	int recent_next;
+} replay_t;
+
+/* A conversation a client is caught up on at login. It saw everything up to cursor, next is the
+ * first message the replay has not got to yet */
+typedef struct{
+	char conv[STR_SIZE + 1];
+	int group;        /* group id, -1 for the personal messages */
+	uint64_t cursor;
+	uint64_t next;
+} resume_t;
+
+/* A login a client can pick up again with its token instead of the password */
+typedef struct session{
+	char token[2 * SESSION_TOKEN + 1];
+	int user;       /* user id */
+	int holder;     /* uid of the connection that logged in with it last */
+	time_t expires; /* 0 while that connection is open */
+	time_t deadline; /* issued + SESSION_LIFETIME, expires is never later */
+	struct session *next;
+} session_t;
+
+/* Group structure, the id is its slot in groups[] and is never reused */
+typedef struct group{
+	int id;
 	char name[STR_SIZE];
 	char admin[STR_SIZE];
-	client_t users[MAX_CLIENTS_PER_GROUP];
+	/* User ids of every member, online or not: a sorted array while that is smaller,
+	 * then a bitset for good */
+	int *members;
+	int member_count;
+	int member_cap;
+	bitset_t member_bits;
+	history_t *_Atomic history; /* loaded at startup, or made on first use */
+	struct group *next;
 } group_t;
 
+/*
+ * Binary snapshot, mapped read only at startup. Sections follow the header
+ * in this order, every offset is from the start of the file:
+ *   users     user_count snap_user_t records, by user id
+ *   groups    group_count snap_group_t records
+ *   lists     each user's contacts as user ids, followed by its groups as string offsets
+ *   index     bucket_count user ids + 1 (0 is empty), open addressing by hash_name
+ *   strings   NUL terminated names and passwords
+ */
+typedef struct{
+	char magic[8];
+	uint32_t version;
+	uint32_t user_count;
+	uint32_t group_count;
+	uint32_t bucket_count;
+	uint64_t users_off;
+	uint64_t groups_off;
+	uint64_t lists_off;
+	uint64_t lists_count;
+	uint64_t index_off;
+	uint64_t strings_off;
+	uint64_t strings_len;
+} snap_header_t;
+
+typedef struct{
+	uint32_t name;
+	uint32_t pswd;
+	uint32_t lists;
+	uint32_t contact_count;
+	uint32_t group_count;
+} snap_user_t;
+
+typedef struct{
+	uint32_t name;
+	uint32_t admin;
+} snap_group_t;
+
+/*
+ * What a client is due that need not fit in its queue at once: after a login its stored frames and,
+ * when it resumes, the logs of its conversations, or the pages a history command asked for. The
+ * client is parked meanwhile and catchup_run() queues the next part whenever its queue empties
+ */
+typedef struct catchup{
+	int step;
+	int round;
+	int joined;             /* the connection is in its user's sessions */
+	resume_t *convs;
+	int conv_count;
+	int conv_next;          /* the conversation being replayed */
+	replay_t r;
+	unsigned long replayed;
+} catchup_t;
+
+/* io_uring mode: a ring shared with the kernel, driven with raw system calls */
+typedef struct{
+	int fd;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int sq_local;  /* tail including entries the kernel has not been told about */
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* Receive buffers the kernel picks from, handed back once their bytes are parsed */
+	struct io_uring_buf_ring *buf_ring;
+	char *bufs;
+	unsigned short buf_tail;
+
+	int accept_single;  /* the kernel turned a multishot accept down, accept one connection at a time */
+} uring_t;
+
+/* Event loop structure, ring is only set in io_uring mode. Other threads post clients to the
+ * mailbox, the eventfd wakes the loop to write them in io_uring mode or take them up if parked */
+typedef struct event_loop{
+	int epfd;
+	int listenfd;
+	pthread_t tid;
+	uring_t *ring;
+	int wake_fd;
+	uint64_t wake_val;
+	pthread_mutex_t mail_mutex;
+	client_ref_t *mail;
+	int mail_count;
+	int mail_cap;
+	client_ref_t *mail_spare;
+	int mail_spare_cap;
+	client_ref_t *woken;    /* parked clients posted, taken up once the loop is between events */
+	int woken_count;
+	int woken_cap;
+} event_loop_t;
+
+/* What holds a parked client */
+enum { PARK_SYNC = 1, PARK_PAUSE = 2, PARK_CATCHUP = 4 };
+
+/* Steps of a catch-up: the logs conversation by conversation, then a look under the users lock
+ * whether it is done or goes another round. A history command only replays */
+enum { CATCHUP_LOGS, CATCHUP_REPLAY, CATCHUP_JOIN, CATCHUP_DONE };
+
+/* A client parked in strict mode until a journal record is on disk, and the loop to post it to */
+typedef struct{
+	event_loop_t *loop;
+	client_ref_t ref;
+	long seq;
+} sync_wait_t;
+
+/* Pause policy: a sender parked until a recipient it overflowed drains, and the loop to post it to */
+typedef struct{
+	event_loop_t *loop;
+	client_ref_t ref;
+} pause_wait_t;
+
+/* Connected clients by slot. Slots below client_slots have been used, freed ones are reused first */
 client_t *clients[MAX_CLIENTS];
-group_t *groups[MAX_GROUPS];
+int client_slots = 0;
+int free_slots[MAX_CLIENTS];
+int free_slot_count = 0;
+
+event_loop_t *loops;
+
+/* User directory: hash table by name plus the records in registration order.
+ * Users still only in the snapshot have a NULL slot until they are first looked up */
+user_t **user_buckets;
+size_t user_bucket_count = 0;
+user_t **users;
+int user_count = 0;
+int user_cap = 0;
+int user_loaded = 0;
+
+/* Group registry: hash table by name plus the groups by id, deleted groups leave a NULL slot.
+ * Guarded by users_lock like the rest of the directory */
+group_t **group_buckets;
+size_t group_bucket_count = 0;
+group_t **groups;
+int group_slots = 0;
+int group_cap = 0;
+
+/* The mapped snapshot, hdr is NULL when starting from the text files */
+struct {
+	char *base;
+	size_t size;
+	snap_header_t *hdr;
+	snap_user_t *users;
+	snap_group_t *groups;
+	uint32_t *lists;
+	uint32_t *index;
+	char *strings;
+} snap;
+
+/* Compaction writes the binary snapshot instead of the text files */
+int snapshot_binary = 0;
+
+/* Durability of the journal: never fsync, fsync batches, or fsync before replying */
+enum { SYNC_NONE, SYNC_BATCH, SYNC_STRICT };
+int sync_mode = SYNC_BATCH;
+int sync_interval_ms = 10;
+int sync_records = 256;
+
+/* What to do when a connection's outbound queue is full */
+enum { OUT_DROP, OUT_DISCONNECT, OUT_PAUSE };
+int out_policy = OUT_DROP;
+size_t out_limit = 256 * 1024;
+
+/* Cork: hold writes to every client until the end of the batch, not only replies to the sender */
+int out_cork = 0;
+
+/* Clients whose writes this thread holds until its batch of input is handled */
+static __thread int batching = 0;
+static __thread client_t *replying = NULL;
+static __thread client_ref_t *held;
+static __thread int held_count = 0;
+static __thread int held_cap = 0;
+
+/* Event modes: the loop this thread runs */
+static __thread event_loop_t *current_loop = NULL;
+
+/* Thread mode: the flusher's epoll instance, and closed clients it frees once no event can refer to them */
+int flush_epfd = -1;
+client_t *reap_list = NULL;
+
+/* Outbound counters, reported in the server stats */
+struct {
+	_Atomic unsigned long frames;
+	_Atomic unsigned long writes;
+	_Atomic unsigned long held;
+	_Atomic unsigned long dropped;
+	_Atomic unsigned long disconnected;
+	_Atomic unsigned long paused;
+	_Atomic unsigned long deferred;
+	_Atomic unsigned long sendfiles;  /* sendfile calls for file messages */
+	_Atomic unsigned long file_bytes; /* bytes they sent */
+} out_stats;
+
+/* Event loop counters, reported in the server stats */
+struct {
+	_Atomic unsigned long waits;    /* epoll_wait or io_uring_enter calls */
+	_Atomic unsigned long reads;
+	_Atomic unsigned long ring_sends;
+	_Atomic unsigned long wakeups;  /* writes to another loop's eventfd */
+} io_stats;
+
+/* Fixed size object pools. Slabs are carved into objects and never given back; a thread keeps
+ * freed objects for itself and trades them with the shared free list half a cache at a time */
+typedef struct pool_free{
+	struct pool_free *next;
+} pool_free_t;
+
+typedef struct{
+	const char *name;
+	size_t size;
+	pthread_mutex_t mutex;
+	pool_free_t *free;     /* shared free list, guarded by mutex */
+	unsigned long slabs;   /* guarded by mutex */
+	unsigned long carved;  /* objects cut from slabs, guarded by mutex */
+	size_t bytes;          /* guarded by mutex */
+	_Atomic long live;     /* objects handed out and not freed yet */
+} pool_t;
+
+enum { POOL_CLIENT, POOL_INPUT, POOL_SEND, POOL_GROUP, POOL_MSG_SMALL, POOL_MSG_MEDIUM, POOL_MSG_LARGE, POOL_COUNT };
+
+pool_t pools[POOL_COUNT] = {
+	[POOL_CLIENT] = { "clients", sizeof(client_t), PTHREAD_MUTEX_INITIALIZER },
+	[POOL_INPUT] = { "input buffers", FRAME_HDR + BUFFER_SZ, PTHREAD_MUTEX_INITIALIZER },
+	[POOL_SEND] = { "io_uring sends", sizeof(uring_send_t), PTHREAD_MUTEX_INITIALIZER },
+	[POOL_GROUP] = { "groups", sizeof(group_t), PTHREAD_MUTEX_INITIALIZER },
+	[POOL_MSG_SMALL] = { "messages <= 128 B", 128, PTHREAD_MUTEX_INITIALIZER },
+	[POOL_MSG_MEDIUM] = { "messages <= 512 B", 512, PTHREAD_MUTEX_INITIALIZER },
+	[POOL_MSG_LARGE] = { "messages <= 2 KiB", sizeof(msg_t) + FRAME_HDR + BUFFER_SZ + 1, PTHREAD_MUTEX_INITIALIZER },
+};
+
+/* Resident memory when the server started serving, the stats divide what came after by the clients */
+long rss_base = 0;
+
+/* Messages too big for the largest pool, allocated on their own */
+_Atomic long msg_heap_live = 0;
 
-pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+typedef struct{
+	void *objs[POOL_CACHE];
+	int count;
+} pool_cache_t;
+
+static __thread pool_cache_t pool_cache[POOL_COUNT];
+
+/* Mutation journal, owned by the writer thread. journal_records counts records since the last compaction */
+int journal_fd = -1;
+_Atomic int journal_records = 0;
+int journal_rotate = 0;
+
+/* Records queued for the writer, guarded by persist_mutex */
+char *persist_buf;
+size_t persist_len = 0;
+size_t persist_cap = 0;
+int persist_pending = 0;
+long persist_enqueued = 0;
+long persist_durable = 0;
+sync_wait_t *sync_waits;  /* clients parked until their record is durable */
+int sync_wait_count = 0;
+int sync_wait_cap = 0;
+
+/* Persistence counters, reported in the server stats */
+struct {
+	unsigned long records;
+	unsigned long batches;
+	unsigned long max_batch;
+	unsigned long syncs;
+	unsigned long sync_us_total;
+	unsigned long sync_us_max;
+} persist_stats;
+
+/* Histories with messages for the writer, guarded by history_queue_mutex */
+history_t **history_queue;
+int history_queue_count = 0;
+int history_queue_cap = 0;
+/* Personal message histories by user id, loaded on first use. Guarded by history_mutex */
+history_t **personal_logs;
+int personal_log_cap = 0;
+/* Acknowledgements by user id, guarded by ack_mutex */
+ack_list_t *ack_lists;
+int ack_list_cap = 0;
+
+/* Resume counters, reported in the server stats */
+struct {
+	_Atomic unsigned long logins;   /* logins that came with cursors */
+	_Atomic unsigned long replayed; /* messages replayed to them from the logs */
+	_Atomic unsigned long lost;     /* messages the logs dropped before a client got them */
+	_Atomic unsigned long acks;
+} resume_stats;
+
+/* Session tokens by hash, guarded by session_mutex */
+session_t *sessions[SESSION_BUCKETS];
+
+/* Session counters, reported in the server stats. Guarded by session_mutex */
+struct {
+	unsigned long issued;
+	unsigned long reconnects; /* logins with a token */
+	unsigned long rejected;   /* tokens unknown or expired */
+	unsigned long cached;
+} session_stats;
+
+/* Deliveries and lookups read, joins, leaves and mutations write. Writers go first so a busy
+ * chat cannot hold off a login; a thread never takes a read lock it already holds */
+pthread_rwlock_t clients_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+pthread_rwlock_t users_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+pthread_mutex_t compact_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t compact_cond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t persist_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t persist_cond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t reap_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t drain_cond = PTHREAD_COND_INITIALIZER;
+pause_wait_t *pause_waits;  /* senders parked by the pause policy, guarded by drain_mutex */
+int pause_wait_count = 0;
+int pause_wait_cap = 0;
+pthread_cond_t durable_cond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t history_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t history_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t history_queue_cond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t ack_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /* trim \n */
 void str_trim_lf (char* arr, int length) {
@@ -92,1019 +644,5663 @@ void trim_leading(char * str) {
     }
 }
 
-void substring(char s[], char sub[], int pos, int length) {
-   int i = 0;
+/* Copy a single name argument, trimmed and bounded to STR_SIZE */
+void name_arg(char *args, char *name) {
+	trim_leading(args);
+	str_trim_lf(args, strlen(args));
+	snprintf(name, STR_SIZE, "%s", args);
+}
 
-   while (i < length) {
-      sub[i] = s[pos+i-1];
-      i++;
-   }
-   sub[i] = '\0';
+/* Split "<target> <text>" arguments, returns the text */
+char *split_target(char *args, char *target) {
+	trim_leading(args);
+	size_t n = strcspn(args, " ");
+	snprintf(target, STR_SIZE, "%.*s", (int)n, args);
+	return args[n] != '\0' ? args + n + 1 : args + n;
 }
 
-int search_in_file(char *fname, char *str, int ignore) {
-	FILE *fp;
-	int line_num = 1;
-	int find_result = 0;
-	char temp[512];
+/* Hash a user or group name (FNV-1a) */
+unsigned long hash_name(const char *s) {
+	unsigned long h = 2166136261UL;
 
-	if((fp = fopen(fname, "r")) == NULL) {
-		perror(fname);
-		return(-1);
+	while(*s != '\0') {
+		h ^= (unsigned char)*s++;
+		h *= 16777619UL;
 	}
+	return h;
+}
 
-	while(fgets(temp, 512, fp) != NULL) {
-		if(ignore==1 && strncmp(temp,"contacts",8)==0) {
-			line_num++;
-			continue;
-		}
+/* Bit i is set */
+int bitset_test(bitset_t *b, int i) {
+	return i / 64 < b->nwords && (b->words[i / 64] >> (i % 64) & 1);
+}
 
-		if((strstr(temp, str)) != NULL) {
-			find_result++;
-			return line_num;
+/* Set bit i, 1 if it was clear, 0 if it was set already, -1 out of memory */
+int bitset_set(bitset_t *b, int i) {
+	if(i / 64 >= b->nwords) {
+		int n = b->nwords ? b->nwords * 2 : 1;
+		if(n <= i / 64) {
+			n = i / 64 + 1;
 		}
-		line_num++;
+		uint64_t *words = (uint64_t *)realloc(b->words, n * sizeof(uint64_t));
+		if(words == NULL) {
+			return -1;
+		}
+		memset(words + b->nwords, 0, (n - b->nwords) * sizeof(uint64_t));
+		b->words = words;
+		b->nwords = n;
 	}
-
-	if(find_result == 0) {
-		return (-1);
+	if(bitset_test(b, i)) {
+		return 0;
 	}
+	b->words[i / 64] |= 1ULL << (i % 64);
+	return 1;
+}
 
-	if(fp) {
-		fclose(fp);
+/* Clear bit i, 1 if it was set */
+int bitset_clear(bitset_t *b, int i) {
+	if(!bitset_test(b, i)) {
+		return 0;
 	}
-   	return(-1);
+	b->words[i / 64] &= ~(1ULL << (i % 64));
+	return 1;
 }
 
-int contact_exists(char *contact_name, client_t *cl) {
-	int result = -1; // Contact not found
+/* First set bit from i on, -1 if there is none. Clear words are skipped 64 bits at a time */
+int bitset_next(bitset_t *b, int i) {
+	int w = i / 64;
+	if(w >= b->nwords) {
+		return -1;
+	}
 
-	for(int i=0; i<sizeof cl->contacts; i++) {
-		if(strcmp(cl->contacts[i],contact_name) == 0){
-			result = 0; // Contact found
+	uint64_t word = b->words[w] & (~0ULL << (i % 64));
+	while(word == 0) {
+		if(++w == b->nwords) {
+			return -1;
 		}
+		word = b->words[w];
 	}
-
-	return result;
+	return w * 64 + __builtin_ctzll(word);
 }
 
-void print_client_addr(struct sockaddr_in addr){
-    printf("%d.%d.%d.%d",
-        addr.sin_addr.s_addr & 0xff,
-        (addr.sin_addr.s_addr & 0xff00) >> 8,
-        (addr.sin_addr.s_addr & 0xff0000) >> 16,
-        (addr.sin_addr.s_addr & 0xff000000) >> 24);
+void bitset_free(bitset_t *b) {
+	free(b->words);
+	memset(b, 0, sizeof(*b));
 }
 
-/* Add clients to queue */
-void queue_add(client_t *cl){
-	pthread_mutex_lock(&clients_mutex);
+/* Home slot of a user id in a set of cap slots */
+int id_set_slot(int id, int cap) {
+	return ((uint32_t)id * 2654435761u) & (cap - 1);
+}
 
-	for(int i=0; i < MAX_CLIENTS; ++i){
-		if(!clients[i]){
-			clients[i] = cl;
-			break;
+/* The id is in the set */
+int id_set_has(id_set_t *s, int id) {
+	if(s->cap == 0) {
+		return 0;
+	}
+	for(int b = id_set_slot(id, s->cap); s->slots[b] != 0; b = (b + 1) & (s->cap - 1)) {
+		if(s->slots[b] == id + 1) {
+			return 1;
 		}
 	}
+	return 0;
+}
 
-	pthread_mutex_unlock(&clients_mutex);
+/* Put an id into its probe run, the set has a free slot */
+void id_set_put(int *slots, int cap, int id) {
+	int b = id_set_slot(id, cap);
+	while(slots[b] != 0) {
+		b = (b + 1) & (cap - 1);
+	}
+	slots[b] = id + 1;
 }
 
-/* Remove clients from queue */
-void queue_remove(int uid){
-	pthread_mutex_lock(&clients_mutex);
+/* Add an id, 1 if it was added, 0 if it was there already or memory ran out */
+int id_set_add(id_set_t *s, int id) {
+	if(id_set_has(s, id)) {
+		return 0;
+	}
 
-	for(int i=0; i < MAX_CLIENTS; ++i){
-		if(clients[i]){
-			if(clients[i]->uid == uid){
-				clients[i] = NULL;
-				break;
+	/* Kept at most half full so probe runs stay short */
+	if(2 * (s->count + 1) > s->cap) {
+		int cap = s->cap ? s->cap * 2 : 8;
+		int *slots = (int *)calloc(cap, sizeof(int));
+		if(slots == NULL) {
+			return 0;
+		}
+		for(int i=0; i<s->cap; i++) {
+			if(s->slots[i] != 0) {
+				id_set_put(slots, cap, s->slots[i] - 1);
 			}
 		}
+		free(s->slots);
+		s->slots = slots;
+		s->cap = cap;
 	}
 
-	pthread_mutex_unlock(&clients_mutex);
+	id_set_put(s->slots, s->cap, id);
+	s->count++;
+	return 1;
 }
 
-/* Add groups to queue */
-void queue_add_group(group_t *gr){
+/* Remove an id, 1 if it was there */
+int id_set_remove(id_set_t *s, int id) {
+	int mask = s->cap - 1;
+	int hole = -1;
 
-	for(int i=0; i < MAX_GROUPS; ++i){
-		if(!groups[i]){
-			groups[i] = gr;
+	for(int b = s->cap ? id_set_slot(id, s->cap) : 0; s->cap > 0 && s->slots[b] != 0; b = (b + 1) & mask) {
+		if(s->slots[b] == id + 1) {
+			hole = b;
 			break;
 		}
 	}
-}
-
-/* Remove clients from queue */
-void queue_remove_group(char *group_name){
+	if(hole < 0) {
+		return 0;
+	}
 
-	for(int i=0; i < MAX_GROUPS; ++i){
-		if(groups[i]){
-			if(strcmp(groups[i]->name,group_name) == 0){
-				groups[i] = NULL;
-				break;
-			}
+	/* Pull later entries of the probe run back so no lookup stops early at the hole */
+	for(int j = (hole + 1) & mask; s->slots[j] != 0; j = (j + 1) & mask) {
+		int home = id_set_slot(s->slots[j] - 1, s->cap);
+		if(((j - home) & mask) >= ((j - hole) & mask)) {
+			s->slots[hole] = s->slots[j];
+			hole = j;
 		}
 	}
+	s->slots[hole] = 0;
+	s->count--;
+	return 1;
+}
 
+void id_set_free(id_set_t *s) {
+	free(s->slots);
+	memset(s, 0, sizeof(*s));
 }
 
-/* Add clients to group */
-int add_to_group(client_t *cl, char *group_name){
+/* String from the snapshot string table, empty if the offset is bad */
+const char *snap_str(uint32_t off) {
+	return off < snap.hdr->strings_len ? snap.strings + off : "";
+}
 
-	int added = -1; // group_name not found in groups
-	str_trim_lf(group_name,strlen(group_name));
+/* Id of a user in the snapshot index, -1 if it is not there */
+int snapshot_lookup(const char *name) {
+	if(snap.hdr == NULL) {
+		return -1;
+	}
 
-	for(int i=0; i < group_count; ++i){
-		if(strcmp(groups[i]->name,group_name)==0) {
-			added = 0; // group_name found in groups
-			for(int j=0; j < MAX_CLIENTS_PER_GROUP; ++j) {
-				if(strcmp(groups[i]->users[j].name,cl->name) == 0) {
-					added = -2; // client already in group
-					goto DONE;
-				}
-				if(strcmp(groups[i]->users[j].name,"\0") == 0) {
-					strcpy(groups[i]->users[j].name,cl->name);
-					groups[i]->users[j].sockfd = cl->sockfd;
-					groups[i]->users[j].uid = cl->uid;
-					added = 1; // client added to group
-					goto DONE;
-				}
-			}
+	uint32_t mask = snap.hdr->bucket_count - 1;
+	uint32_t b = hash_name(name) & mask;
+	for(uint32_t probes = 0; probes <= mask; probes++, b = (b + 1) & mask) {
+		uint32_t id = snap.index[b];
+		if(id == 0 || id > snap.hdr->user_count) {
+			return -1;
+		}
+		if(strcmp(snap_str(snap.users[id - 1].name), name) == 0) {
+			return id - 1;
 		}
 	}
-
-	DONE:
-	return added;
+	return -1;
 }
 
-/* Send a personal message to a contact */
-int send_pm(char *s, char *contact_name, client_t *cl){
-	pthread_mutex_lock(&clients_mutex);
+/* Group registry and joining, defined with the groups and the other mutations further down */
+group_t *group_find(const char *group_name);
+int user_join_group(user_t *u, group_t *gr);
+int group_add_member(group_t *gr, int id);
+int apply_enter_group(user_t *u, const char *group_name);
 
-	int result = contact_exists(contact_name,cl);
+/* Copy the snapshot record of user id i into u */
+void snapshot_fill(int i, user_t *u) {
+	snap_user_t *r = &snap.users[i];
 
-	if(result == 0) {
-		for(int i=0; i<MAX_CLIENTS; ++i){
-			if(clients[i]){
-				if(strcmp(clients[i]->name,contact_name) == 0){
-					char buffer[BUFFER_SZ];
-					sprintf(buffer,"[PM]%s: %s\n", cl->name, s);
-					if(write(clients[i]->sockfd, buffer, strlen(buffer)) < 0){
-						result = -1; // message not sent
-					}
-					result = 1; // message sent
-					break;
-				}
-			}
+	memset(u, 0, sizeof(*u));
+	u->id = i;
+	snprintf(u->name, STR_SIZE, "%s", snap_str(r->name));
+	snprintf(u->pswd, STR_SIZE, "%s", snap_str(r->pswd));
+
+	if((uint64_t)r->lists + r->contact_count + r->group_count > snap.hdr->lists_count) {
+		return;
+	}
+	uint32_t *list = snap.lists + r->lists;
+	for(int j=0; j<r->contact_count; j++) {
+		if(list[j] < snap.hdr->user_count) {
+			id_set_add(&u->contacts, list[j]);
+		}
+	}
+	list += r->contact_count;
+	for(int j=0; j<r->group_count; j++) {
+		group_t *gr = group_find(snap_str(list[j]));
+		if(gr != NULL) {
+			user_join_group(u, gr);
 		}
 	}
-
-	pthread_mutex_unlock(&clients_mutex);
-	return result;
 }
 
-/* Send group message */
-int send_gm(char *message, char *group_name, client_t *cl){
-	pthread_mutex_lock(&clients_mutex);
-
-	int result = -1; // Group name not found in groups
-	int u_found_in_group = -1; // User not found in group
+/* Snapshot user i is a member of the group, checked without copying the record */
+int snapshot_in_group(int i, const char *group_name) {
+	snap_user_t *r = &snap.users[i];
 
-	char buffer[BUFFER_SZ];
-	sprintf(buffer,"[%s]%s: %s\n",group_name, cl->name, message);
-
-	for(int i=0; i<group_count; i++) {
-		if(strcmp(groups[i]->name,group_name) == 0){
-			result = 0; // Group name found in groups
-			for(int j=0;j<MAX_CLIENTS_PER_GROUP;j++){
-				if(strcmp(groups[i]->users[j].name,cl->name)==0) {
-					u_found_in_group = 0; // User found in group
-				}
-			}
-			if(u_found_in_group == 0) {
-				for(int j=0;j<MAX_CLIENTS_PER_GROUP;j++){
-					if(strcmp(groups[i]->users[j].name,cl->name)!=0 && strcmp(groups[i]->users[j].name,"\0")!=0) {
-						printf("Writing message to user %s with sockfd %d\n",groups[i]->users[j].name,groups[i]->users[j].sockfd );
-						if(write(groups[i]->users[j].sockfd, buffer, strlen(buffer)) < 0){
-							result = -1; // Message not sent to groups[i]->users[j].sockfd
-						}
-						result = 1; // Message sent to groups[i]->users[j].sockfd
-					}
-				}
-			} else {
-				result = -2; // User not found in group
-			}
-		}
-		if(result==0) {
-			break;
+	if((uint64_t)r->lists + r->contact_count + r->group_count > snap.hdr->lists_count) {
+		return 0;
+	}
+	uint32_t *list = snap.lists + r->lists + r->contact_count;
+	for(int j=0; j<r->group_count; j++) {
+		if(strcmp(snap_str(list[j]), group_name) == 0) {
+			return 1;
 		}
 	}
-
-	pthread_mutex_unlock(&clients_mutex);
-	return result;
+	return 0;
 }
 
-/* Send message to all clients except sender */
-void send_message(char *s, int uid){
-	pthread_mutex_lock(&clients_mutex);
+/* Double the hash table once it holds more users than buckets */
+int user_buckets_grow(void) {
+	size_t count = user_bucket_count ? user_bucket_count * 2 : 1024;
+	user_t **buckets = (user_t **)calloc(count, sizeof(user_t *));
+	if(buckets == NULL) {
+		return -1;
+	}
 
-	for(int i=0; i<MAX_CLIENTS; ++i){
-		if(clients[i]){
-			if(clients[i]->uid != uid){
-				if(write(clients[i]->sockfd, s, strlen(s)) < 0){
-					perror("ERROR: write to descriptor failed");
-					break;
-				}
-			}
+	for(int i=0; i<user_count; i++) {
+		user_t *u = users[i];
+		if(u == NULL) {
+			continue;
 		}
+		size_t b = hash_name(u->name) & (count - 1);
+		u->next = buckets[b];
+		buckets[b] = u;
 	}
 
-	pthread_mutex_unlock(&clients_mutex);
+	free(user_buckets);
+	user_buckets = buckets;
+	user_bucket_count = count;
+	return 0;
 }
 
-/* Handle all communication with the client */
-void *handle_client(void *arg){
-	char buff_out[BUFFER_SZ];
-	char buffer[BUFFER_SZ];
-	char name[STR_SIZE];
-	char pswd[STR_SIZE];
-	char action[STR_SIZE];
-	char groups_input[1024];
-	char contact_name[STR_SIZE];
-	int leave_flag = 0;
-	int user_line_found = -1;
-	int user_complete = 1;
-	FILE *file;
-	FILE *temp;
-	FILE *groups_file;
+/* Put a user into the hash table and its id slot */
+int user_insert(user_t *u) {
+	if((size_t)user_loaded >= user_bucket_count && user_buckets_grow() < 0) {
+		return -1;
+	}
 
-	char *line = NULL;
-  size_t len = 0;
-  ssize_t read;
+	size_t b = hash_name(u->name) & (user_bucket_count - 1);
+	u->next = user_buckets[b];
+	user_buckets[b] = u;
+	users[u->id] = u;
+	user_loaded++;
+	return 0;
+}
 
-	cli_count++;
-	client_t *cli = (client_t *)arg;
+/* Free what a user record points to */
+void user_release(user_t *u) {
+	id_set_free(&u->contacts);
+	bitset_free(&u->groups);
+}
+
+/* Copy a snapshot user into the directory on first use */
+user_t *user_materialize(int i) {
+	user_t *u = (user_t *)malloc(sizeof(user_t));
+	if(u == NULL) {
+		return NULL;
+	}
+	snapshot_fill(i, u);
+	if(user_insert(u) < 0) {
+		user_release(u);
+		free(u);
+		return NULL;
+	}
+	return u;
+}
 
-	// Check if Register or Login
-	if(recv(cli->sockfd, action, STR_SIZE, 0) <= 0 || strlen(action) >= STR_SIZE-1){
-		printf("Wrong action input.\n");
-		leave_flag = 1;
-	} else if(strcmp(action,REGISTER)==0){
+/* Look up a user already in the hash table, enough for anyone online. Read lock is fine */
+user_t *user_lookup(const char *name) {
+	user_t *u = NULL;
 
-		file=fopen("users.txt","a+");
-		if(file==NULL) {
-			perror("Error opening file users.txt.\n");
-			leave_flag = 1;
+	if(user_bucket_count > 0) {
+		u = user_buckets[hash_name(name) & (user_bucket_count - 1)];
+		while(u != NULL && strcmp(u->name, name) != 0) {
+			u = u->next;
 		}
+	}
+	return u;
+}
 
-		if(recv(cli->sockfd, name, STR_SIZE, 0) <= 0 || strlen(name) <  2 || strlen(name) >= STR_SIZE-1){
-			printf("Didn't enter the name.\n");
-			leave_flag = 1;
-		} else{
-
-			sprintf(buffer,"%s",name);
-			user_line_found = search_in_file("users.txt",buffer,1);
+/* Id of a registered user without loading it, -1 if there is none. Read lock is fine */
+int user_id(const char *name) {
+	user_t *u = user_lookup(name);
 
-			if(user_line_found > 0) {
-				printf("Username already exists. Disconnecting...\n");
+	if(u != NULL) {
+		return u->id;
+	}
+	return snapshot_lookup(name);
+}
 
-				send(cli->sockfd, USERNAME_ERROR, STR_SIZE, 0);
-				fclose(file);
-				goto EXIT;
-			}
+/* Name of user id i, whether or not it was loaded from the snapshot */
+const char *user_name(int i) {
+	return users[i] != NULL ? users[i]->name : snap_str(snap.users[i].name);
+}
 
-			if(leave_flag != 1) {
-				strcpy(cli->name, name);
-				sprintf(buff_out, "%s registering now\n", cli->name);
-				printf("%s", buff_out);
+/* Look up a registered user, call with users_lock held for writing since it may load the user from the snapshot */
+user_t *user_find(const char *name) {
+	user_t *u = user_lookup(name);
 
-				// Password
-				if(recv(cli->sockfd, pswd, STR_SIZE, 0) <= 0 || strlen(pswd) <  2 || strlen(pswd) >= STR_SIZE-1){
-					printf("Didn't enter the password.\n");
-					goto EXIT;
-				}
+	if(u == NULL) {
+		int i = snapshot_lookup(name);
+		if(i >= 0 && users[i] == NULL) {
+			u = user_materialize(i);
+		}
+	}
+	return u;
+}
 
-				bzero(buffer,BUFFER_SZ);
+/* A connection logged in as u, call with users_lock held for writing */
+void user_attach(user_t *u, client_t *cli) {
+	cli->user = u;
+	cli->session_next = u->sessions;
+	u->sessions = cli;
+}
 
-				// Ask user to join groups
-				int i;
-				for(i=0;i<group_count;i++) {
-					sprintf(buffer + strlen(buffer), "%d. %s\n", i+1, groups[i]->name);
-					//write(cli->sockfd, buffer, strlen(buffer));
-				}
-				printf("%s\n", buffer);
-				send(cli->sockfd, buffer, BUFFER_SZ, 0);
+/* Drop a connection from its user's sessions, 1 if it was the last one. Call with users_lock held for writing */
+int user_detach(client_t *cli) {
+	int found = 0;
 
-				// groups
-				if(recv(cli->sockfd, groups_input, 1024, 0) <= 0 || strlen(groups_input) <  2 || strlen(groups_input) >= 1024-1){
-					printf("Didn't enter the groups.\n");
-					goto EXIT;
-				}
+	if(cli->user == NULL) {
+		return 0;
+	}
+	for(client_t **p = &cli->user->sessions; *p != NULL; p = &(*p)->session_next) {
+		if(*p == cli) {
+			*p = cli->session_next;
+			found = 1;
+			break;
+		}
+	}
+	cli->session_next = NULL;
+	return found && cli->user->sessions == NULL;
+}
 
-				printf("Groups entered: %s\n",groups_input);
-
-				str_trim_lf(groups_input,strlen(groups_input));
-				trim_leading(groups_input);
-				char *pointer=strtok(groups_input,",");
-				char groups_not_found[MAX_GROUPS][STR_SIZE];
-				char groups_found[MAX_GROUPS][STR_SIZE];
-				int nf=0;
-				int f=0;
-
-				while (pointer != NULL) {
-					int group_found = add_to_group(cli,pointer);
-
-						if(group_found == -1) {
-							strcpy(groups_not_found[nf],pointer);
-							nf++;
-						} else {
-							strcpy(groups_found[f],pointer);
-							f++;
-						}
-						pointer = strtok (NULL, ",");
-				}
+/* User by id, snapshot users that were never looked up are copied into tmp, which the caller releases */
+user_t *user_at(int i, user_t *tmp) {
+	if(users[i] != NULL) {
+		return users[i];
+	}
+	snapshot_fill(i, tmp);
+	return tmp;
+}
 
-				// No valid group names to join found
-				if(f-1 < 0) {
-					printf(GROUP_ERROR);
-					send(cli->sockfd, GROUP_ERROR, BUFFER_SZ, 0);
-					goto EXIT;
-				}
+/* Register a new user, NULL if the name is taken. Call with users_lock held for writing */
+user_t *user_add(const char *name, const char *pswd) {
+	if(user_find(name) != NULL) {
+		return NULL;
+	}
 
-				printf("Saving username...\n");
-				fputs(name,file);
-				fputs(":",file);
-				printf("Saving password...\n");
-				fputs(pswd,file);
-				fputs("\n",file);
-				fputs("contacts:\n",file);
-				fputs("groups:",file);
-				for(int k=0;k<sizeof(groups_found);k++) {
-					if(strcmp(groups_found[k],"\0")==0) {
-						break;
-					} else {
-						fputs(":",file);
-						fputs(groups_found[k],file);
-					}
-				}
-				fputs("\n",file);
-
-				bzero(buffer,BUFFER_SZ);
-				sprintf(buffer+strlen(buffer),"%s", REGISTER_SUCCESS);
-
-				if(nf-1 >= 0) {
-					sprintf(buffer+strlen(buffer),"Groups not joined:");
-					for(int k=0;k<sizeof(groups_not_found);k++) {
-						if(strcmp(groups_not_found[k],"\0")==0) {
-							break;
-						} else {
-							sprintf(buffer+strlen(buffer)," %s ", groups_not_found[k]);
-						}
-					}
-				}
+	if(user_count == user_cap) {
+		int cap = user_cap ? user_cap * 2 : 1024;
+		user_t **grown = (user_t **)realloc(users, cap * sizeof(user_t *));
+		if(grown == NULL) {
+			return NULL;
+		}
+		users = grown;
+		user_cap = cap;
+	}
 
-				send(cli->sockfd, buffer, BUFFER_SZ, 0);
+	user_t *u = (user_t *)calloc(1, sizeof(user_t));
+	if(u == NULL) {
+		return NULL;
+	}
+	u->id = user_count;
+	snprintf(u->name, STR_SIZE, "%s", name);
+	snprintf(u->pswd, STR_SIZE, "%s", pswd);
 
-			}
-			bzero(buffer,BUFFER_SZ);
+	if(user_insert(u) < 0) {
+		free(u);
+		return NULL;
+	}
+	user_count++;
+	return u;
+}
 
-		}
+/* Load every user record from the users file into the directory, after the groups */
+int load_users(const char *fname) {
+	FILE *file;
+	char *line = NULL;
+	size_t len = 0;
+	user_t *u = NULL;
 
-		fclose(file);
+	if((file = fopen(fname, "r")) == NULL) {
+		perror(fname);
+		return -1;
+	}
 
-	} else if(strcmp(action,LOGIN)==0) {
-		// Login
-		printf("Logging in...\n");
+	/* Records are three lines: name:password, contacts:..., groups:... */
+	while(getline(&line, &len, file) != -1) {
+		str_trim_lf(line, strlen(line));
 
-		// Name
-		if(recv(cli->sockfd, name, STR_SIZE, 0) <= 0 || strlen(name) <  2 || strlen(name) >= STR_SIZE-1){
-			printf("Didn't enter the name.\n");
-			leave_flag = 1;
+		if(strncmp(line, "contacts:", 9) == 0) {
+			continue;
+		} else if(strncmp(line, "groups:", 7) == 0) {
+			char *p = strtok(line, ":");
+			while(u != NULL && (p = strtok(NULL, ":")) != NULL) {
+				apply_enter_group(u, p);
+			}
+		} else if(strchr(line, ':') != NULL) {
+			char *pswd = strchr(line, ':');
+			*pswd++ = '\0';
+			u = user_add(line, pswd);
 		}
-		strcpy(cli->name, name);
+	}
 
-		// Password
-		if(recv(cli->sockfd, pswd, STR_SIZE, 0) <= 0 || strlen(pswd) <  2 || strlen(pswd) >= STR_SIZE-1){
-			printf("Didn't enter the password.\n");
-			leave_flag = 1;
+	/* Contacts are kept as user ids, so they are read once every user has one */
+	rewind(file);
+	u = NULL;
+	while(getline(&line, &len, file) != -1) {
+		str_trim_lf(line, strlen(line));
+
+		if(strncmp(line, "contacts:", 9) == 0) {
+			char *p = strtok(line, ":");
+			while(u != NULL && (p = strtok(NULL, ":")) != NULL) {
+				user_t *c = user_find(p);
+				if(c != NULL) {
+					id_set_add(&u->contacts, c->id);
+				}
+			}
+		} else if(strncmp(line, "groups:", 7) != 0 && strchr(line, ':') != NULL) {
+			*strchr(line, ':') = '\0';
+			u = user_find(line);
 		}
+	}
 
-		if(leave_flag != 1) {
-
-			char buff[BUFFER_SZ];
+	free(line);
+	fclose(file);
+	return 0;
+}
 
-			sprintf(buff,"%s:%s",name,pswd);
-			user_line_found = search_in_file("users.txt",buff,1);
+/* Write the users file format for every user, call with users_lock held */
+void write_users(FILE *file) {
+	user_t tmp;
 
-			if(user_line_found > 0) {
-				file = fopen("users.txt","r+");
-				if(file==NULL) {
-					perror("Error opening users.txt\n");
-				}
+	for(int i=0; i<user_count; i++) {
+		user_t *u = user_at(i, &tmp);
 
-				int line_index = 1;
-
-				while ((read = getline(&line, &len, file)) != -1) {
-
-					// Checking line after user found for contacts
-					if(line_index == user_line_found+1 || line_index == user_line_found+2) {
-						char temp_buff[BUFFER_SZ];
-						strcpy(temp_buff,line);
-						char *p=strtok(temp_buff,":");
-						int j = 0;
-						if(strncmp(temp_buff,"contacts",8) == 0) {
-
-					    while (p != NULL) {
-									p = strtok (NULL, ":");
-									if(p != NULL && strcmp(p,"\0") != 0 && strcmp(p,"\n") != 0){
-										str_trim_lf(p,strlen(p));
-										printf("Adding contact %s to user.\n",p );
-										strcpy(cli->contacts[j],p);
-									}
-									j++;
-					    }
-						}
-						else if(strncmp(temp_buff,"groups",6) == 0) {
-							while (p != NULL) {
-									 p = strtok (NULL, ":");
-									 if(p!=NULL) {
-										 int added = add_to_group(cli, p);
-									 }
-
-							 }
-						 }
-					}
-					line_index++;
-				}
+		fprintf(file, "%s:%s\ncontacts:", u->name, u->pswd);
+		for(int j=0; j<u->contacts.cap; j++) {
+			if(u->contacts.slots[j] != 0) {
+				fprintf(file, ":%s", user_name(u->contacts.slots[j] - 1));
+			}
+		}
+		fputs("\ngroups:", file);
+		for(int g = bitset_next(&u->groups, 0); g >= 0; g = bitset_next(&u->groups, g + 1)) {
+			fprintf(file, ":%s", groups[g]->name);
+		}
+		fputs("\n", file);
+		if(u == &tmp) {
+			user_release(&tmp);
+		}
+	}
+}
 
-				fclose(file);
+/* Replace a file with new contents through a temp file and rename */
+int write_file(const char *fname, const char *data, size_t len) {
+	char tmp_name[256];
+	FILE *file;
 
-				strcpy(cli->name, name);
-				sprintf(buff_out, "User %s logged in\n", cli->name);
-				printf("%s", buff_out);
-				send(cli->sockfd, LOGIN_SUCCESS, STR_SIZE, 0);
-			} else {
-				printf("User not found.\n");
-				send(cli->sockfd, LOGIN_ERROR, STR_SIZE, 0);
-				goto EXIT;
-			}
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", fname);
+	if((file = fopen(tmp_name, "w")) == NULL) {
+		perror(tmp_name);
+		return -1;
+	}
 
-		}
+	if(fwrite(data, 1, len, file) != len || fflush(file) != 0
+		|| (sync_mode != SYNC_NONE && fsync(fileno(file)) < 0)) {
+		perror(tmp_name);
+		fclose(file);
+		return -1;
+	}
+	if(fclose(file) != 0) {
+		perror(tmp_name);
+		return -1;
+	}
+	return rename(tmp_name, fname);
+}
 
+/* Make renames in the working directory durable */
+void sync_dir(void) {
+	if(sync_mode == SYNC_NONE) {
+		return;
 	}
 
-	bzero(buff_out, BUFFER_SZ);
+	int dirfd = open(".", O_RDONLY);
+	if(dirfd >= 0) {
+		fsync(dirfd);
+		close(dirfd);
+	}
+}
 
-	while(1){
-		if (leave_flag) {
-			break;
+/* Ask the loop serving a client to look at it, from any thread. -1 if it could not be posted */
+int loop_post(event_loop_t *loop, int slot, int uid){
+	pthread_mutex_lock(&loop->mail_mutex);
+	if(loop->mail_count == loop->mail_cap) {
+		int cap = loop->mail_cap ? loop->mail_cap * 2 : 64;
+		client_ref_t *grown = (client_ref_t *)realloc(loop->mail, cap * sizeof(client_ref_t));
+		if(grown == NULL) {
+			pthread_mutex_unlock(&loop->mail_mutex);
+			return -1;
+		}
+		loop->mail = grown;
+		loop->mail_cap = cap;
+	}
+	loop->mail[loop->mail_count].slot = slot;
+	loop->mail[loop->mail_count].uid = uid;
+	int first = ++loop->mail_count == 1;
+	pthread_mutex_unlock(&loop->mail_mutex);
+
+	/* One wakeup covers everything posted until the loop reads the mailbox */
+	if(first) {
+		uint64_t one = 1;
+		if(write(loop->wake_fd, &one, sizeof(one)) < 0) {
+			perror("ERROR: eventfd write failed");
 		}
+		io_stats.wakeups++;
+	}
+	return 0;
+}
 
-		int receive = recv(cli->sockfd, buff_out, BUFFER_SZ, 0);
-		if(strncmp(buff_out,CREATE_GROUP,strlen(CREATE_GROUP)) == 0) {
+void print_client_addr(struct sockaddr_in addr){
+    printf("%d.%d.%d.%d",
+        addr.sin_addr.s_addr & 0xff,
+        (addr.sin_addr.s_addr & 0xff00) >> 8,
+        (addr.sin_addr.s_addr & 0xff0000) >> 16,
+        (addr.sin_addr.s_addr & 0xff000000) >> 24);
+}
 
-			char group_name[STR_SIZE];
-			substring(buff_out, group_name, strlen(CREATE_GROUP)+1, strlen(buff_out));
-			trim_leading(group_name);
-			str_trim_lf(group_name,strlen(group_name));
+/* Ask for EPOLLOUT while the queue holds data, call with out_mutex held. A parked client is not read */
+void client_arm(client_t *cli, int on){
+	struct epoll_event ev;
 
-			bzero(buffer,BUFFER_SZ);
-			sprintf(buffer,"%s:%s",group_name,cli->name);
-			int group_line_num = search_in_file("groups.txt",buffer,0);
+	/* io_uring mode has no epoll set, a send in flight plays the part of EPOLLOUT */
+	if(cli->epfd < 0) {
+		return;
+	}
 
-			if(group_line_num == -1) {
-				groups_file = fopen("groups.txt","a+");
-				if(groups_file==NULL) {
-					perror("Error opening groups.txt\n");
-				}
+	ev.events = (cli->parked ? cli->ev_base & ~EPOLLIN : cli->ev_base) | (on ? EPOLLOUT : 0);
+	ev.data.ptr = cli;
+	if(epoll_ctl(cli->epfd, EPOLL_CTL_MOD, cli->sockfd, &ev) < 0) {
+		perror("ERROR: epoll_ctl failed");
+	}
+	cli->out_armed = on;
+}
 
-				bzero(buffer, BUFFER_SZ);
-				sprintf(buffer,"%s:%s\n",group_name,cli->name);
-				fputs(buffer,groups_file);
+/* Objects are 16 byte aligned within a slab */
+size_t pool_stride(pool_t *p){
+	return (p->size + 15) & ~(size_t)15;
+}
 
-				group_t *gr = (group_t *)malloc(sizeof(group_t));
-				strcpy(gr->name,group_name);
-				strcpy(gr->admin,cli->name);
-				queue_add_group(gr);
-				group_count++;
+/* Objects a thread may keep for itself, fewer of the big ones */
+int pool_cache_limit(pool_t *p){
+	size_t n = POOL_CACHE_BYTES / pool_stride(p);
+	return n < 2 ? 2 : n > POOL_CACHE ? POOL_CACHE : (int)n;
+}
 
-				fclose(groups_file);
+/* Fill half of a thread's cache from the shared list, carving a new slab when that is empty */
+int pool_refill(pool_t *p, pool_cache_t *c){
+	pthread_mutex_lock(&p->mutex);
+	if(p->free == NULL) {
+		size_t stride = pool_stride(p);
+		size_t n = POOL_SLAB / stride > 0 ? POOL_SLAB / stride : 1;
+		char *slab = (char *)malloc(n * stride);
+		if(slab == NULL) {
+			pthread_mutex_unlock(&p->mutex);
+			return -1;
+		}
+		for(size_t i=n; i>0; i--) {
+			pool_free_t *f = (pool_free_t *)(slab + (i - 1) * stride);
+			f->next = p->free;
+			p->free = f;
+		}
+		p->slabs++;
+		p->carved += n;
+		p->bytes += n * stride;
+	}
+	while(c->count < pool_cache_limit(p) / 2 && p->free != NULL) {
+		c->objs[c->count++] = p->free;
+		p->free = p->free->next;
+	}
+	pthread_mutex_unlock(&p->mutex);
+	return 0;
+}
 
-				write(cli->sockfd,"Group successfully created.You are its admin, but not yet a member.\n",
-				strlen("Group successfully created.You are its admin.You are its admin, but not yet a member.\n"));
-			} else {
-				write(cli->sockfd,"Group not created.Duplicate name-admin combo.\n",
-				strlen("Group successfully created.Duplicate name-admin combo.\n"));
-			}
+/* Hand count of a thread's cached objects back to the shared list */
+void pool_drain(pool_t *p, pool_cache_t *c, int count){
+	pthread_mutex_lock(&p->mutex);
+	while(count-- > 0) {
+		pool_free_t *f = (pool_free_t *)c->objs[--c->count];
+		f->next = p->free;
+		p->free = f;
+	}
+	pthread_mutex_unlock(&p->mutex);
+}
 
-		}	else if(strncmp(buff_out,DELETE_GROUP,strlen(DELETE_GROUP)) == 0) {
-			char group_name[STR_SIZE];
-			substring(buff_out, group_name, strlen(DELETE_GROUP)+1, strlen(buff_out));
-			trim_leading(group_name);
-			str_trim_lf(group_name,strlen(group_name));
+/* Take an object from a pool, its contents are undefined. NULL when out of memory */
+void *pool_alloc(int id){
+	pool_cache_t *c = &pool_cache[id];
 
-			int deleted = -1;
+	if(c->count == 0 && pool_refill(&pools[id], c) < 0) {
+		return NULL;
+	}
+	pools[id].live++;
+	return c->objs[--c->count];
+}
 
-			for(int i=0;i<group_count;i++) {
-				if(strcmp(groups[i]->name,group_name)==0 && strcmp(groups[i]->admin,cli->name)==0) {
-					queue_remove_group(group_name);
-					deleted = 0;
-					bzero(buffer,BUFFER_SZ);
-					sprintf(buffer,"%s:%s",group_name,cli->name);
-					group_count--;
-					break;
-				}
-			}
+/* Give an object back to the pool it came from */
+void pool_free(int id, void *obj){
+	pool_cache_t *c = &pool_cache[id];
 
-			bzero(buffer,BUFFER_SZ);
+	if(obj == NULL) {
+		return;
+	}
+	if(c->count >= pool_cache_limit(&pools[id])) {
+		pool_drain(&pools[id], c, c->count / 2);
+	}
+	c->objs[c->count++] = obj;
+	pools[id].live--;
+}
 
-			file = fopen("users.txt","r");
-			temp=fopen("temp.txt","a+");
-			if(file==NULL || temp==NULL) {
-				perror("Error opening file.\n");
-			}
+/* A thread that exits hands back everything it cached */
+void pool_thread_exit(void){
+	for(int i=0; i<POOL_COUNT; i++) {
+		pool_drain(&pools[i], &pool_cache[i], pool_cache[i].count);
+	}
+}
 
-			while ((read = getline(&line, &len, file)) != -1) {
-				if(strncmp(line,"groups",6)!=0) {
-					fputs(line,temp);
-				} else {
-					char temp_buff[BUFFER_SZ];
-					char new_line[BUFFER_SZ];
-					strcpy(temp_buff,line);
-					str_trim_lf(temp_buff,strlen(temp_buff));
-					char *p=strtok(temp_buff,":");
-
-					strcpy(new_line,"groups:");
-
-					while (p != NULL) {
-							p = strtok (NULL, ":");
-							if(p != NULL && strcmp(p,"\0") != 0 && strcmp(p,"\n") != 0
-								&& strncmp(p,group_name,strlen(group_name))!=0 ){
-								sprintf(new_line + strlen(new_line),":%s",p);
-							}
-					}
+/* Room for a message of size bytes of frame, from the smallest pool it fits in */
+msg_t *msg_alloc(size_t size){
+	msg_t *m;
 
-					fputs(new_line,temp);
-					fputs("\n",temp);
-				}
+	for(int id = POOL_MSG_SMALL; id <= POOL_MSG_LARGE; id++) {
+		if(sizeof(msg_t) + size <= pools[id].size) {
+			m = (msg_t *)pool_alloc(id);
+			if(m != NULL) {
+				m->pool = id;
+				m->fd = -1;
 			}
+			return m;
+		}
+	}
 
-			remove("users.txt");
-			rename("temp.txt", "users.txt");
+	m = (msg_t *)malloc(sizeof(msg_t) + size);
+	if(m != NULL) {
+		m->pool = -1;
+		m->fd = -1;
+		msg_heap_live++;
+	}
+	return m;
+}
 
-			fclose(temp);
-			fclose(file);
+/* Build a message from a payload, the caller holds the only reference */
+msg_t *msg_new(uint8_t opcode, const void *payload, size_t len){
+	if(len > FRAME_MAX_PAYLOAD) {
+		len = FRAME_MAX_PAYLOAD;
+	}
 
-			if(deleted == 0) {
-				int group_line_num = search_in_file("groups.txt",buffer,0);
-				int line_num = 1;
+	msg_t *m = msg_alloc(FRAME_HDR + len);
+	if(m == NULL) {
+		return NULL;
+	}
+	m->refs = 1;
+	m->len = FRAME_HDR + len;
+	frame_header((unsigned char *)m->data, opcode, len);
+	memcpy(m->data + FRAME_HDR, payload, len);
+	return m;
+}
 
-				groups_file = fopen("groups.txt","r");
-				temp=fopen("temp.txt","a+");
-				if(groups_file==NULL || temp==NULL) {
-					perror("Error opening file.\n");
-					deleted = -1;
-				}
+/* Format a text message once, however many clients it goes to */
+msg_t *msg_text(const char *fmt, ...){
+	va_list ap;
 
-				while ((read = getline(&line, &len, groups_file)) != -1) {
-					if(line_num != group_line_num) {
-						fputs(line,temp);
-					}
-					line_num++;
-				}
+	va_start(ap, fmt);
+	int len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if(len < 0) {
+		return NULL;
+	}
+	if(len > FRAME_MAX_PAYLOAD) {
+		len = FRAME_MAX_PAYLOAD;
+	}
 
-				remove("groups.txt");
-				rename("temp.txt", "groups.txt");
+	msg_t *m = msg_alloc(FRAME_HDR + len + 1);
+	if(m == NULL) {
+		return NULL;
+	}
+	m->refs = 1;
+	m->len = FRAME_HDR + len;
+	frame_header((unsigned char *)m->data, OP_TEXT, len);
+
+	va_start(ap, fmt);
+	vsnprintf(m->data + FRAME_HDR, len + 1, fmt, ap);
+	va_end(ap);
+	return m;
+}
 
-				fclose(temp);
-				fclose(groups_file);
+/* Format a message of a conversation once, headed by the conversation and its sequence number */
+msg_t *msg_seq(const char *conv, uint64_t seq, const char *fmt, ...){
+	va_list ap;
 
-				deleted = 1;
-			}
+	int head = snprintf(NULL, 0, "%s %llu\n", conv, (unsigned long long)seq);
+	va_start(ap, fmt);
+	int len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if(head < 0 || len < 0) {
+		return NULL;
+	}
+	if(head + len > FRAME_MAX_PAYLOAD) {
+		len = FRAME_MAX_PAYLOAD - head;
+	}
 
-			if(deleted == -1) {
-				write(cli->sockfd,"Group not deleted.Wrong group name or user is not admin.\n",
-				strlen("Group not deleted.Wrong group name or user is not admin.\n"));
+	msg_t *m = msg_alloc(FRAME_HDR + head + len + 1);
+	if(m == NULL) {
+		return NULL;
+	}
+	m->refs = 1;
+	m->len = FRAME_HDR + head + len;
+	frame_header((unsigned char *)m->data, OP_SEQ_TEXT, head + len);
+	snprintf(m->data + FRAME_HDR, head + 1, "%s %llu\n", conv, (unsigned long long)seq);
+
+	va_start(ap, fmt);
+	vsnprintf(m->data + FRAME_HDR + head, len + 1, fmt, ap);
+	va_end(ap);
+	return m;
+}
+
+/* A message for len bytes of whole frames in fd from off on, sent straight from the page cache.
+ * It takes over fd, which is closed with the message */
+msg_t *msg_file(int fd, off_t off, size_t len){
+	msg_t *m = msg_alloc(sizeof(off));
+	if(m == NULL) {
+		return NULL;
+	}
+	m->refs = 1;
+	m->len = len;
+	m->fd = fd;
+	memcpy(m->data, &off, sizeof(off));
+	return m;
+}
+
+/* Where a file message starts in its file */
+off_t msg_file_off(const msg_t *m){
+	off_t off;
+	memcpy(&off, m->data, sizeof(off));
+	return off;
+}
+
+/* Drop a reference, the last one frees the message */
+void msg_unref(msg_t *m){
+	if(m != NULL && --m->refs == 0) {
+		if(m->fd >= 0) {
+			close(m->fd);
+		}
+		if(m->pool >= 0) {
+			pool_free(m->pool, m);
+		} else {
+			msg_heap_live--;
+			free(m);
+		}
+	}
+}
+
+/* The i-th queued message, call with out_mutex held */
+msg_t **client_out_at(client_t *cli, unsigned int i){
+	return &cli->out_ring[(cli->out_first + i) & (cli->out_cap - 1)];
+}
+
+/* Ask the loop serving a client to look at it, defined with the mailbox further down */
+int loop_post(event_loop_t *loop, int slot, int uid);
+
+/* A client catching up is posted to its loop once its queue is empty, see client_room() */
+void client_catchup_post(client_t *cli){
+	if(cli->catchup_wait && cli->out_count == 0) {
+		cli->catchup_wait = 0;
+		loop_post(cli->loop, cli->slot, cli->uid);
+	}
+}
+
+/* Release every queued message not pinned by a send in flight, call with out_mutex held */
+void client_out_clear(client_t *cli){
+	for(unsigned int i=cli->out_busy; i<cli->out_count; i++) {
+		msg_t *m = *client_out_at(cli, i);
+		cli->out_bytes -= m->len;
+		msg_unref(m);
+	}
+	cli->out_count = cli->out_busy;
+	if(cli->out_count == 0) {
+		cli->out_first = 0;
+		cli->out_off = 0;
+		cli->out_bytes = 0;
+	}
+	client_catchup_post(cli);
+}
+
+/* Point iov at up to FLUSH_IOV queued messages, returns how many and the bytes they hold.
+ * It stops short of a file message, which goes out on its own */
+unsigned int client_out_iov(client_t *cli, struct iovec *iov, size_t *want){
+	unsigned int count = cli->out_count < FLUSH_IOV ? cli->out_count : FLUSH_IOV;
+
+	*want = 0;
+	for(unsigned int i=0; i<count; i++) {
+		msg_t *m = *client_out_at(cli, i);
+		if(m->fd >= 0) {
+			count = i;
+			break;
+		}
+		iov[i].iov_base = m->data;
+		iov[i].iov_len = m->len;
+		*want += m->len;
+	}
+	if(count > 0) {
+		iov[0].iov_base = (char *)iov[0].iov_base + cli->out_off;
+		iov[0].iov_len -= cli->out_off;
+		*want -= cli->out_off;
+	}
+	return count;
+}
+
+/* A congested client drained or left: wake the senders paused on it. Thread mode waits on
+ * drain_cond, the event modes' senders are posted back to their loops and check again there */
+void client_drained(client_t *cli){
+	cli->congested = 0;
+
+	pthread_mutex_lock(&drain_mutex);
+	pthread_cond_broadcast(&drain_cond);
+	int kept = 0;
+	for(int i=0; i<pause_wait_count; i++) {
+		pause_wait_t *w = &pause_waits[i];
+		if(loop_post(w->loop, w->ref.slot, w->ref.uid) < 0) {
+			pause_waits[kept++] = *w;
+		}
+	}
+	pause_wait_count = kept;
+	pthread_mutex_unlock(&drain_mutex);
+}
+
+/* Retire the messages that went out whole and remember how far into the next one n bytes got */
+void client_out_sent(client_t *cli, size_t n){
+	cli->out_bytes -= n;
+	n += cli->out_off;
+	while(cli->out_count > 0) {
+		msg_t *m = *client_out_at(cli, 0);
+		if(n < m->len) {
+			break;
+		}
+		n -= m->len;
+		cli->out_first = (cli->out_first + 1) & (cli->out_cap - 1);
+		cli->out_count--;
+		msg_unref(m);
+	}
+	cli->out_off = n;
+
+	/* Paused senders may go on once the queue is down to half */
+	if(cli->congested && cli->out_bytes <= out_limit / 2) {
+		client_drained(cli);
+	}
+	client_catchup_post(cli);
+}
+
+/*
+ * Write queued messages until the socket would block, call with out_mutex held.
+ * Every sendmsg gathers up to FLUSH_IOV messages. -1 once the peer is gone
+ */
+int client_write_locked(client_t *cli){
+	struct iovec iov[FLUSH_IOV];
+	struct msghdr hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov = iov;
+
+	while(cli->out_count > 0) {
+		/* A file message is spliced from the page cache to the socket, it is never copied in here */
+		msg_t *head = *client_out_at(cli, 0);
+		if(head->fd >= 0) {
+			off_t off = msg_file_off(head) + cli->out_off;
+			ssize_t n = sendfile(cli->sockfd, head->fd, &off, head->len - cli->out_off);
+			out_stats.sendfiles++;
+			if(n < 0) {
+				if(errno == EINTR) {
+					continue;
+				}
+				if(errno == EAGAIN || errno == EWOULDBLOCK) {
+					break;
+				}
+				cli->closing = 1;
+				client_out_clear(cli);
+				return -1;
+			}
+			out_stats.file_bytes += n;
+
+			/* A file that came up short has nothing more to send, the rest of it is done with too */
+			client_out_sent(cli, n > 0 ? (size_t)n : head->len - cli->out_off);
+			if(cli->out_off > 0) {
+				break;
+			}
+			continue;
+		}
+
+		size_t want;
+		unsigned int count = client_out_iov(cli, iov, &want);
+		hdr.msg_iovlen = count;
+
+		/* Corked, a call that leaves messages behind tells TCP more is coming */
+		int flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+		if(out_cork && count < cli->out_count) {
+			flags |= MSG_MORE;
+		}
+
+		ssize_t n = sendmsg(cli->sockfd, &hdr, flags);
+		out_stats.writes++;
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			/* Nothing goes out on it any more, the reader closes it */
+			cli->closing = 1;
+			client_out_clear(cli);
+			return -1;
+		}
+		client_out_sent(cli, n);
+
+		/* A short write means the socket buffer is full, asking again would only get EAGAIN */
+		if((size_t)n < want) {
+			break;
+		}
+	}
+	return 0;
+}
+
+/* io_uring mode: a free submission entry, handing the full queue to the kernel first if need be */
+struct io_uring_sqe *uring_sqe(uring_t *r){
+	if(r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == r->sq_entries) {
+		__atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+		syscall(__NR_io_uring_enter, r->fd, r->sq_entries, 0, 0, NULL, 0);
+		io_stats.waits++;
+	}
+
+	unsigned int idx = r->sq_local & r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[idx] = idx;
+	r->sq_local++;
+	return sqe;
+}
+
+/* What a completion is for, kept in the low bits of its user_data next to the client */
+enum { URING_ACCEPT, URING_RECV, URING_SEND, URING_WAKE, URING_CANCEL };
+#define URING_KIND 7
+
+/* io_uring mode: send the head of the queue with one gathered sendmsg, on the owning loop with out_mutex held */
+void uring_send(client_t *cli){
+	if(cli->out_send == NULL) {
+		cli->out_send = (uring_send_t *)pool_alloc(POOL_SEND);
+		if(cli->out_send == NULL) {
+			/* Nothing is in flight, so writing from here is safe */
+			client_write_locked(cli);
+			cli->out_armed = 0;
+			return;
+		}
+	}
+
+	uring_send_t *s = cli->out_send;
+	size_t want;
+	unsigned int count = client_out_iov(cli, s->iov, &want);
+
+	memset(&s->hdr, 0, sizeof(s->hdr));
+	s->hdr.msg_iov = s->iov;
+	s->hdr.msg_iovlen = count;
+
+	struct io_uring_sqe *sqe = uring_sqe(cli->loop->ring);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = cli->sockfd;
+	sqe->addr = (uintptr_t)&s->hdr;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL | (out_cork && count < cli->out_count ? MSG_MORE : 0);
+	sqe->user_data = (uintptr_t)cli | URING_SEND;
+
+	cli->out_busy = count;
+	cli->uring_ops++;
+	io_stats.ring_sends++;
+}
+
+/* io_uring mode: start writing the queue unless a send is already on its way, call with out_mutex held */
+void uring_flush(client_t *cli){
+	if(cli->out_armed || cli->out_count == 0) {
+		return;
+	}
+
+	cli->out_armed = 1;
+	if(cli->loop == current_loop) {
+		uring_send(cli);
+	} else if(loop_post(cli->loop, cli->slot, cli->uid) < 0) {
+		/* Nothing is in flight yet, so writing from here is safe */
+		client_write_locked(cli);
+		cli->out_armed = 0;
+	}
+}
+
+/* Write what the socket takes now, in io_uring mode leave it to the owning loop. -1 once the peer is gone */
+int client_flush_locked(client_t *cli){
+	if(cli->epfd < 0) {
+		uring_flush(cli);
+		return 0;
+	}
+	return client_write_locked(cli);
+}
+
+/* Flush on EPOLLOUT and stop asking once the queue is empty, -1 once the peer is gone */
+int client_flush(client_t *cli){
+	pthread_mutex_lock(&cli->out_mutex);
+	if(cli->closing) {
+		pthread_mutex_unlock(&cli->out_mutex);
+		return 0;
+	}
+
+	int result = client_flush_locked(cli);
+
+	/* Thread mode arms one shot, so the flusher has to ask again for what is left */
+	if(cli->out_count == 0 && cli->out_armed) {
+		client_arm(cli, 0);
+	} else if(cli->out_count > 0 && (cli->ev_base & EPOLLONESHOT)) {
+		client_arm(cli, 1);
+	}
+	pthread_mutex_unlock(&cli->out_mutex);
+	return result;
+}
+
+/* Drop the oldest messages that have not started going out until len more bytes fit */
+void client_drop_oldest(client_t *cli, size_t len){
+	/* A message that is partly written, or pinned by a send in flight, stays first, the ones after it go */
+	unsigned int keep = cli->out_busy ? cli->out_busy : (cli->out_off > 0 ? 1 : 0);
+	unsigned int drop = 0;
+
+	while(keep + drop < cli->out_count && cli->out_bytes + len > out_limit) {
+		msg_t *m = *client_out_at(cli, keep + drop);
+		cli->out_bytes -= m->len;
+		msg_unref(m);
+		drop++;
+		out_stats.dropped++;
+	}
+	if(drop > 0) {
+		for(unsigned int i=keep; i>0; i--) {
+			*client_out_at(cli, drop + i - 1) = *client_out_at(cli, i - 1);
+		}
+	}
+	cli->out_first = (cli->out_first + drop) & (cli->out_cap - 1);
+	cli->out_count -= drop;
+}
+
+/* Make room for one more reference in the ring, call with out_mutex held */
+int client_out_grow(client_t *cli){
+	unsigned int cap = cli->out_cap ? cli->out_cap * 2 : 16;
+	msg_t **ring = (msg_t **)malloc(cap * sizeof(msg_t *));
+	if(ring == NULL) {
+		return -1;
+	}
+
+	for(unsigned int i=0; i<cli->out_count; i++) {
+		ring[i] = *client_out_at(cli, i);
+	}
+	free(cli->out_ring);
+	cli->out_ring = ring;
+	cli->out_cap = cap;
+	cli->out_first = 0;
+	return 0;
+}
+
+/* Put off writing to a client until this thread's batch ends: replies to the sender, anybody when corked
+ * or in io_uring mode, where the batch end turns into one submission */
+int client_hold(client_t *cli){
+	if(!batching || (!out_cork && cli != replying && cli->epfd >= 0)) {
+		return 0;
+	}
+
+	if(held_count == held_cap) {
+		int cap = held_cap ? held_cap * 2 : 64;
+		client_ref_t *grown = (client_ref_t *)realloc(held, cap * sizeof(client_ref_t));
+		if(grown == NULL) {
+			return 0;
+		}
+		held = grown;
+		held_cap = cap;
+	}
+	held[held_count].slot = cli->slot;
+	held[held_count].uid = cli->uid;
+	held_count++;
+	out_stats.held++;
+	return 1;
+}
+
+/* Write everything this thread held back, one gathered write per client */
+void client_flush_held(void){
+	if(held_count == 0) {
+		return;
+	}
+
+	pthread_rwlock_rdlock(&clients_lock);
+	for(int i=0; i<held_count; i++) {
+		client_t *cli = clients[held[i].slot];
+		if(cli == NULL || cli->uid != held[i].uid) {
+			continue;
+		}
+
+		pthread_mutex_lock(&cli->out_mutex);
+		cli->flush_held = 0;
+		if(!cli->closing && !cli->out_armed) {
+			client_flush_locked(cli);
+			if(cli->out_count > 0 && !cli->out_armed) {
+				client_arm(cli, 1);
+				out_stats.deferred++;
+			}
+		}
+		pthread_mutex_unlock(&cli->out_mutex);
+	}
+	pthread_rwlock_unlock(&clients_lock);
+	held_count = 0;
+}
+
+/* Start holding writes until batch_end(), so each client gets one gathered write per batch */
+void batch_begin(void){
+	batching = 1;
+}
+
+void batch_end(void){
+	client_flush_held();
+	batching = 0;
+	replying = NULL;
+}
+
+/* Hold a reply until the client's journal record is on disk, see journal_sync() */
+int client_defer(client_t *cli, msg_t *m){
+	if(cli->reply_count == cli->reply_cap) {
+		int cap = cli->reply_cap ? cli->reply_cap * 2 : 4;
+		msg_t **grown = (msg_t **)realloc(cli->replies, cap * sizeof(msg_t *));
+		if(grown == NULL) {
+			return -1;
+		}
+		cli->replies = grown;
+		cli->reply_cap = cap;
+	}
+	m->refs++;
+	cli->replies[cli->reply_count++] = m;
+	return 0;
+}
+
+/*
+ * Queue a reference to a message and write as much as the socket takes now.
+ * Returns 0 when queued, 1 when queued past the limit under the pause
+ * policy, -1 when the message was not queued.
+ */
+int client_send_msg(client_t *cli, msg_t *m){
+	int result = 0;
+
+	if(m == NULL) {
+		return -1;
+	}
+
+	/* The thread handling the client's input is the only one that parks it or replies to it */
+	if(cli == replying && (cli->parked & PARK_SYNC)) {
+		return client_defer(cli, m);
+	}
+
+	pthread_mutex_lock(&cli->out_mutex);
+	if(cli->closing) {
+		pthread_mutex_unlock(&cli->out_mutex);
+		return -1;
+	}
+
+	/* File messages count with their length too, each holds a descriptor. One alone always fits */
+	if(cli->out_count > 0 && cli->out_bytes + m->len > out_limit) {
+		if(out_policy == OUT_DROP) {
+			client_drop_oldest(cli, m->len);
+		} else if(out_policy == OUT_DISCONNECT) {
+			/* The reader sees the shutdown and closes the connection as usual */
+			printf("Disconnecting slow client %d\n", cli->uid);
+			cli->closing = 1;
+			client_out_clear(cli);
+			shutdown(cli->sockfd, SHUT_RDWR);
+			out_stats.disconnected++;
+			pthread_mutex_unlock(&cli->out_mutex);
+			return -1;
+		} else {
+			cli->congested = 1;
+			result = 1;
+		}
+	}
+
+	if(cli->out_count == cli->out_cap && client_out_grow(cli) < 0) {
+		pthread_mutex_unlock(&cli->out_mutex);
+		return -1;
+	}
+	m->refs++;
+	*client_out_at(cli, cli->out_count++) = m;
+	cli->out_bytes += m->len;
+	out_stats.frames++;
+
+	/* Nothing is waiting for EPOLLOUT or the batch end, so try right away and leave the rest to the event */
+	if(!cli->out_armed && !cli->flush_held) {
+		if(client_hold(cli)) {
+			cli->flush_held = 1;
+		} else {
+			client_flush_locked(cli);
+			if(cli->out_count > 0 && !cli->out_armed) {
+				client_arm(cli, 1);
+				out_stats.deferred++;
+			}
+		}
+	}
+	pthread_mutex_unlock(&cli->out_mutex);
+	return result;
+}
+
+/* Queue a frame for this client only */
+int client_send(client_t *cli, uint8_t opcode, const void *payload, size_t len){
+	msg_t *m = msg_new(opcode, payload, len);
+	int result = client_send_msg(cli, m);
+	msg_unref(m);
+	return result;
+}
+
+/* Send text for the client to display */
+int send_text(client_t *cli, const char *s){
+	return client_send(cli, OP_TEXT, s, strlen(s));
+}
+
+/* Relay a message from one client to another, the pause policy remembers recipients that overflowed */
+int relay(client_t *from, client_t *to, msg_t *m){
+	int result = client_send_msg(to, m);
+
+	if(result == 1 && from->pause_count < MAX_PAUSE) {
+		from->pause_on[from->pause_count].slot = to->slot;
+		from->pause_on[from->pause_count].uid = to->uid;
+		from->pause_count++;
+	}
+	return result;
+}
+
+/* io_uring mode: stop a client's receive, defined with the loop further down */
+void uring_cancel(client_t *cli);
+
+/*
+ * Park a client for a reason: its input is put aside until nothing holds it any more, so one
+ * client waiting for the disk never holds up the loop serving everybody else. The event modes stop
+ * reading its socket and go on with other connections, its loop takes it up again when posted to.
+ * Thread mode waits in the client's own thread. On the thread handling the client's input
+ */
+void client_park(client_t *cli, int reason){
+	pthread_mutex_lock(&cli->out_mutex);
+	int was = cli->parked;
+	cli->parked |= reason;
+	if(!was && cli->loop != NULL) {
+		client_arm(cli, cli->out_armed);
+	}
+	pthread_mutex_unlock(&cli->out_mutex);
+
+	if(!was && cli->epfd < 0 && cli->uring_reading) {
+		uring_cancel(cli);
+	}
+}
+
+/* Clear a reason a client was parked for, it is read again once none is left */
+void client_unpark(client_t *cli, int reason){
+	pthread_mutex_lock(&cli->out_mutex);
+	cli->parked &= ~reason;
+	if(cli->parked == 0 && cli->loop != NULL && !cli->closing) {
+		client_arm(cli, cli->out_armed);
+	}
+	pthread_mutex_unlock(&cli->out_mutex);
+}
+
+/*
+ * Pause policy: drop the recipients a sender overflowed that have drained or left since, 1 while
+ * one is still congested. An event loop's sender is put on pause_waits then; the check is made under
+ * drain_mutex, so a recipient draining meanwhile cannot miss it
+ */
+int client_overflowed(client_t *cli){
+	pthread_rwlock_rdlock(&clients_lock);
+	pthread_mutex_lock(&drain_mutex);
+	while(cli->pause_count > 0) {
+		client_ref_t *p = &cli->pause_on[cli->pause_count - 1];
+		client_t *to = clients[p->slot];
+		if(to != NULL && to->uid == p->uid && to->congested) {
+			break;
+		}
+		cli->pause_count--;
+	}
+
+	if(cli->pause_count > 0 && cli->loop != NULL) {
+		if(pause_wait_count == pause_wait_cap) {
+			int cap = pause_wait_cap ? pause_wait_cap * 2 : 64;
+			pause_wait_t *grown = (pause_wait_t *)realloc(pause_waits, cap * sizeof(pause_wait_t));
+			if(grown != NULL) {
+				pause_waits = grown;
+				pause_wait_cap = cap;
+			}
+		}
+		if(pause_wait_count < pause_wait_cap) {
+			pause_wait_t *w = &pause_waits[pause_wait_count++];
+			w->loop = cli->loop;
+			w->ref.slot = cli->slot;
+			w->ref.uid = cli->uid;
+		} else {
+			/* Nothing could post it back, so the sender goes on */
+			cli->pause_count = 0;
+		}
+	}
+	pthread_mutex_unlock(&drain_mutex);
+	pthread_rwlock_unlock(&clients_lock);
+
+	return cli->pause_count > 0;
+}
+
+/* Pause policy: after a command, park the sender until every recipient it overflowed has drained
+ * or left. Its input is not read meanwhile, so the back-pressure reaches its own socket */
+void client_pause(client_t *cli){
+	if(cli->pause_count == 0 || !client_overflowed(cli)) {
+		return;
+	}
+	out_stats.paused++;
+	client_park(cli, PARK_PAUSE);
+}
+
+/* Whether len more bytes fit in a client's own queue, for output it is due rather than sent by others.
+ * 1 if they do, -1 once it is closing. 0 if not: an event loop's client is posted back once its
+ * queue is empty, thread mode waits in client_park_wait() */
+int client_room(client_t *cli, size_t len){
+	pthread_mutex_lock(&cli->out_mutex);
+	int room = cli->closing ? -1 : cli->out_count == 0 || cli->out_bytes + len <= out_limit;
+	if(room == 0 && cli->loop != NULL) {
+		cli->catchup_wait = 1;
+	}
+	pthread_mutex_unlock(&cli->out_mutex);
+	return room;
+}
+
+/* Whether everything queued for a client went out, the same way */
+int client_sent_all(client_t *cli){
+	pthread_mutex_lock(&cli->out_mutex);
+	int sent = cli->closing ? -1 : cli->out_count == 0;
+	if(sent == 0 && cli->loop != NULL) {
+		cli->catchup_wait = 1;
+	}
+	pthread_mutex_unlock(&cli->out_mutex);
+	return sent;
+}
+
+/* Whether file messages may be queued for a client. They need the non-blocking sockets of epoll mode:
+ * thread mode sockets block, and io_uring mode only sends what it can gather into a sendmsg */
+int client_zero_copy(client_t *cli){
+	return cli->epfd >= 0 && cli->epfd != flush_epfd;
+}
+
+/* Add clients to queue, -1 if every slot is taken */
+int queue_add(client_t *cl){
+	int result = 0;
+
+	pthread_rwlock_wrlock(&clients_lock);
+
+	if(free_slot_count > 0) {
+		cl->slot = free_slots[--free_slot_count];
+	} else if(client_slots < MAX_CLIENTS) {
+		cl->slot = client_slots++;
+	} else {
+		result = -1;
+	}
+	if(result == 0) {
+		clients[cl->slot] = cl;
+	}
+
+	pthread_rwlock_unlock(&clients_lock);
+	return result;
+}
+
+/* Remove clients from queue */
+void queue_remove(client_t *cl){
+	pthread_rwlock_wrlock(&clients_lock);
+
+	if(clients[cl->slot] == cl) {
+		clients[cl->slot] = NULL;
+		free_slots[free_slot_count++] = cl->slot;
+	}
+
+	pthread_rwlock_unlock(&clients_lock);
+}
+
+/* Find a group by name, NULL if there is none. Call with users_lock held */
+group_t *group_find(const char *group_name){
+	if(group_bucket_count == 0) {
+		return NULL;
+	}
+
+	group_t *gr = group_buckets[hash_name(group_name) & (group_bucket_count - 1)];
+	while(gr != NULL && strcmp(gr->name, group_name) != 0) {
+		gr = gr->next;
+	}
+	return gr;
+}
+
+/* Position of a user id in the member array, or where it would be inserted */
+int group_member_pos(group_t *gr, int id){
+	int lo = 0, hi = gr->member_count;
+
+	while(lo < hi) {
+		int mid = (lo + hi) / 2;
+		if(gr->members[mid] < id) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* User id is in the member set */
+int group_has_member(group_t *gr, int id){
+	if(gr->member_bits.nwords > 0) {
+		return bitset_test(&gr->member_bits, id);
+	}
+	int pos = group_member_pos(gr, id);
+	return pos < gr->member_count && gr->members[pos] == id;
+}
+
+/* Next member id in order, start with *pos at 0. -1 after the last */
+int group_member_next(group_t *gr, int *pos){
+	if(gr->member_bits.nwords > 0) {
+		int id = bitset_next(&gr->member_bits, *pos);
+		*pos = id + 1;
+		return id;
+	}
+	return *pos < gr->member_count ? gr->members[(*pos)++] : -1;
+}
+
+/* Move the member array into a bitset covering ids up to top */
+int group_members_to_bits(group_t *gr, int top){
+	if(bitset_set(&gr->member_bits, top) < 0) {
+		return -1;
+	}
+	bitset_clear(&gr->member_bits, top);
+	for(int j=0; j<gr->member_count; j++) {
+		bitset_set(&gr->member_bits, gr->members[j]);
+	}
+	free(gr->members);
+	gr->members = NULL;
+	gr->member_cap = 0;
+	return 0;
+}
+
+/* Add a user id to the member set, call with users_lock held for writing */
+int group_add_member(group_t *gr, int id){
+	if(group_has_member(gr, id)) {
+		return -2; // already a member
+	}
+
+	if(gr->member_bits.nwords == 0 && gr->member_count == gr->member_cap) {
+		int cap = gr->member_cap ? gr->member_cap * 2 : 8;
+		int top = gr->member_count > 0 && gr->members[gr->member_count - 1] > id ? gr->members[gr->member_count - 1] : id;
+
+		/* A bitset over every id so far is smaller than the grown array, switch for good */
+		if((size_t)cap * sizeof(int) >= (size_t)(top / 64 + 1) * sizeof(uint64_t)) {
+			if(group_members_to_bits(gr, top) < 0) {
+				return 0; // out of memory
+			}
+		} else {
+			int *grown = (int *)realloc(gr->members, cap * sizeof(int));
+			if(grown == NULL) {
+				return 0; // out of memory
+			}
+			gr->members = grown;
+			gr->member_cap = cap;
+		}
+	}
+
+	if(gr->member_bits.nwords > 0) {
+		if(bitset_set(&gr->member_bits, id) < 0) {
+			return 0; // out of memory
+		}
+	} else {
+		int pos = group_member_pos(gr, id);
+		memmove(gr->members + pos + 1, gr->members + pos, (gr->member_count - pos) * sizeof(int));
+		gr->members[pos] = id;
+	}
+	gr->member_count++;
+	return 1; // added
+}
+
+/* Set the group's bit in a user record, 1 if it was not set. The member set is the caller's */
+int user_join_group(user_t *u, group_t *gr){
+	if(bitset_set(&u->groups, gr->id) != 1) {
+		return 0;
+	}
+	u->group_count++;
+	return 1;
+}
+
+/* Double the group hash table once it holds more groups than buckets */
+int group_buckets_grow(void){
+	size_t count = group_bucket_count ? group_bucket_count * 2 : 64;
+	group_t **buckets = (group_t **)calloc(count, sizeof(group_t *));
+	if(buckets == NULL) {
+		return -1;
+	}
+
+	for(int i=0; i<group_slots; i++) {
+		group_t *gr = groups[i];
+		if(gr == NULL) {
+			continue;
+		}
+		size_t b = hash_name(gr->name) & (count - 1);
+		gr->next = buckets[b];
+		buckets[b] = gr;
+	}
+
+	free(group_buckets);
+	group_buckets = buckets;
+	group_bucket_count = count;
+	return 0;
+}
+
+/* Create a group with the next free id, NULL if out of memory. Call with users_lock held for writing */
+group_t *group_create(const char *group_name, const char *admin){
+	if(group_slots == group_cap) {
+		int cap = group_cap ? group_cap * 2 : 64;
+		group_t **grown = (group_t **)realloc(groups, cap * sizeof(group_t *));
+		if(grown == NULL) {
+			return NULL;
+		}
+		groups = grown;
+		group_cap = cap;
+	}
+	if(group_count >= group_bucket_count && group_buckets_grow() < 0) {
+		return NULL;
+	}
+
+	group_t *gr = (group_t *)pool_alloc(POOL_GROUP);
+	if(gr == NULL) {
+		return NULL;
+	}
+	memset(gr, 0, sizeof(*gr));
+	gr->id = group_slots;
+	snprintf(gr->name, STR_SIZE, "%s", group_name);
+	snprintf(gr->admin, STR_SIZE, "%s", admin);
+
+	size_t b = hash_name(gr->name) & (group_bucket_count - 1);
+	gr->next = group_buckets[b];
+	group_buckets[b] = gr;
+	groups[group_slots++] = gr;
+	group_count++;
+	return gr;
+}
+
+/* Unlink a group from the registry and free it, call with users_lock held for writing */
+void group_remove(group_t *gr){
+	group_t **p = &group_buckets[hash_name(gr->name) & (group_bucket_count - 1)];
+	while(*p != gr) {
+		p = &(*p)->next;
+	}
+	*p = gr->next;
+
+	groups[gr->id] = NULL;
+	group_count--;
+	free(gr->members);
+	bitset_free(&gr->member_bits);
+	pool_free(POOL_GROUP, gr);
+}
+
+/* Write "1. name" lines for every group, call with users_lock held */
+void write_group_list(FILE *file){
+	int n = 0;
+
+	for(int i=0; i < group_slots; ++i){
+		if(groups[i]){
+			fprintf(file, "%d. %s\n", ++n, groups[i]->name);
+		}
+	}
+}
+
+/* Load every group from the groups file */
+int load_groups(const char *fname) {
+	FILE *file;
+	char *line = NULL;
+	size_t len = 0;
+
+	if((file = fopen(fname, "r")) == NULL) {
+		perror(fname);
+		return -1;
+	}
+
+	/* One group per line, name:admin */
+	while(getline(&line, &len, file) != -1) {
+		str_trim_lf(line, strlen(line));
+
+		char *admin = strchr(line, ':');
+		if(admin == NULL || admin[1] == '\0') {
+			continue;
+		}
+		*admin++ = '\0';
+
+		if(group_find(line) == NULL && group_create(line, admin) == NULL) {
+			perror("ERROR: group");
+			break;
+		}
+	}
+
+	free(line);
+	fclose(file);
+	return 0;
+}
+
+/* Write the groups file format for every group, call with users_lock held */
+void write_groups(FILE *file){
+	for(int i=0; i < group_slots; ++i){
+		if(groups[i]){
+			fprintf(file, "%s:%s\n", groups[i]->name, groups[i]->admin);
+		}
+	}
+}
+
+/* Add a string to the snapshot string table, returns its offset */
+uint32_t snap_put(FILE *strings, const char *str){
+	uint32_t off = ftell(strings);
+	fwrite(str, 1, strlen(str) + 1, strings);
+	return off;
+}
+
+/* Serialize users and groups as a binary snapshot, call with users_lock held */
+int snapshot_build(char **buf, size_t *len){
+	snap_header_t hdr;
+	char *strings, *lists;
+	size_t strings_len, lists_len;
+	uint32_t buckets = 16;
+	uint32_t g = 0;
+	user_t tmp;
+
+	while(buckets < 2 * (uint64_t)user_count) {
+		buckets *= 2;
+	}
+	snap_user_t *recs = (snap_user_t *)calloc(user_count + 1, sizeof(snap_user_t));
+	snap_group_t *grecs = (snap_group_t *)calloc(group_slots + 1, sizeof(snap_group_t));
+	uint32_t *index = (uint32_t *)calloc(buckets, sizeof(uint32_t));
+	FILE *s = open_memstream(&strings, &strings_len);
+	FILE *l = open_memstream(&lists, &lists_len);
+	if(recs == NULL || grecs == NULL || index == NULL || s == NULL || l == NULL) {
+		perror("ERROR: snapshot failed");
+		if(s != NULL) {
+			fclose(s);
+			free(strings);
+		}
+		if(l != NULL) {
+			fclose(l);
+			free(lists);
+		}
+		free(recs);
+		free(grecs);
+		free(index);
+		return -1;
+	}
+
+	for(int i=0; i<user_count; i++) {
+		user_t *u = user_at(i, &tmp);
+
+		recs[i].name = snap_put(s, u->name);
+		recs[i].pswd = snap_put(s, u->pswd);
+		recs[i].lists = ftell(l) / sizeof(uint32_t);
+		recs[i].contact_count = u->contacts.count;
+		recs[i].group_count = u->group_count;
+		for(int j=0; j<u->contacts.cap; j++) {
+			if(u->contacts.slots[j] != 0) {
+				uint32_t id = u->contacts.slots[j] - 1;
+				fwrite(&id, sizeof(id), 1, l);
+			}
+		}
+		for(int g = bitset_next(&u->groups, 0); g >= 0; g = bitset_next(&u->groups, g + 1)) {
+			uint32_t off = snap_put(s, groups[g]->name);
+			fwrite(&off, sizeof(off), 1, l);
+		}
+		if(u == &tmp) {
+			user_release(&tmp);
+		}
+
+		uint32_t b = hash_name(u->name) & (buckets - 1);
+		while(index[b] != 0) {
+			b = (b + 1) & (buckets - 1);
+		}
+		index[b] = i + 1;
+	}
+
+	for(int i=0; i < group_slots; ++i){
+		if(groups[i]){
+			grecs[g].name = snap_put(s, groups[i]->name);
+			grecs[g].admin = snap_put(s, groups[i]->admin);
+			g++;
+		}
+	}
+	fclose(s);
+	fclose(l);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.user_count = user_count;
+	hdr.group_count = g;
+	hdr.bucket_count = buckets;
+	hdr.users_off = sizeof(hdr);
+	hdr.groups_off = hdr.users_off + (uint64_t)user_count * sizeof(snap_user_t);
+	hdr.lists_off = hdr.groups_off + g * sizeof(snap_group_t);
+	hdr.lists_count = lists_len / sizeof(uint32_t);
+	hdr.index_off = hdr.lists_off + lists_len;
+	hdr.strings_off = hdr.index_off + (uint64_t)buckets * sizeof(uint32_t);
+	hdr.strings_len = strings_len;
+
+	int result = 0;
+	if(strings_len > UINT32_MAX) {
+		printf("ERROR: Snapshot string table too large\n");
+		result = -1;
+	} else {
+		FILE *m = open_memstream(buf, len);
+		fwrite(&hdr, sizeof(hdr), 1, m);
+		fwrite(recs, sizeof(snap_user_t), user_count, m);
+		fwrite(grecs, sizeof(snap_group_t), g, m);
+		fwrite(lists, 1, lists_len, m);
+		fwrite(index, sizeof(uint32_t), buckets, m);
+		fwrite(strings, 1, strings_len, m);
+		fclose(m);
+	}
+
+	free(recs);
+	free(grecs);
+	free(index);
+	free(strings);
+	free(lists);
+	return result;
+}
+
+/* Section of count elements at off lies within the mapped file */
+int snap_section(uint64_t off, uint64_t count, size_t size){
+	return off % sizeof(uint32_t) == 0 && off <= snap.size && count <= (snap.size - off) / size;
+}
+
+/* Map a binary snapshot, users are read from it as they are looked up */
+int snapshot_open(const char *fname){
+	struct stat st;
+	int fd = open(fname, O_RDONLY);
+
+	if(fd < 0 || fstat(fd, &st) < 0) {
+		perror(fname);
+		return -1;
+	}
+	if((size_t)st.st_size < sizeof(snap_header_t)) {
+		printf("ERROR: %s is truncated\n", fname);
+		close(fd);
+		return -1;
+	}
+
+	snap.size = st.st_size;
+	snap.base = mmap(NULL, snap.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(snap.base == MAP_FAILED) {
+		perror(fname);
+		return -1;
+	}
+
+	snap_header_t *hdr = (snap_header_t *)snap.base;
+	if(memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) == 0 && hdr->version != SNAPSHOT_VERSION) {
+		printf("ERROR: %s is snapshot version %u, this server reads version %d only\n", fname,
+			hdr->version, SNAPSHOT_VERSION);
+		munmap(snap.base, snap.size);
+		return -1;
+	}
+	uint32_t buckets = hdr->bucket_count;
+	if(memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) != 0
+		|| buckets == 0 || (buckets & (buckets - 1)) != 0 || buckets <= hdr->user_count
+		|| !snap_section(hdr->users_off, hdr->user_count, sizeof(snap_user_t))
+		|| !snap_section(hdr->groups_off, hdr->group_count, sizeof(snap_group_t))
+		|| !snap_section(hdr->lists_off, hdr->lists_count, sizeof(uint32_t))
+		|| !snap_section(hdr->index_off, buckets, sizeof(uint32_t))
+		|| !snap_section(hdr->strings_off, hdr->strings_len, 1)
+		|| (hdr->strings_len > 0 && snap.base[hdr->strings_off + hdr->strings_len - 1] != '\0')) {
+		printf("ERROR: %s is not a valid snapshot\n", fname);
+		munmap(snap.base, snap.size);
+		return -1;
+	}
+
+	snap.users = (snap_user_t *)(snap.base + hdr->users_off);
+	snap.groups = (snap_group_t *)(snap.base + hdr->groups_off);
+	snap.lists = (uint32_t *)(snap.base + hdr->lists_off);
+	snap.index = (uint32_t *)(snap.base + hdr->index_off);
+	snap.strings = snap.base + hdr->strings_off;
+	snap.hdr = hdr;
+	snapshot_binary = 1;
+
+	/* Every user gets an id slot, the records stay in the mapping until used */
+	user_cap = hdr->user_count + 1024;
+	users = (user_t **)calloc(user_cap, sizeof(user_t *));
+	if(users == NULL) {
+		return -1;
+	}
+	user_count = hdr->user_count;
+
+	for(uint32_t i=0; i<hdr->group_count; i++) {
+		if(group_create(snap_str(snap.groups[i].name), snap_str(snap.groups[i].admin)) == NULL) {
+			return -1;
+		}
+	}
+
+	/* Member sets cover users still in the mapping too, group messages have to find them offline */
+	for(uint32_t i=0; i<hdr->user_count; i++) {
+		snap_user_t *r = &snap.users[i];
+		if((uint64_t)r->lists + r->contact_count + r->group_count > hdr->lists_count) {
+			continue;
+		}
+		uint32_t *list = snap.lists + r->lists + r->contact_count;
+		for(int j=0; j<r->group_count; j++) {
+			group_t *gr = group_find(snap_str(list[j]));
+			if(gr != NULL) {
+				group_add_member(gr, i);
+			}
+		}
+	}
+	return 0;
+}
+
+/* Move user id's cursor in a conversation forward to seq, 1 if it moved. Call with ack_mutex held */
+int ack_set(int id, int group, uint64_t seq){
+	if(id >= ack_list_cap) {
+		int n = ack_list_cap ? ack_list_cap : 1024;
+		while(n <= id) {
+			n *= 2;
+		}
+		ack_list_t *grown = (ack_list_t *)realloc(ack_lists, n * sizeof(ack_list_t));
+		if(grown == NULL) {
+			return 0;
+		}
+		memset(grown + ack_list_cap, 0, (n - ack_list_cap) * sizeof(ack_list_t));
+		ack_lists = grown;
+		ack_list_cap = n;
+	}
+
+	ack_list_t *l = &ack_lists[id];
+	int i = 0;
+	while(i < l->count && l->acks[i].group != group) {
+		i++;
+	}
+	if(i == l->count) {
+		ack_t *grown = (ack_t *)realloc(l->acks, (i + 1) * sizeof(ack_t));
+		if(grown == NULL) {
+			return 0;
+		}
+		l->acks = grown;
+		l->acks[i].group = group;
+		l->acks[i].seq = 0;
+		l->count++;
+	}
+	if(seq <= l->acks[i].seq) {
+		return 0;
+	}
+	l->acks[i].seq = seq;
+	return 1;
+}
+
+/* The last message of a conversation user id acknowledged, 0 if none */
+uint64_t user_acked(int id, int group){
+	uint64_t seq = 0;
+
+	pthread_mutex_lock(&ack_mutex);
+	ack_list_t *l = id < ack_list_cap ? &ack_lists[id] : NULL;
+	for(int i=0; l != NULL && i<l->count; i++) {
+		if(l->acks[i].group == group) {
+			seq = l->acks[i].seq;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ack_mutex);
+	return seq;
+}
+
+/* Write every acknowledgement as the journal record that sets it, by user and conversation name
+ * since group ids are not kept across restarts. Call with users_lock and ack_mutex held */
+void write_acks(FILE *file){
+	for(int id=0; id<ack_list_cap; id++) {
+		ack_list_t *l = &ack_lists[id];
+		for(int i=0; i<l->count; i++) {
+			int group = l->acks[i].group;
+			if(group >= 0 && groups[group] == NULL) {
+				continue;
+			}
+			fprintf(file, "ack:%s:%s%s:%llu\n", user_name(id), group < 0 ? "@" : "#",
+				group < 0 ? "" : groups[group]->name, (unsigned long long)l->acks[i].seq);
+		}
+	}
+}
+
+/*
+ * Mutations of users and groups. They run with users_lock held for writing, return 1
+ * when something changed (only then is a journal record due) and are
+ * idempotent, so replaying a record that is already in the snapshot is harmless.
+ */
+int apply_add_contact(user_t *u, const char *contact_name){
+	int id = user_id(contact_name);
+	return id >= 0 && id_set_add(&u->contacts, id);
+}
+
+int apply_delete_contact(user_t *u, const char *contact_name){
+	int id = user_id(contact_name);
+	return id >= 0 && id_set_remove(&u->contacts, id);
+}
+
+int apply_enter_group(user_t *u, const char *group_name){
+	group_t *gr = group_find(group_name);
+	if(gr == NULL || !user_join_group(u, gr)) {
+		return 0;
+	}
+	group_add_member(gr, u->id);
+	return 1;
+}
+
+int apply_create_group(const char *group_name, const char *admin){
+	if(group_find(group_name) != NULL) {
+		return 0;
+	}
+	return group_create(group_name, admin) != NULL;
+}
+
+/* ack:user:conversation:seq, where the user saw a conversation up to */
+int apply_ack(const char *name, const char *conv, const char *seq){
+	int id = user_id(name);
+	int group = -1;
+
+	if(conv[0] == '#') {
+		group_t *gr = group_find(conv + 1);
+		if(gr == NULL) {
+			return 0;
+		}
+		group = gr->id;
+	} else if(strcmp(conv, "@") != 0) {
+		return 0;
+	}
+	if(id < 0) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&ack_mutex);
+	int moved = ack_set(id, group, strtoull(seq, NULL, 10));
+	pthread_mutex_unlock(&ack_mutex);
+	return moved;
+}
+
+/* Defined with the group history further down */
+void history_remove(group_t *gr);
+
+int apply_delete_group(const char *group_name){
+	group_t *gr = group_find(group_name);
+	if(gr == NULL) {
+		return 0;
+	}
+
+	/* Nobody is a member any more, snapshot users are copied in only if they were,
+	 * while the name still resolves to the group */
+	for(int i=0; i<user_count; i++) {
+		user_t *u = users[i];
+		if(u == NULL) {
+			if(!snapshot_in_group(i, group_name) || (u = user_materialize(i)) == NULL) {
+				continue;
+			}
+		}
+		if(bitset_clear(&u->groups, gr->id)) {
+			u->group_count--;
+		}
+	}
+
+	/* A group created later under the same name starts without history */
+	history_remove(gr);
+	group_remove(gr);
+	return 1;
+}
+
+/* Microseconds elapsed since a CLOCK_MONOTONIC timestamp */
+long elapsed_us(struct timespec *start){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* Queue one mutation record for the journal writer, call with users_lock held for writing, or held
+ * for reading with ack_mutex for an acknowledgement. Returns the record's sequence number for journal_sync() */
+long journal_append(const char *fmt, ...){
+	char record[BUFFER_SZ];
+	va_list ap;
+
+	va_start(ap, fmt);
+	int len = vsnprintf(record, sizeof(record) - 1, fmt, ap);
+	va_end(ap);
+	if(len < 0) {
+		return 0;
+	}
+	if(len > (int)sizeof(record) - 2) {
+		len = sizeof(record) - 2;
+	}
+	record[len++] = '\n';
+
+	pthread_mutex_lock(&persist_mutex);
+	if(persist_len + len > persist_cap) {
+		size_t cap = persist_cap ? persist_cap * 2 : 65536;
+		while(cap < persist_len + len) {
+			cap *= 2;
+		}
+		char *grown = (char *)realloc(persist_buf, cap);
+		if(grown == NULL) {
+			pthread_mutex_unlock(&persist_mutex);
+			perror("ERROR: journal queue full");
+			return 0;
+		}
+		persist_buf = grown;
+		persist_cap = cap;
+	}
+	memcpy(persist_buf + persist_len, record, len);
+	persist_len += len;
+	persist_pending++;
+	long seq = ++persist_enqueued;
+	pthread_cond_signal(&persist_cond);
+	pthread_mutex_unlock(&persist_mutex);
+
+	if(++journal_records == COMPACT_RECORDS) {
+		pthread_cond_signal(&compact_cond);
+	}
+	return seq;
+}
+
+/* Whether a record is on disk, or need not be */
+int journal_durable(long seq){
+	pthread_mutex_lock(&persist_mutex);
+	int durable = persist_durable >= seq;
+	pthread_mutex_unlock(&persist_mutex);
+	return durable;
+}
+
+/*
+ * In strict mode, the replies to a client's mutation wait until its record is on disk. The client
+ * is parked with them: an event loop goes on with other connections and the writer posts the client
+ * back once the record is synced, thread mode waits in its own thread. Call without users_lock
+ */
+void journal_sync(client_t *cli, long seq){
+	if(sync_mode != SYNC_STRICT || seq == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&persist_mutex);
+	int durable = persist_durable >= seq;
+	if(!durable && cli->loop != NULL) {
+		if(sync_wait_count == sync_wait_cap) {
+			int cap = sync_wait_cap ? sync_wait_cap * 2 : 64;
+			sync_wait_t *grown = (sync_wait_t *)realloc(sync_waits, cap * sizeof(sync_wait_t));
+			if(grown == NULL) {
+				/* Nothing can post the client back, so wait here as thread mode does */
+				while(persist_durable < seq) {
+					pthread_cond_wait(&durable_cond, &persist_mutex);
+				}
+				pthread_mutex_unlock(&persist_mutex);
+				return;
+			}
+			sync_waits = grown;
+			sync_wait_cap = cap;
+		}
+		sync_wait_t *w = &sync_waits[sync_wait_count++];
+		w->loop = cli->loop;
+		w->ref.slot = cli->slot;
+		w->ref.uid = cli->uid;
+		w->seq = seq;
+	}
+	pthread_mutex_unlock(&persist_mutex);
+
+	if(!durable) {
+		cli->sync_seq = seq;
+		client_park(cli, PARK_SYNC);
+	}
+}
+
+/* Journal writer: writes queued records in batches and syncs them per sync_mode */
+void *persist_loop(void *arg){
+	char *batch = NULL;
+	size_t batch_cap = 0;
+
+	pthread_mutex_lock(&persist_mutex);
+	while(1) {
+		while(persist_pending == 0 && !journal_rotate) {
+			pthread_cond_wait(&persist_cond, &persist_mutex);
+		}
+
+		/* Batch mode gathers records until the interval ends or enough have queued */
+		if(sync_mode == SYNC_BATCH) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += sync_interval_ms * 1000000L;
+			deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+			deadline.tv_nsec %= 1000000000L;
+
+			while(persist_pending < sync_records && !journal_rotate) {
+				if(pthread_cond_timedwait(&persist_cond, &persist_mutex, &deadline) == ETIMEDOUT) {
+					break;
+				}
+			}
+		}
+
+		/* Swap buffers so appenders never wait for the disk */
+		char *out = persist_buf;
+		size_t out_len = persist_len;
+		size_t out_cap = persist_cap;
+		persist_buf = batch;
+		persist_cap = batch_cap;
+		persist_len = 0;
+		batch = out;
+		batch_cap = out_cap;
+
+		int records = persist_pending;
+		long seq = persist_enqueued;
+		int rotate = journal_rotate;
+		persist_pending = 0;
+		pthread_mutex_unlock(&persist_mutex);
+
+		/* Everything before the rotation is in the compaction snapshot, later records go to a new journal */
+		if(rotate) {
+			if(sync_mode != SYNC_NONE) {
+				fsync(journal_fd);
+			}
+			close(journal_fd);
+			rename(JOURNAL_FILE, JOURNAL_OLD_FILE);
+			journal_fd = open(JOURNAL_FILE, O_WRONLY | O_CREAT | O_APPEND, 0644);
+			if(journal_fd < 0) {
+				perror("ERROR: journal open failed");
+			}
+		}
+
+		for(size_t off = 0; off < out_len; ) {
+			ssize_t n = write(journal_fd, out + off, out_len - off);
+			if(n < 0) {
+				if(errno == EINTR) {
+					continue;
+				}
+				perror("ERROR: journal write failed");
+				break;
+			}
+			off += n;
+		}
+
+		long sync_us = 0;
+		if(sync_mode != SYNC_NONE && records > 0) {
+			struct timespec start;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			if(fdatasync(journal_fd) < 0) {
+				perror("ERROR: journal sync failed");
+			}
+			sync_us = elapsed_us(&start);
+		}
+
+		pthread_mutex_lock(&persist_mutex);
+		if(records > 0) {
+			persist_stats.records += records;
+			persist_stats.batches++;
+			if(records > persist_stats.max_batch) {
+				persist_stats.max_batch = records;
+			}
+			if(sync_mode != SYNC_NONE) {
+				persist_stats.syncs++;
+				persist_stats.sync_us_total += sync_us;
+				if(sync_us > persist_stats.sync_us_max) {
+					persist_stats.sync_us_max = sync_us;
+				}
+			}
+		}
+		persist_durable = seq;
+		if(rotate) {
+			journal_rotate = 0;
+		}
+		pthread_cond_broadcast(&durable_cond);
+
+		/* Clients parked on these records are posted back to their loops */
+		int kept = 0;
+		for(int i=0; i<sync_wait_count; i++) {
+			sync_wait_t *w = &sync_waits[i];
+			if(w->seq > seq || loop_post(w->loop, w->ref.slot, w->ref.uid) < 0) {
+				sync_waits[kept++] = *w;
+			}
+		}
+		sync_wait_count = kept;
+	}
+
+	return NULL;
+}
+
+/* Apply every record of a journal file, returns the number of records */
+int journal_replay(const char *fname){
+	FILE *file;
+	char *line = NULL;
+	size_t len = 0;
+	int records = 0;
+
+	if((file = fopen(fname, "r")) == NULL) {
+		return 0;
+	}
+
+	while(getline(&line, &len, file) != -1) {
+		str_trim_lf(line, strlen(line));
+
+		char *op = strtok(line, ":");
+		char *name = strtok(NULL, ":");
+		char *arg = strtok(NULL, ":");
+		if(op == NULL || name == NULL || arg == NULL) {
+			continue;
+		}
+
+		if(strcmp(op, "register") == 0) {
+			/* register:name:password:group:group... */
+			user_t *u = user_add(name, arg);
+			char *g;
+			while(u != NULL && (g = strtok(NULL, ":")) != NULL) {
+				apply_enter_group(u, g);
+			}
+		} else if(strcmp(op, "cgroup") == 0) {
+			apply_create_group(name, arg);
+		} else if(strcmp(op, "dgroup") == 0) {
+			apply_delete_group(name);
+		} else if(strcmp(op, "ack") == 0) {
+			/* ack:user:conversation:seq */
+			char *seq = strtok(NULL, ":");
+			if(seq != NULL) {
+				apply_ack(name, arg, seq);
+			}
+		} else {
+			user_t *u = user_find(name);
+			if(u == NULL) {
+				continue;
+			} else if(strcmp(op, "acontact") == 0) {
+				apply_add_contact(u, arg);
+			} else if(strcmp(op, "dcontact") == 0) {
+				apply_delete_contact(u, arg);
+			} else if(strcmp(op, "egroup") == 0) {
+				apply_enter_group(u, arg);
+			}
+		}
+		records++;
+	}
+
+	free(line);
+	fclose(file);
+	return records;
+}
+
+/* Serialize users, groups and acknowledgements, call with users_lock and ack_mutex held.
+ * In binary mode the users and groups go to users_buf and groups_buf is NULL */
+int snapshot_take(char **users_buf, size_t *users_len, char **groups_buf, size_t *groups_len,
+	char **acks_buf, size_t *acks_len){
+	FILE *m = open_memstream(acks_buf, acks_len);
+	write_acks(m);
+	fclose(m);
+
+	if(snapshot_binary) {
+		*groups_buf = NULL;
+		*groups_len = 0;
+		if(snapshot_build(users_buf, users_len) < 0) {
+			free(*acks_buf);
+			return -1;
+		}
+		return 0;
+	}
+
+	m = open_memstream(users_buf, users_len);
+	write_users(m);
+	fclose(m);
+
+	m = open_memstream(groups_buf, groups_len);
+	write_groups(m);
+	fclose(m);
+	return 0;
+}
+
+/* Write a snapshot to the binary snapshot file, or to the users and groups files, and the acknowledgements */
+int snapshot_save(char *users_buf, size_t users_len, char *groups_buf, size_t groups_len,
+	char *acks_buf, size_t acks_len){
+	int result = 0;
+
+	if(snapshot_binary) {
+		result = write_file(SNAPSHOT_FILE, users_buf, users_len);
+	} else if(write_file("users.txt", users_buf, users_len) < 0
+		|| write_file("groups.txt", groups_buf, groups_len) < 0) {
+		result = -1;
+	}
+	if(result == 0 && write_file(ACKS_FILE, acks_buf, acks_len) < 0) {
+		result = -1;
+	}
+	sync_dir();
+
+	free(users_buf);
+	free(groups_buf);
+	free(acks_buf);
+	return result;
+}
+
+/* Fold the journal into new users and groups files */
+int journal_compact(void){
+	char *users_buf, *groups_buf, *acks_buf;
+	size_t users_len, groups_len, acks_len;
+
+	/* Deliveries go on while the snapshot is taken, mutations, acknowledgements and their journal records wait */
+	pthread_rwlock_rdlock(&users_lock);
+	if(journal_records == 0) {
+		pthread_rwlock_unlock(&users_lock);
+		return 0;
+	}
+
+	pthread_mutex_lock(&ack_mutex);
+	if(snapshot_take(&users_buf, &users_len, &groups_buf, &groups_len, &acks_buf, &acks_len) < 0) {
+		pthread_mutex_unlock(&ack_mutex);
+		pthread_rwlock_unlock(&users_lock);
+		return -1;
+	}
+	int records = journal_records;
+	journal_records = 0;
+
+	/* Later mutations go to a new journal, the old one is kept until the snapshot is on disk */
+	pthread_mutex_lock(&persist_mutex);
+	journal_rotate = 1;
+	pthread_cond_signal(&persist_cond);
+	pthread_mutex_unlock(&persist_mutex);
+	pthread_mutex_unlock(&ack_mutex);
+	pthread_rwlock_unlock(&users_lock);
+
+	pthread_mutex_lock(&persist_mutex);
+	while(journal_rotate) {
+		pthread_cond_wait(&durable_cond, &persist_mutex);
+	}
+	pthread_mutex_unlock(&persist_mutex);
+
+	if(snapshot_save(users_buf, users_len, groups_buf, groups_len, acks_buf, acks_len) < 0) {
+		printf("ERROR: Compaction failed, keeping %s\n", JOURNAL_OLD_FILE);
+		return -1;
+	}
+	unlink(JOURNAL_OLD_FILE);
+
+	printf("Compacted %d journal records\n", records);
+	return 0;
+}
+
+/* Compact the journal periodically, or early once it grows large */
+void *compaction_loop(void *arg){
+	while(1) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += COMPACT_INTERVAL;
+
+		pthread_mutex_lock(&compact_mutex);
+		pthread_cond_timedwait(&compact_cond, &compact_mutex, &deadline);
+		pthread_mutex_unlock(&compact_mutex);
+
+		journal_compact();
+	}
+
+	return NULL;
+}
+
+/* Replay the journal over the loaded files and start compacting in the background */
+int journal_open(void){
+	/* The acknowledgements of the last compaction come first, they are records too.
+	 * A compaction that did not finish leaves the previous journal behind */
+	journal_replay(ACKS_FILE);
+	int records = journal_replay(JOURNAL_OLD_FILE);
+	records += journal_replay(JOURNAL_FILE);
+
+	printf("Replayed %d journal records\n", records);
+
+	if(records > 0) {
+		char *users_buf, *groups_buf, *acks_buf;
+		size_t users_len, groups_len, acks_len;
+
+		if(snapshot_take(&users_buf, &users_len, &groups_buf, &groups_len, &acks_buf, &acks_len) < 0
+			|| snapshot_save(users_buf, users_len, groups_buf, groups_len, acks_buf, acks_len) < 0) {
+			return -1;
+		}
+		unlink(JOURNAL_OLD_FILE);
+		unlink(JOURNAL_FILE);
+	}
+
+	journal_fd = open(JOURNAL_FILE, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if(journal_fd < 0) {
+		perror("ERROR: journal open failed");
+		return -1;
+	}
+
+	pthread_t tid;
+	if(pthread_create(&tid, NULL, &persist_loop, NULL) != 0
+		|| pthread_create(&tid, NULL, &compaction_loop, NULL) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/* Directory of a group's history, the name is hex encoded so any group name makes a file name.
+ * A user's personal messages are under @ and the user name, which no group directory starts with */
+void history_dir(const char *name, int personal, char *buf, size_t size){
+	int n = snprintf(buf, size, "%s/%s", HISTORY_DIR, personal ? "@" : "");
+
+	for(const unsigned char *p = (const unsigned char *)name; *p != '\0' && n + 3 <= (int)size; p++) {
+		n += snprintf(buf + n, size - n, "%02x", *p);
+	}
+}
+
+/* Path of a segment file, ext is "log" or "idx" */
+void history_path(history_t *h, uint64_t first, const char *ext, char *buf, size_t size){
+	snprintf(buf, size, "%s/%020llu.%s", h->dir, (unsigned long long)first, ext);
+}
+
+/* Remember where message first + count of a segment starts if it is due an index entry */
+int history_index(history_seg_t *seg, uint32_t off){
+	if(seg->count % HISTORY_STRIDE != 0) {
+		return 0;
+	}
+	uint32_t k = seg->count / HISTORY_STRIDE;
+	if(k == seg->index_cap) {
+		uint32_t cap = seg->index_cap ? seg->index_cap * 2 : 16;
+		uint32_t *grown = (uint32_t *)realloc(seg->index, cap * sizeof(uint32_t));
+		if(grown == NULL) {
+			return -1;
+		}
+		seg->index = grown;
+		seg->index_cap = cap;
+	}
+	seg->index[k] = off;
+	return 1;
+}
+
+/* Delete a segment's files and free its index */
+void history_delete(history_t *h, history_seg_t *seg){
+	char path[sizeof(h->dir) + 32];
+
+	history_path(h, seg->first, "log", path, sizeof(path));
+	unlink(path);
+	history_path(h, seg->first, "idx", path, sizeof(path));
+	unlink(path);
+	free(seg->index);
+}
+
+/* Forget the oldest segment and delete its files */
+void history_drop_oldest(history_t *h){
+	history_delete(h, &h->segs[0]);
+	memmove(h->segs, h->segs + 1, (h->seg_count - 1) * sizeof(history_seg_t));
+	h->seg_count--;
+}
+
+/* Start a segment for messages from first on, the oldest goes if the group has too many.
+ * Called by the writer, which takes h->mutex only to change the segments */
+int history_start(history_t *h, uint64_t first){
+	char path[sizeof(h->dir) + 32];
+
+	if(h->fd >= 0) {
+		close(h->fd);
+		close(h->idx_fd);
+		h->fd = h->idx_fd = -1;
+	}
+
+	mkdir(HISTORY_DIR, 0755);
+	mkdir(h->dir, 0755);
+	history_path(h, first, "log", path, sizeof(path));
+	h->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	history_path(h, first, "idx", path, sizeof(path));
+	h->idx_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if(h->fd < 0 || h->idx_fd < 0) {
+		perror(path);
+		if(h->fd >= 0) {
+			close(h->fd);
+		}
+		h->fd = h->idx_fd = -1;
+		return -1;
+	}
+
+	history_seg_t oldest = { 0 };
+	pthread_mutex_lock(&h->mutex);
+	if(h->seg_count == HISTORY_SEGMENTS) {
+		oldest = h->segs[0];
+		memmove(h->segs, h->segs + 1, (h->seg_count - 1) * sizeof(history_seg_t));
+		h->seg_count--;
+	}
+	history_seg_t *seg = &h->segs[h->seg_count++];
+	memset(seg, 0, sizeof(*seg));
+	seg->first = first;
+	pthread_mutex_unlock(&h->mutex);
+
+	/* A replay planned from the oldest segment holds it open */
+	if(oldest.first > 0) {
+		history_delete(h, &oldest);
+	}
+	return 0;
+}
+
+/* Read whole frames from a segment at *off into buf, at most cap bytes and *n frames. Returns the bytes */
+size_t history_read(int fd, off_t *off, char *buf, size_t cap, int *n){
+	ssize_t got = pread(fd, buf, cap, *off);
+	size_t used = 0;
+
+	while(*n > 0 && got > 0 && used + FRAME_HDR <= (size_t)got) {
+		unsigned char *hdr = (unsigned char *)buf + used;
+		size_t len = FRAME_HDR + (((size_t)hdr[2] << 8) | hdr[3]);
+		if(hdr[0] != PROTO_VERSION || used + len > (size_t)got) {
+			break;
+		}
+		used += len;
+		(*n)--;
+	}
+	*off += used;
+	return used;
+}
+
+/* Offset of the frame skip frames after off, walking the headers */
+off_t history_skip(int fd, off_t off, int skip){
+	unsigned char hdr[FRAME_HDR];
+
+	while(skip-- > 0 && pread(fd, hdr, FRAME_HDR, off) == FRAME_HDR) {
+		off += FRAME_HDR + (((size_t)hdr[2] << 8) | hdr[3]);
+	}
+	return off;
+}
+
+/* Index a segment left by an earlier run from its .idx file and the frames after the last entry.
+ * The segment ends at the last whole frame, anything after it is cut off */
+int history_scan(history_t *h, history_seg_t *seg){
+	char path[sizeof(h->dir) + 32];
+	struct stat st;
+
+	history_path(h, seg->first, "log", path, sizeof(path));
+	int fd = open(path, O_RDWR);
+	if(fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		if(fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+
+	/* Entries past the end point at frames a crash lost */
+	history_path(h, seg->first, "idx", path, sizeof(path));
+	int idx_fd = open(path, O_RDONLY);
+	uint32_t off, k = 0;
+	while(idx_fd >= 0 && read(idx_fd, &off, sizeof(off)) == sizeof(off) && off < (uint64_t)st.st_size) {
+		seg->count = k * HISTORY_STRIDE;
+		if(history_index(seg, off) < 0) {
+			break;
+		}
+		k++;
+	}
+	if(idx_fd >= 0) {
+		close(idx_fd);
+	}
+
+	/* Count the frames from the last entry on */
+	seg->count = k > 0 ? (k - 1) * HISTORY_STRIDE : 0;
+	off_t end = k > 0 ? seg->index[k - 1] : 0;
+	unsigned char hdr[FRAME_HDR];
+	while(pread(fd, hdr, FRAME_HDR, end) == FRAME_HDR && hdr[0] == PROTO_VERSION) {
+		off_t next = end + FRAME_HDR + (((size_t)hdr[2] << 8) | hdr[3]);
+		if(next > st.st_size || history_index(seg, end) < 0) {
+			break;
+		}
+		seg->count++;
+		end = next;
+	}
+	if(end < st.st_size && ftruncate(fd, end) < 0) {
+		perror(path);
+	}
+	close(fd);
+	seg->size = end;
+	return 0;
+}
+
+/* Sort segment sequence numbers */
+int history_cmp(const void *a, const void *b){
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* A history with nothing in it yet, its directory is made once the writer has something for it */
+history_t *history_new(const char *dir_name){
+	history_t *h = (history_t *)calloc(1, sizeof(history_t));
+	if(h == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&h->mutex, NULL);
+	h->fd = h->idx_fd = -1;
+	h->next = h->written = 1;
+	snprintf(h->dir, sizeof(h->dir), "%s", dir_name);
+	return h;
+}
+
+/* Load the segments an earlier run left in a history's directory, at startup. The ring fills
+ * with the messages that come after, older ones are read from the segments */
+int history_load(history_t *h){
+	DIR *dir = opendir(h->dir);
+	if(dir == NULL) {
+		perror(h->dir);
+		return -1;
+	}
+
+	uint64_t *firsts = NULL;
+	int found = 0, cap = 0;
+	struct dirent *e;
+	while((e = readdir(dir)) != NULL) {
+		char *end;
+		uint64_t first = strtoull(e->d_name, &end, 10);
+		if(end == e->d_name || strcmp(end, ".log") != 0) {
+			continue;
+		}
+		if(found == cap) {
+			cap = cap ? cap * 2 : HISTORY_SEGMENTS + 1;
+			uint64_t *grown = (uint64_t *)realloc(firsts, cap * sizeof(uint64_t));
+			if(grown == NULL) {
+				break;
+			}
+			firsts = grown;
+		}
+		firsts[found++] = first;
+	}
+	closedir(dir);
+	qsort(firsts, found, sizeof(uint64_t), history_cmp);
+
+	/* The newest segments are kept, older ones are what a crash left before deleting them */
+	for(int i=0; i<found; i++) {
+		if(i + HISTORY_SEGMENTS < found) {
+			h->segs[0].first = firsts[i];
+			h->seg_count = 1;
+			history_drop_oldest(h);
+			continue;
+		}
+		history_seg_t *seg = &h->segs[h->seg_count++];
+		seg->first = firsts[i];
+		if(history_scan(h, seg) < 0) {
+			h->seg_count--;
+			continue;
+		}
+		/* A segment a crash left without a whole frame has nothing to index */
+		if(seg->count == 0) {
+			history_delete(h, seg);
+			h->seg_count--;
+			continue;
+		}
+		h->next = h->written = seg->first + seg->count;
+	}
+	free(firsts);
+
+	/* Appends go on in the last segment */
+	if(h->seg_count > 0) {
+		char path[sizeof(h->dir) + 32];
+		history_path(h, h->segs[h->seg_count - 1].first, "log", path, sizeof(path));
+		h->fd = open(path, O_WRONLY | O_APPEND);
+		history_path(h, h->segs[h->seg_count - 1].first, "idx", path, sizeof(path));
+		h->idx_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+		history_seg_t *seg = &h->segs[h->seg_count - 1];
+		for(uint32_t k=0; h->idx_fd >= 0 && k * HISTORY_STRIDE < seg->count; k++) {
+			if(write(h->idx_fd, &seg->index[k], sizeof(uint32_t)) < 0) {
+				perror(path);
+			}
+		}
+	}
+	return 0;
+}
+
+/* A group's history, made on first use if the group had none at startup. Call with users_lock held */
+history_t *history_get(group_t *gr){
+	history_t *h = gr->history;
+
+	if(h == NULL) {
+		pthread_mutex_lock(&history_mutex);
+		if((h = gr->history) == NULL) {
+			char dir_name[sizeof(h->dir)];
+			history_dir(gr->name, 0, dir_name, sizeof(dir_name));
+			h = gr->history = history_new(dir_name);
+		}
+		pthread_mutex_unlock(&history_mutex);
+	}
+	return h;
+}
+
+/* The history of user id's personal messages, made on first use if there was none at startup.
+ * Call with users_lock held */
+history_t *history_personal(int id){
+	history_t *h = NULL;
+
+	pthread_mutex_lock(&history_mutex);
+	if(id >= personal_log_cap) {
+		int n = personal_log_cap ? personal_log_cap : 1024;
+		while(n <= id) {
+			n *= 2;
+		}
+		history_t **grown = (history_t **)realloc(personal_logs, n * sizeof(history_t *));
+		if(grown == NULL) {
+			pthread_mutex_unlock(&history_mutex);
+			return NULL;
+		}
+		memset(grown + personal_log_cap, 0, (n - personal_log_cap) * sizeof(history_t *));
+		personal_logs = grown;
+		personal_log_cap = n;
+	}
+	if((h = personal_logs[id]) == NULL) {
+		char dir_name[sizeof(h->dir)];
+		history_dir(user_name(id), 1, dir_name, sizeof(dir_name));
+		h = personal_logs[id] = history_new(dir_name);
+	}
+	pthread_mutex_unlock(&history_mutex);
+	return h;
+}
+
+/* Put a history on the writer's list, call with h->mutex held */
+void history_enqueue(history_t *h){
+	pthread_mutex_lock(&history_queue_mutex);
+	if(history_queue_count == history_queue_cap) {
+		int cap = history_queue_cap ? history_queue_cap * 2 : 64;
+		history_t **grown = (history_t **)realloc(history_queue, cap * sizeof(history_t *));
+		if(grown == NULL) {
+			perror("ERROR: history queue full");
+			exit(EXIT_FAILURE);
+		}
+		history_queue = grown;
+		history_queue_cap = cap;
+	}
+	history_queue[history_queue_count++] = h;
+	h->queued = 1;
+	pthread_cond_signal(&history_queue_cond);
+	pthread_mutex_unlock(&history_queue_mutex);
+}
+
+/* Record m as the next message of a history: in the ring by reference, and pending for the writer,
+ * so the delivery path never waits for the disk. Call with h->mutex held */
+void history_append(history_t *h, msg_t *m){
+	uint64_t seq = h->next++;
+	msg_t **slot = &h->ring[seq % HISTORY_RING];
+	msg_unref(*slot);
+	m->refs++;
+	*slot = m;
+
+	if(h->pending_count == h->pending_cap) {
+		int cap = h->pending_cap ? h->pending_cap * 2 : 16;
+		msg_t **grown = (msg_t **)realloc(h->pending, cap * sizeof(msg_t *));
+		if(grown == NULL) {
+			perror("ERROR: history queue full");
+			exit(EXIT_FAILURE);
+		}
+		h->pending = grown;
+		h->pending_cap = cap;
+	}
+	m->refs++;
+	h->pending[h->pending_count++] = m;
+
+	if(!h->queued) {
+		history_enqueue(h);
+	}
+}
+
+/* The oldest message of a history still kept, call with h->mutex held */
+uint64_t history_oldest(history_t *h){
+	return h->seg_count > 0 ? h->segs[0].first : h->written;
+}
+
+/* The first of messages from..to-1 from which on a history has them all in memory, the ones the
+ * writer has not got to and the newest in the ring. Call with h->mutex held */
+uint64_t history_cached(history_t *h, uint64_t from, uint64_t to){
+	uint64_t seq = to;
+
+	while(seq > from && (seq > h->written
+		|| (seq + HISTORY_RING > h->next && h->ring[(seq - 1) % HISTORY_RING] != NULL))) {
+		seq--;
+	}
+	return seq;
+}
+
+/* Plan sending messages from..to-1 of a history, call with h->mutex held. What is in memory goes by
+ * reference, older pages from the segments */
+void history_plan(history_t *h, uint64_t from, uint64_t to, replay_t *r){
+	r->page_count = r->page_next = 0;
+	r->recent_count = r->recent_next = 0;
+	r->recent = NULL;
+
+	uint64_t seq = history_cached(h, from, to);
+	if(seq < to && (r->recent = (msg_t **)malloc((to - seq) * sizeof(msg_t *))) == NULL) {
+		seq = to;
+	}
+	for(uint64_t s = seq; s < to; s++) {
+		msg_t *m = s >= h->written ? h->pending[s - h->written] : h->ring[s % HISTORY_RING];
+		m->refs++;
+		r->recent[r->recent_count++] = m;
+	}
+
+	/* Messages before a segment that are in none are gone */
+	uint64_t next = from;
+	for(int i=0; i<h->seg_count && next < seq; i++) {
+		history_seg_t *sg = &h->segs[i];
+		if(next < sg->first) {
+			next = sg->first;
+		}
+		uint64_t end = sg->first + sg->count < seq ? sg->first + sg->count : seq;
+		if(end <= next || sg->index == NULL) {
+			continue;
+		}
+		char path[sizeof(h->dir) + 32];
+		history_path(h, sg->first, "log", path, sizeof(path));
+		int fd = open(path, O_RDONLY);
+		if(fd >= 0) {
+			uint32_t k = (next - sg->first) / HISTORY_STRIDE;
+			r->pages[r->page_count].fd = fd;
+			r->pages[r->page_count].off = history_skip(fd, sg->index[k], next - sg->first - k * HISTORY_STRIDE);
+			r->pages[r->page_count].count = end - next;
+			if(end == sg->first + sg->count) {
+				r->pages[r->page_count].end = sg->size;
+			} else {
+				k = (end - sg->first) / HISTORY_STRIDE;
+				r->pages[r->page_count].end = history_skip(fd, sg->index[k], end - sg->first - k * HISTORY_STRIDE);
+			}
+			r->page_count++;
+		}
+		next = end;
+	}
+}
+
+/* Release what is left of a planned replay */
+void history_release(replay_t *r){
+	for(; r->page_next < r->page_count; r->page_next++) {
+		close(r->pages[r->page_next].fd);
+	}
+	for(; r->recent_next < r->recent_count; r->recent_next++) {
+		msg_unref(r->recent[r->recent_next]);
+	}
+	free(r->recent);
+	r->recent = NULL;
+}
+
+/*
+ * Queue a planned replay, as long as the client's queue has room unless paced is 0, and release
+ * what went. Segments hold the frames as sent, so a page is queued as a file message and goes out
+ * with sendfile when the socket allows it. Otherwise it is copied in large messages.
+ * 1 once all is queued, 0 while it waits for room, -1 if the client stopped taking it
+ */
+int history_send(client_t *cli, replay_t *r, int paced){
+	size_t chunk = out_limit / 2 < REPLAY_CHUNK ? out_limit / 2 : REPLAY_CHUNK;
+	if(chunk < 2 * BUFFER_SZ) {
+		chunk = 2 * BUFFER_SZ;
+	}
+	int result = 1;
+
+	while(result > 0 && r->page_next < r->page_count) {
+		struct replay_page *p = &r->pages[r->page_next];
+		if(p->count == 0) {
+			close(p->fd);
+			r->page_next++;
+			continue;
+		}
+		size_t len = client_zero_copy(cli) ? p->end - p->off : chunk;
+		if(paced && (result = client_room(cli, len)) <= 0) {
+			break;
+		}
+
+		/* A file message owns the descriptor from here on */
+		msg_t *m = client_zero_copy(cli) ? msg_file(p->fd, p->off, len) : NULL;
+		if(m != NULL) {
+			r->page_next++;
+		} else if((m = msg_alloc(chunk)) != NULL) {
+			m->refs = 1;
+			m->len = history_read(p->fd, &p->off, m->data, chunk, &p->count);
+		}
+		if(m == NULL || m->len == 0 || client_send_msg(cli, m) < 0) {
+			result = -1;
+		}
+		msg_unref(m);
+	}
+	while(result > 0 && r->recent_next < r->recent_count) {
+		msg_t *m = r->recent[r->recent_next];
+		if(paced && (result = client_room(cli, m->len)) <= 0) {
+			break;
+		}
+		if(client_send_msg(cli, m) < 0) {
+			result = -1;
+		}
+		msg_unref(m);
+		r->recent_next++;
+	}
+
+	if(result != 0) {
+		history_release(r);
+	}
+	return result;
+}
+
+/* Delete a history directory and everything in it */
+void history_rmdir(const char *dir_name){
+	DIR *dir = opendir(dir_name);
+	if(dir == NULL) {
+		return;
+	}
+	struct dirent *e;
+	while((e = readdir(dir)) != NULL) {
+		char path[512];
+		if(e->d_name[0] != '.') {
+			snprintf(path, sizeof(path), "%s/%s", dir_name, e->d_name);
+			unlink(path);
+		}
+	}
+	closedir(dir);
+	rmdir(dir_name);
+}
+
+/* Forget a deleted group's history, call with users_lock held for writing. The writer deletes its
+ * files once it has written what was pending, before anything of a group by the same name */
+void history_remove(group_t *gr){
+	history_t *h = gr->history;
+
+	if(h != NULL) {
+		pthread_mutex_lock(&h->mutex);
+		h->removed = 1;
+		if(!h->queued) {
+			history_enqueue(h);
+		}
+		pthread_mutex_unlock(&h->mutex);
+		gr->history = NULL;
+	}
+}
+
+/* Free a removed history and delete its directory, nothing else can reach it any more */
+void history_free(history_t *h){
+	for(int i=0; i<HISTORY_RING; i++) {
+		msg_unref(h->ring[i]);
+	}
+	for(int i=0; i<h->pending_count; i++) {
+		msg_unref(h->pending[i]);
+	}
+	free(h->pending);
+	for(int i=0; i<h->seg_count; i++) {
+		free(h->segs[i].index);
+	}
+	if(h->fd >= 0) {
+		close(h->fd);
+		close(h->idx_fd);
+	}
+	history_rmdir(h->dir);
+	pthread_mutex_destroy(&h->mutex);
+	free(h);
+}
+
+/* Append message seq to the last segment, or start the next one. Called by the writer */
+void history_write(history_t *h, msg_t *m, uint64_t seq){
+	history_seg_t *seg = h->seg_count > 0 ? &h->segs[h->seg_count - 1] : NULL;
+
+	if(seg == NULL || h->fd < 0 || seg->size + m->len > HISTORY_SEGMENT) {
+		if(history_start(h, seq) < 0) {
+			return;
+		}
+		seg = &h->segs[h->seg_count - 1];
+	}
+
+	uint32_t off = seg->size;
+	if(seg->count % HISTORY_STRIDE == 0 && write(h->idx_fd, &off, sizeof(off)) < 0) {
+		perror("ERROR: history index write failed");
+	}
+	if(write(h->fd, m->data, m->len) != (ssize_t)m->len) {
+		perror("ERROR: history write failed");
+	}
+
+	pthread_mutex_lock(&h->mutex);
+	if(history_index(seg, off) < 0) {
+		perror("ERROR: history index full");
+	}
+	seg->size += m->len;
+	seg->count++;
+	pthread_mutex_unlock(&h->mutex);
+}
+
+/* History writer: appends the pending messages of the histories on its list to their segments, so
+ * the delivery path never waits for the disk. The page cache takes the writes, history is not synced */
+void *history_loop(void *arg){
+	history_t **batch = NULL;
+	int batch_cap = 0;
+	msg_t **msgs = NULL;
+	int msgs_cap = 0;
+
+	pthread_mutex_lock(&history_queue_mutex);
+	while(1) {
+		while(history_queue_count == 0) {
+			pthread_cond_wait(&history_queue_cond, &history_queue_mutex);
+		}
+
+		/* Swap lists so appenders never wait for the disk */
+		history_t **list = history_queue;
+		int count = history_queue_count;
+		int cap = history_queue_cap;
+		history_queue = batch;
+		history_queue_cap = batch_cap;
+		history_queue_count = 0;
+		batch = list;
+		batch_cap = cap;
+		pthread_mutex_unlock(&history_queue_mutex);
+
+		for(int i=0; i<count; i++) {
+			history_t *h = batch[i];
+
+			/* The messages stay pending, so a replay finds them, until they are in the segments */
+			pthread_mutex_lock(&h->mutex);
+			h->queued = 0;
+			int removed = h->removed;
+			int n = h->pending_count;
+			if(n > msgs_cap) {
+				msgs_cap = n > 2 * msgs_cap ? n : 2 * msgs_cap;
+				msgs = (msg_t **)realloc(msgs, msgs_cap * sizeof(msg_t *));
+				if(msgs == NULL) {
+					perror("ERROR: history writer out of memory");
+					exit(EXIT_FAILURE);
+				}
+			}
+			memcpy(msgs, h->pending, n * sizeof(msg_t *));
+			uint64_t seq = h->written;
+			pthread_mutex_unlock(&h->mutex);
+
+			if(removed) {
+				history_free(h);
+				continue;
+			}
+			for(int j=0; j<n; j++) {
+				history_write(h, msgs[j], seq + j);
+			}
+
+			pthread_mutex_lock(&h->mutex);
+			memmove(h->pending, h->pending + n, (h->pending_count - n) * sizeof(msg_t *));
+			h->pending_count -= n;
+			h->written += n;
+			pthread_mutex_unlock(&h->mutex);
+			for(int j=0; j<n; j++) {
+				msg_unref(msgs[j]);
+			}
+		}
+		pthread_mutex_lock(&history_queue_mutex);
+	}
+
+	return NULL;
+}
+
+/* Load the histories an earlier run left and start the writer. Histories are never read in while
+ * serving, one made later starts empty; what is left of a group that is gone goes */
+int history_open(void){
+	if(mkdir(HISTORY_DIR, 0755) < 0 && errno != EEXIST) {
+		perror(HISTORY_DIR);
+		return -1;
+	}
+	DIR *dir = opendir(HISTORY_DIR);
+	if(dir == NULL) {
+		perror(HISTORY_DIR);
+		return -1;
+	}
+
+	int loaded = 0;
+	struct dirent *e;
+	while((e = readdir(dir)) != NULL) {
+		char name[STR_SIZE + 1], dir_name[sizeof(HISTORY_DIR) + sizeof(e->d_name)];
+		int personal = e->d_name[0] == '@';
+		const char *hex = e->d_name + personal;
+		size_t len = strlen(hex);
+		if(len == 0 || len % 2 != 0 || len / 2 > STR_SIZE || strspn(hex, "0123456789abcdef") != len) {
+			continue;
+		}
+		for(size_t i=0; i<len / 2; i++) {
+			unsigned int c;
+			sscanf(hex + 2 * i, "%2x", &c);
+			name[i] = c;
+		}
+		name[len / 2] = '\0';
+		snprintf(dir_name, sizeof(dir_name), "%s/%s", HISTORY_DIR, e->d_name);
+
+		history_t *h = NULL;
+		if(personal) {
+			int id = user_id(name);
+			h = id >= 0 ? history_personal(id) : NULL;
+		} else {
+			group_t *gr = group_find(name);
+			if(gr == NULL) {
+				history_rmdir(dir_name);
+				continue;
+			}
+			h = history_get(gr);
+		}
+		if(h == NULL) {
+			continue;
+		}
+		if(history_load(h) < 0) {
+			closedir(dir);
+			return -1;
+		}
+		loaded++;
+	}
+	closedir(dir);
+	printf("History: %d logs loaded\n", loaded);
+
+	pthread_t tid;
+	if(pthread_create(&tid, NULL, &history_loop, NULL) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/* Send a personal message to a contact */
+int send_pm(char *s, char *contact_name, client_t *cl){
+	/* The contact is reached through its user record, the users lock keeps its sessions alive */
+	pthread_rwlock_rdlock(&users_lock);
+
+	int id = user_id(contact_name);
+	int result = id >= 0 && id_set_has(&cl->user->contacts, id) ? 0 : -1;
+
+	if(result == 0) {
+		/* Every connection of the contact gets the same buffer, numbered in the contact's personal
+		 * history, which stays locked until the message is out so they arrive in order */
+		history_t *h = history_personal(id);
+		msg_t *m;
+		if(h != NULL) {
+			pthread_mutex_lock(&h->mutex);
+			m = msg_seq("@", h->next, "[PM]%s: %s\n", cl->name, s);
+			if(m != NULL) {
+				history_append(h, m);
+			}
+		} else {
+			m = msg_text("[PM]%s: %s\n", cl->name, s);
+		}
+
+		/* Anyone online was loaded at login, a user still in the snapshot is offline */
+		user_t *u = users[id];
+		if(u != NULL && u->sessions != NULL) {
+			for(client_t *c = u->sessions; c != NULL; c = c->session_next) {
+				if(relay(cl, c, m) >= 0){
+					result = 1; // message sent, it stays 0 when no session took it
+				}
+			}
+		} else if(m != NULL && h != NULL) {
+			result = 2; // message kept in the history until the contact logs in
+		}
+		if(h != NULL) {
+			pthread_mutex_unlock(&h->mutex);
+		}
+		msg_unref(m);
+	}
+
+	pthread_rwlock_unlock(&users_lock);
+	return result;
+}
+
+/* Send group message */
+int send_gm(char *message, char *group_name, client_t *cl){
+	/* Members are reached through their sessions, which the users lock keeps alive */
+	pthread_rwlock_rdlock(&users_lock);
+
+	int result = -1; // Group name not found in groups
+	int u_found_in_group = -1; // User not found in group
+
+	group_t *gr = group_find(group_name);
+	if(gr != NULL) {
+		result = 0; // Group name found in groups
+		if(bitset_test(&cl->user->groups, gr->id)) {
+			u_found_in_group = 0; // User found in group
+		}
+		if(u_found_in_group == 0) {
+			/* Encoded once, every member's queue holds a reference to the same buffer, and so does the history.
+			 * The history stays locked until the message is out, so members get the group's messages in order */
+			char conv[STR_SIZE + 1];
+			snprintf(conv, sizeof(conv), "#%s", gr->name);
+			history_t *h = history_get(gr);
+			msg_t *m;
+			if(h != NULL) {
+				pthread_mutex_lock(&h->mutex);
+				m = msg_seq(conv, h->next, "[%s]%s: %s\n", group_name, cl->name, message);
+				if(m != NULL) {
+					history_append(h, m);
+				}
+			} else {
+				m = msg_text("[%s]%s: %s\n", group_name, cl->name, message);
+			}
+
+			/* Members are resolved to their live connections, the offline ones find it in the history */
+			int offline = 0;
+			int pos = 0, id;
+			while((id = group_member_next(gr, &pos)) >= 0) {
+				user_t *u = users[id];
+				if(u == NULL || u->sessions == NULL) {
+					offline = 1;
+					continue;
+				}
+				for(client_t *c = u->sessions; c != NULL; c = c->session_next) {
+					if(c == cl) {
+						continue;
+					}
+					if(relay(cl, c, m) >= 0){
+						result = 1; // Message sent to c
+					}
+				}
+			}
+			if(h != NULL) {
+				pthread_mutex_unlock(&h->mutex);
+			}
+			if(offline && (h == NULL || m == NULL)) {
+				result = -3; // Not kept for the offline members
+			}
+			msg_unref(m);
+		} else {
+			result = -2; // User not found in group
+		}
+	}
+
+	pthread_rwlock_unlock(&users_lock);
+	return result;
+}
+
+/* Send message to all clients except sender */
+void send_message(char *s, client_t *cl){
+	msg_t *m = msg_new(OP_TEXT, s, strlen(s));
+
+	pthread_rwlock_rdlock(&clients_lock);
+
+	for(int i=0; i<client_slots; ++i){
+		if(clients[i]){
+			if(clients[i] != cl){
+				relay(cl, clients[i], m);
+			}
+		}
+	}
+
+	pthread_rwlock_unlock(&clients_lock);
+	msg_unref(m);
+}
+
+/* Bucket of a token in the session cache */
+session_t **session_bucket(const char *token){
+	return &sessions[hash_name(token) & (SESSION_BUCKETS - 1)];
+}
+
+/* Unlink the expired sessions of a bucket, call with session_mutex held */
+void session_prune(session_t **p, time_t now){
+	while(*p != NULL) {
+		session_t *s = *p;
+		if((s->expires != 0 && s->expires <= now) || s->deadline <= now) {
+			*p = s->next;
+			free(s);
+			session_stats.cached--;
+		} else {
+			p = &s->next;
+		}
+	}
+}
+
+/* Give a client that just logged in a fresh token and send it along */
+void session_issue(client_t *cli){
+	unsigned char bytes[SESSION_TOKEN];
+	session_t *s = (session_t *)malloc(sizeof(session_t));
+
+	if(s == NULL || getrandom(bytes, sizeof(bytes), 0) != sizeof(bytes)) {
+		free(s);
+		return;
+	}
+	for(int i=0; i<SESSION_TOKEN; i++) {
+		sprintf(s->token + 2 * i, "%02x", bytes[i]);
+	}
+	s->user = cli->user->id;
+	s->holder = cli->uid;
+	s->expires = 0;
+	s->deadline = time(NULL) + SESSION_LIFETIME;
+
+	pthread_mutex_lock(&session_mutex);
+	session_t **bucket = session_bucket(s->token);
+	session_prune(bucket, time(NULL));
+	s->next = *bucket;
+	*bucket = s;
+	session_stats.issued++;
+	session_stats.cached++;
+	pthread_mutex_unlock(&session_mutex);
+
+	memcpy(cli->token, s->token, sizeof(cli->token));
+	client_send(cli, OP_TOKEN, cli->token, 2 * SESSION_TOKEN);
+}
+
+/* A connection is gone, if it held its token last the token is good for SESSION_TTL more seconds,
+ * or up to its deadline if that comes first */
+void session_release(client_t *cli){
+	if(cli->token[0] == '\0') {
+		return;
+	}
+	pthread_mutex_lock(&session_mutex);
+	for(session_t *s = *session_bucket(cli->token); s != NULL; s = s->next) {
+		if(strcmp(s->token, cli->token) == 0) {
+			if(s->holder == cli->uid) {
+				time_t expires = time(NULL) + SESSION_TTL;
+				s->expires = expires < s->deadline ? expires : s->deadline;
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&session_mutex);
+}
+
+/* Hand a token over to a connection logging in with it: the id of the user it was issued to, -1 if
+ * it is unknown or expired. The old connection may not have closed yet, it no longer holds the token */
+int session_claim(client_t *cli, const char *token){
+	int id = -1;
+
+	pthread_mutex_lock(&session_mutex);
+	session_t **p = session_bucket(token);
+	session_prune(p, time(NULL));
+	session_t *s = *p;
+	while(s != NULL && strcmp(s->token, token) != 0) {
+		s = s->next;
+	}
+	if(s != NULL) {
+		s->holder = cli->uid;
+		s->expires = 0;
+		id = s->user;
+		memcpy(cli->token, s->token, sizeof(cli->token));
+		session_stats.reconnects++;
+	} else {
+		session_stats.rejected++;
+	}
+	pthread_mutex_unlock(&session_mutex);
+	return id;
+}
+
+/* Free the expired tokens of the whole cache every SESSION_SWEEP seconds, so tokens nobody comes
+ * back with do not pile up. The lock is dropped between runs of buckets to keep logins going */
+void *session_loop(void *arg){
+	while(1) {
+		sleep(SESSION_SWEEP);
+
+		time_t now = time(NULL);
+		for(int i=0; i<SESSION_BUCKETS; i+=1024) {
+			pthread_mutex_lock(&session_mutex);
+			for(int j=i; j<i+1024; j++) {
+				session_prune(&sessions[j], now);
+			}
+			pthread_mutex_unlock(&session_mutex);
+		}
+	}
+
+	return NULL;
+}
+
+/* Note that user u saw a conversation up to seq. It is journaled so a restart keeps it, but never
+ * synced: a crash at worst sends a few messages again. Call with users_lock held */
+void user_ack(user_t *u, int group, uint64_t seq){
+	char conv[STR_SIZE + 1];
+
+	if(group < 0) {
+		snprintf(conv, sizeof(conv), "@");
+	} else {
+		snprintf(conv, sizeof(conv), "#%s", groups[group]->name);
+	}
+	pthread_mutex_lock(&ack_mutex);
+	if(ack_set(u->id, group, seq)) {
+		journal_append("ack:%s:%s:%llu", u->name, conv, (unsigned long long)seq);
+	}
+	pthread_mutex_unlock(&ack_mutex);
+}
+
+/* The history of a conversation, NULL once its group is gone. Call with users_lock held */
+history_t *resume_log(user_t *u, int group){
+	if(group < 0) {
+		return history_personal(u->id);
+	}
+	return groups[group] != NULL ? history_get(groups[group]) : NULL;
+}
+
+/* Note that user u saw a conversation up to its newest message. Call with users_lock held */
+void user_ack_head(user_t *u, int group){
+	history_t *h = resume_log(u, group);
+	if(h == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&h->mutex);
+	uint64_t seq = h->next - 1;
+	pthread_mutex_unlock(&h->mutex);
+	if(seq > 0) {
+		user_ack(u, group, seq);
+	}
+}
+
+/* Note that user u saw every conversation up to its newest message, as the last connection of a
+ * client that does not acknowledge leaves: it got all that came while it was online. Call with
+ * users_lock held for writing, so nothing is sent to the user meanwhile */
+void user_ack_all(user_t *u){
+	user_ack_head(u, -1);
+	for(int id = bitset_next(&u->groups, 0); id >= 0; id = bitset_next(&u->groups, id + 1)) {
+		if(groups[id] != NULL) {
+			user_ack_head(u, id);
+		}
+	}
+}
+
+/* Register: check that the username is free */
+int register_name(client_t *cli, char *name){
+	if(strlen(name) <  2 || strlen(name) >= STR_SIZE-1){
+		printf("Didn't enter the name.\n");
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&users_lock);
+	user_t *existing = user_find(name);
+	pthread_rwlock_unlock(&users_lock);
+
+	if(existing != NULL) {
+		printf("Username already exists. Disconnecting...\n");
+		client_send(cli, OP_ERROR, USERNAME_ERROR, strlen(USERNAME_ERROR));
+		return -1;
+	}
+
+	strcpy(cli->name, name);
+	printf("%s registering now\n", cli->name);
+	cli->state = STATE_REGISTER_PSWD;
+	return 0;
+}
+
+/* Register: store the password and offer the groups to join */
+int register_pswd(client_t *cli, char *pswd){
+	char *buffer;
+	size_t len;
+
+	if(strlen(pswd) <  2 || strlen(pswd) >= STR_SIZE-1){
+		printf("Didn't enter the password.\n");
+		return -1;
+	}
+	strcpy(cli->pswd, pswd);
+
+	// Ask user to join groups
+	FILE *m = open_memstream(&buffer, &len);
+	pthread_rwlock_rdlock(&users_lock);
+	write_group_list(m);
+	pthread_rwlock_unlock(&users_lock);
+	fclose(m);
+
+	printf("%s\n", buffer);
+	client_send(cli, OP_GROUP_LIST, buffer, len);
+	free(buffer);
+
+	cli->state = STATE_REGISTER_GROUPS;
+	return 0;
+}
+
+/* Register: join the chosen groups and save the new user */
+int register_groups(client_t *cli, char *groups_input){
+	char buffer[BUFFER_SZ];
+	char not_found[GROUPS_SZ] = "";
+
+	if(strlen(groups_input) <  2 || strlen(groups_input) >= GROUPS_SZ-1){
+		printf("Didn't enter the groups.\n");
+		return -1;
+	}
+
+	printf("Groups entered: %s\n",groups_input);
+
+	str_trim_lf(groups_input,strlen(groups_input));
+	trim_leading(groups_input);
+
+	/* Names resolve straight to group ids, as many as were entered */
+	bitset_t chosen = {0};
+	int found = 0;
+	char *save;
+	pthread_rwlock_rdlock(&users_lock);
+	for(char *pointer = strtok_r(groups_input, ",", &save); pointer != NULL; pointer = strtok_r(NULL, ",", &save)) {
+		str_trim_lf(pointer,strlen(pointer));
+		group_t *gr = group_find(pointer);
+		if(gr == NULL) {
+			snprintf(not_found + strlen(not_found), sizeof(not_found) - strlen(not_found), " %s ", pointer);
+		} else if(bitset_set(&chosen, gr->id) == 1) {
+			found++;
+		}
+	}
+	pthread_rwlock_unlock(&users_lock);
+
+	// No valid group names to join found
+	if(found == 0) {
+		bitset_free(&chosen);
+		printf(GROUP_ERROR);
+		client_send(cli, OP_ERROR, GROUP_ERROR, strlen(GROUP_ERROR));
+		return -1;
+	}
+
+	long seq = 0;
+
+	pthread_rwlock_wrlock(&users_lock);
+	user_t *u = user_add(cli->name, cli->pswd);
+	if(u != NULL) {
+		char record[BUFFER_SZ];
+
+		printf("Saving user...\n");
+		snprintf(record, sizeof(record), "register:%s:%s", cli->name, cli->pswd);
+		user_attach(u, cli);
+		/* A group deleted since its name was looked up is left out */
+		for(int id = bitset_next(&chosen, 0); id >= 0; id = bitset_next(&chosen, id + 1)) {
+			group_t *gr = groups[id];
+			if(gr != NULL && user_join_group(u, gr)) {
+				group_add_member(gr, u->id);
+				snprintf(record + strlen(record), sizeof(record) - strlen(record), ":%s", gr->name);
+			}
+		}
+		seq = journal_append("%s", record);
+		/* The groups' messages so far are not missed, see cmd_enter_group() */
+		for(int id = bitset_next(&u->groups, 0); id >= 0; id = bitset_next(&u->groups, id + 1)) {
+			user_ack_head(u, id);
+		}
+	}
+	pthread_rwlock_unlock(&users_lock);
+	bitset_free(&chosen);
+	journal_sync(cli, seq);
+
+	/* Somebody else registered the name since it was checked */
+	if(u == NULL) {
+		printf("Username already exists. Disconnecting...\n");
+		client_send(cli, OP_ERROR, USERNAME_ERROR, strlen(USERNAME_ERROR));
+		return -1;
+	}
+
+	snprintf(buffer, sizeof(buffer), "%s", REGISTER_SUCCESS);
+	if(not_found[0] != '\0') {
+		snprintf(buffer + strlen(buffer), sizeof(buffer) - strlen(buffer), "Groups not joined:%s", not_found);
+	}
+
+	client_send(cli, OP_OK, buffer, strlen(buffer));
+	session_issue(cli);
+
+	cli->state = STATE_CHAT;
+	return 0;
+}
+
+/* Login: remember the name until the password arrives */
+int login_name(client_t *cli, char *name){
+	printf("Logging in...\n");
+
+	if(strlen(name) <  2 || strlen(name) >= STR_SIZE-1){
+		printf("Didn't enter the name.\n");
+		return -1;
+	}
+	strcpy(cli->name, name);
+
+	cli->state = STATE_LOGIN_PSWD;
+	return 0;
+}
+
+/* Cursors a client sends before its password, kept for the login. Several frames add up */
+int resume_save(client_t *cli, char *field){
+	size_t have = cli->resume != NULL ? strlen(cli->resume) : 0;
+	size_t len = strlen(field);
+
+	if(have + len + 1 > RESUME_MAX) {
+		printf("Too many resume cursors.\n");
+		return -1;
+	}
+	char *grown = (char *)realloc(cli->resume, have + len + 2);
+	if(grown == NULL) {
+		return -1;
+	}
+	memcpy(grown + have, field, len);
+	grown[have + len] = '\n';
+	grown[have + len + 1] = '\0';
+	cli->resume = grown;
+	cli->acking = 1;
+	return 0;
+}
+
+/* Where a client saw a conversation up to: its own cursor if it sent one, else its user's last
+ * acknowledgement. 0 when neither is known */
+uint64_t resume_cursor(client_t *cli, const char *conv, int group){
+	for(char *line = cli->resume; line != NULL && *line != '\0'; ) {
+		char name[STR_SIZE + 1];
+		unsigned long long seq;
+		if(sscanf(line, "%32s %llu", name, &seq) == 2 && strcmp(name, conv) == 0) {
+			return seq;
+		}
+		line = strchr(line, '\n');
+		if(line != NULL) {
+			line++;
+		}
+	}
+	return user_acked(cli->user->id, group);
+}
+
+/* Add a conversation, group -1 for the personal messages, replayed from the message after the
+ * client's cursor. Returns how many messages that is. Call with users_lock held */
+uint64_t resume_add(client_t *cli, resume_t *convs, int *count, int group){
+	resume_t *c = &convs[*count];
+
+	if(group < 0) {
+		snprintf(c->conv, sizeof(c->conv), "@");
+	} else {
+		snprintf(c->conv, sizeof(c->conv), "#%s", groups[group]->name);
+	}
+	c->group = group;
+
+	history_t *h = resume_log(cli->user, group);
+	if(h == NULL) {
+		return 0;
+	}
+	c->cursor = resume_cursor(cli, c->conv, group);
+	pthread_mutex_lock(&h->mutex);
+	if(c->cursor >= h->next) {
+		c->cursor = h->next - 1;
+	}
+	c->next = c->cursor + 1;
+	uint64_t oldest = history_oldest(h);
+	uint64_t missed = h->next - (c->next > oldest ? c->next : oldest);
+	pthread_mutex_unlock(&h->mutex);
+	(*count)++;
+	return missed;
+}
+
+/* Plan replaying a conversation from where the replay got to up to its newest message, returns how
+ * many messages that is. Messages the log dropped meanwhile are passed over, and the client is told.
+ * With cached set only what the log has in memory is planned and the client is told which older
+ * ones it did not get, so the disk is not read under the users lock. Call with users_lock held */
+uint64_t resume_plan(client_t *cli, resume_t *c, replay_t *r, int cached){
+	r->page_count = r->page_next = 0;
+	r->recent_count = r->recent_next = 0;
+	r->recent = NULL;
+	history_t *h = resume_log(cli->user, c->group);
+	if(h == NULL) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&h->mutex);
+	uint64_t oldest = history_oldest(h);
+	uint64_t gone = c->next;
+	if(c->next < oldest) {
+		c->next = oldest;
+	}
+	uint64_t from = c->next;
+	uint64_t skip = cached ? history_cached(h, from, h->next) : from;
+	c->next = h->next;
+	history_plan(h, skip, c->next, r);
+	pthread_mutex_unlock(&h->mutex);
+
+	char note[BUFFER_SZ];
+	if(from > gone) {
+		resume_stats.lost += from - gone;
+		snprintf(note, sizeof(note), "Messages %llu to %llu of %s are no longer kept.\n",
+			(unsigned long long)gone, (unsigned long long)from - 1, c->conv);
+		send_text(cli, note);
+	}
+	if(skip > from) {
+		snprintf(note, sizeof(note), "Messages %llu to %llu of %s were skipped, history %s since %llu fetches them.\n",
+			(unsigned long long)from, (unsigned long long)skip - 1, c->conv,
+			c->conv[0] == '#' ? c->conv + 1 : c->conv, (unsigned long long)from - 1);
+		send_text(cli, note);
+	}
+	return c->next - skip;
+}
+
+/*
+ * The end of a catch-up round, under the users lock so nothing reaches the user meanwhile. If a log
+ * still has messages the client is missing only on disk, another round goes while rounds are left.
+ * Otherwise the rest of the logs that is in memory is queued without waiting for the client to
+ * read, anything older is left to the history command, and the connection joins its user's
+ * sessions. Live messages come after everything it missed
+ */
+int catchup_join(client_t *cli, catchup_t *c){
+	user_t *u = cli->user;
+
+	pthread_rwlock_wrlock(&users_lock);
+	int behind = 0;
+	for(int i=0; i<c->conv_count; i++) {
+		history_t *h = resume_log(u, c->convs[i].group);
+		if(h != NULL) {
+			pthread_mutex_lock(&h->mutex);
+			behind |= history_cached(h, c->convs[i].next, h->next) > c->convs[i].next;
+			pthread_mutex_unlock(&h->mutex);
+		}
+	}
+
+	if(behind && ++c->round < RESUME_ROUNDS) {
+		pthread_rwlock_unlock(&users_lock);
+		c->conv_next = 0;
+		c->step = CATCHUP_LOGS;
+		return 1;
+	}
+
+	for(int i=0; i<c->conv_count; i++) {
+		replay_t r;
+		c->replayed += resume_plan(cli, &c->convs[i], &r, 1);
+		history_send(cli, &r, 0);
+	}
+	user_attach(u, cli);
+	pthread_rwlock_unlock(&users_lock);
+
+	c->joined = 1;
+	c->step = CATCHUP_DONE;
+	return 1;
+}
+
+/* One step of a catch-up, see catchup_run() */
+int catchup_step(client_t *cli, catchup_t *c){
+	int result = 1;
+
+	switch(c->step) {
+		case CATCHUP_LOGS:
+			/* The next conversation is planned up to its newest message */
+			if(c->conv_next == c->conv_count) {
+				c->step = CATCHUP_JOIN;
+				break;
 			}
-			else if(deleted == 0) {
-				write(cli->sockfd,"Group not deleted.Unknown error.\n",
-				strlen("Group not deleted.Unknown error.\n"));
-			} else {
-				write(cli->sockfd,"Group successfully deleted.\n",
-				strlen("Group successfully deleted.\n"));
+			pthread_rwlock_rdlock(&users_lock);
+			c->replayed += resume_plan(cli, &c->convs[c->conv_next++], &c->r, 0);
+			pthread_rwlock_unlock(&users_lock);
+			c->step = CATCHUP_REPLAY;
+			break;
+		case CATCHUP_REPLAY:
+			result = history_send(cli, &c->r, 1);
+			if(result > 0) {
+				c->step = c->convs != NULL ? CATCHUP_LOGS : CATCHUP_DONE;
+			}
+			break;
+		case CATCHUP_JOIN:
+			result = catchup_join(cli, c);
+			break;
+	}
+	return result;
+}
+
+/* Release what a catch-up holds */
+void catchup_free(catchup_t *c){
+	history_release(&c->r);
+	free(c->convs);
+	free(c);
+}
+
+/*
+ * Queue what a client is due as long as its queue has room, on the thread serving it. It is parked
+ * while it waits for room. Once everything is queued, or it stopped taking it, the client goes on;
+ * after a login it is in its user's sessions by then unless it is closing
+ */
+void catchup_run(client_t *cli){
+	catchup_t *c = cli->catchup;
+	int result = 1;
+
+	while(result > 0 && c->step != CATCHUP_DONE) {
+		result = catchup_step(cli, c);
+	}
+	if(result == 0) {
+		client_park(cli, PARK_CATCHUP);
+		return;
+	}
+
+	pthread_mutex_lock(&cli->out_mutex);
+	int closing = cli->closing;
+	pthread_mutex_unlock(&cli->out_mutex);
+	if(!c->joined && !closing) {
+		pthread_rwlock_wrlock(&users_lock);
+		user_attach(cli->user, cli);
+		pthread_rwlock_unlock(&users_lock);
+	}
+
+	resume_stats.replayed += c->replayed;
+	if(cli->resume != NULL) {
+		resume_stats.logins++;
+		printf("User %s resumed %d conversations, %lu messages replayed\n", cli->name, c->conv_count, c->replayed);
+		free(cli->resume);
+		cli->resume = NULL;
+	} else if(c->replayed > 0) {
+		printf("Delivered %lu messages to %s\n", c->replayed, cli->name);
+	}
+
+	cli->catchup = NULL;
+	catchup_free(c);
+	if(cli->parked & PARK_CATCHUP) {
+		client_unpark(cli, PARK_CATCHUP);
+	}
+}
+
+/* A catch-up starting at step, NULL if there is no memory for it */
+catchup_t *catchup_new(client_t *cli, int step){
+	catchup_t *c = (catchup_t *)calloc(1, sizeof(catchup_t));
+
+	if(c != NULL) {
+		c->step = step;
+		cli->catchup = c;
+	}
+	return c;
+}
+
+/*
+ * Catch a client up on what it missed, right after its login. Offline messages are kept in the
+ * history of their conversation only, so the logs replay every conversation from the message
+ * after the client's cursor, see resume_cursor(). The connection joins its user's sessions at the
+ * end, see catchup_join(), except on a plain login of a user online elsewhere: the other
+ * connections got what came meanwhile
+ */
+void catchup_login(client_t *cli){
+	user_t *u = cli->user;
+	catchup_t *c = catchup_new(cli, CATCHUP_LOGS);
+	uint64_t missed = 0;
+
+	pthread_rwlock_wrlock(&users_lock);
+	if(c == NULL || (cli->resume == NULL && u->sessions != NULL)) {
+		user_attach(u, cli);
+		if(c != NULL) {
+			c->joined = 1;
+			c->step = CATCHUP_DONE;
+		}
+	} else {
+		int cap = 1 + u->group_count;
+		c->convs = (resume_t *)calloc(cap, sizeof(resume_t));
+		if(c->convs != NULL) {
+			missed += resume_add(cli, c->convs, &c->conv_count, -1);
+			for(int id = bitset_next(&u->groups, 0); id >= 0 && c->conv_count < cap; id = bitset_next(&u->groups, id + 1)) {
+				if(groups[id] != NULL) {
+					missed += resume_add(cli, c->convs, &c->conv_count, id);
+				}
+			}
+		}
+	}
+	pthread_rwlock_unlock(&users_lock);
+
+	if(c == NULL) {
+		return;
+	}
+	if(cli->resume == NULL && missed > 0) {
+		char note[64];
+		snprintf(note, sizeof(note), "%llu message%s arrived while you were offline:\n",
+			(unsigned long long)missed, missed == 1 ? "" : "s");
+		send_text(cli, note);
+	}
+	catchup_run(cli);
+}
+
+/* Queue a planned replay for a history command, paced like a catch-up */
+void catchup_replay(client_t *cli, replay_t *r){
+	catchup_t *c = catchup_new(cli, CATCHUP_REPLAY);
+
+	if(c == NULL) {
+		history_release(r);
+		return;
+	}
+	c->joined = 1;
+	c->r = *r;
+	catchup_run(cli);
+}
+
+/* Logged in: a token for the next time unless it came with one, then what the client missed */
+void login_done(client_t *cli){
+	client_send(cli, OP_OK, LOGIN_SUCCESS, strlen(LOGIN_SUCCESS));
+	if(cli->token[0] == '\0') {
+		session_issue(cli);
+	}
+	cli->state = STATE_CHAT;
+	catchup_login(cli);
+}
+
+/* Login: check the credentials and restore contacts and groups */
+int login_pswd(client_t *cli, char *pswd){
+	if(strlen(pswd) <  2 || strlen(pswd) >= STR_SIZE-1){
+		printf("Didn't enter the password.\n");
+		return -1;
+	}
+	strcpy(cli->pswd, pswd);
+
+	pthread_rwlock_wrlock(&users_lock);
+	user_t *u = user_find(cli->name);
+	if(u != NULL && strcmp(u->pswd, pswd) == 0) {
+		/* The connection joins the sessions once it has what it missed */
+		cli->user = u;
+	} else {
+		u = NULL;
+	}
+	pthread_rwlock_unlock(&users_lock);
+
+	if(u == NULL) {
+		printf("User not found.\n");
+		client_send(cli, OP_ERROR, LOGIN_ERROR, strlen(LOGIN_ERROR));
+		return -1;
+	}
+
+	printf("User %s logged in\n", cli->name);
+	login_done(cli);
+	return 0;
+}
+
+/*
+ * Reconnect: a token from an earlier login stands in for the name and the password. The user is
+ * still in memory with its contacts and groups, so this is a lookup. The lines after the token are
+ * cursors as in OP_RESUME, and without any the user's acknowledgements say what it missed.
+ * An unknown or expired token gets an error and the client may log in with its password instead.
+ */
+int session_login(client_t *cli, char *field){
+	char *cursors = strchr(field, '\n');
+	user_t *u = NULL;
+
+	if(cursors != NULL) {
+		*cursors++ = '\0';
+	} else {
+		cursors = field + strlen(field);
+	}
+
+	int id = strlen(field) == 2 * SESSION_TOKEN ? session_claim(cli, field) : -1;
+	if(id >= 0) {
+		/* It logged in before, so the user was loaded from the snapshot already */
+		pthread_rwlock_rdlock(&users_lock);
+		u = id < user_count ? users[id] : NULL;
+		if(u != NULL) {
+			snprintf(cli->name, sizeof(cli->name), "%s", u->name);
+			snprintf(cli->pswd, sizeof(cli->pswd), "%s", u->pswd);
+			cli->user = u;
+		}
+		pthread_rwlock_unlock(&users_lock);
+	}
+
+	if(u == NULL) {
+		cli->token[0] = '\0';
+		printf("Session not found.\n");
+		client_send(cli, OP_ERROR, SESSION_ERROR, strlen(SESSION_ERROR));
+		return 0;
+	}
+	if(resume_save(cli, cursors) < 0) {
+		return -1;
+	}
+
+	printf("User %s reconnected\n", cli->name);
+	login_done(cli);
+	return 0;
+}
+
+/* Dispatch one login dialogue field to the current state */
+int handle_field(client_t *cli, uint8_t opcode, char *field){
+	switch(cli->state) {
+		case STATE_ACTION:
+			if(opcode == OP_REGISTER) {
+				cli->state = STATE_REGISTER_NAME;
+				return 0;
+			} else if(opcode == OP_LOGIN) {
+				cli->state = STATE_LOGIN_NAME;
+				return 0;
+			} else if(opcode == OP_SESSION) {
+				return session_login(cli, field);
+			}
+			break;
+		case STATE_REGISTER_NAME:
+			if(opcode == OP_NAME) {
+				return register_name(cli, field);
+			}
+			break;
+		case STATE_REGISTER_PSWD:
+			if(opcode == OP_PASSWORD) {
+				return register_pswd(cli, field);
+			}
+			break;
+		case STATE_REGISTER_GROUPS:
+			if(opcode == OP_GROUPS) {
+				return register_groups(cli, field);
+			}
+			break;
+		case STATE_LOGIN_NAME:
+			if(opcode == OP_NAME) {
+				return login_name(cli, field);
+			}
+			break;
+		case STATE_LOGIN_PSWD:
+			if(opcode == OP_PASSWORD) {
+				return login_pswd(cli, field);
+			} else if(opcode == OP_RESUME) {
+				return resume_save(cli, field);
+			}
+			break;
+	}
+
+	printf("Wrong action input.\n");
+	return -1;
+}
+
+/* cgroup <name>: create a group, its creator becomes the admin */
+void cmd_create_group(client_t *cli, char *args){
+	char group_name[STR_SIZE];
+	name_arg(args, group_name);
+
+	long seq = 0;
+
+	pthread_rwlock_wrlock(&users_lock);
+	int created = apply_create_group(group_name, cli->name);
+	if(created) {
+		seq = journal_append("cgroup:%s:%s", group_name, cli->name);
+	}
+	pthread_rwlock_unlock(&users_lock);
+	journal_sync(cli, seq);
+
+	if(created) {
+		send_text(cli, "Group successfully created.You are its admin, but not yet a member.\n");
+	} else {
+		send_text(cli, "Group not created.Duplicate name or too many groups.\n");
+	}
+}
+
+/* dgroup <name>: delete a group the client is admin of */
+void cmd_delete_group(client_t *cli, char *args){
+	char group_name[STR_SIZE];
+	name_arg(args, group_name);
+
+	int deleted = 0;
+	long seq = 0;
+
+	pthread_rwlock_wrlock(&users_lock);
+	group_t *gr = group_find(group_name);
+	if(gr != NULL && strcmp(gr->admin,cli->name)==0) {
+		deleted = apply_delete_group(group_name);
+		seq = journal_append("dgroup:%s:%s", group_name, cli->name);
+	}
+	pthread_rwlock_unlock(&users_lock);
+	journal_sync(cli, seq);
+
+	if(deleted) {
+		send_text(cli, "Group successfully deleted.\n");
+	} else {
+		send_text(cli, "Group not deleted.Wrong group name or user is not admin.\n");
+	}
+}
+
+/* egroup <name>: join a group */
+void cmd_enter_group(client_t *cli, char *args){
+	char group_enter[STR_SIZE];
+	name_arg(args, group_enter);
+
+	long seq = 0;
+
+	pthread_rwlock_wrlock(&users_lock);
+	group_t *gr = group_find(group_enter);
+	int added = -1;
+	if(gr != NULL && bitset_test(&cli->user->groups, gr->id)) {
+		added = -2;
+	} else if(gr != NULL && apply_enter_group(cli->user, group_enter)) {
+		added = 1;
+		seq = journal_append("egroup:%s:%s", cli->name, group_enter);
+		/* A new member starts after the messages sent so far */
+		user_ack_head(cli->user, gr->id);
+	} else if(gr != NULL) {
+		added = 0;
+	}
+	pthread_rwlock_unlock(&users_lock);
+	journal_sync(cli, seq);
+
+	if(added == -2) {
+		send_text(cli, "You are already a member.\n");
+	} else if(added == -1) {
+		send_text(cli, "Group name not found.\n");
+	} else if(added == 0) {
+		send_text(cli, "Group not entered.Unknown error.\n");
+	} else {
+		send_text(cli, "Entered group successfully.\n");
+	}
+}
+
+/* sgroups: list all groups */
+void cmd_show_groups(client_t *cli, char *args){
+	char *buffer;
+	size_t len;
+
+	FILE *m = open_memstream(&buffer, &len);
+	fputs("Groups List:\n", m);
+	pthread_rwlock_rdlock(&users_lock);
+	write_group_list(m);
+	pthread_rwlock_unlock(&users_lock);
+	fclose(m);
+
+	client_send(cli, OP_TEXT, buffer, len);
+	free(buffer);
+}
+
+/* acontact <name>: add a contact */
+void cmd_add_contact(client_t *cli, char *args){
+	char buffer[BUFFER_SZ];
+	char contact_name[STR_SIZE];
+	int added = 0;
+	long seq = 0;
+
+	name_arg(args, contact_name);
+
+	pthread_rwlock_wrlock(&users_lock);
+	user_t *u = cli->user;
+	int id = user_id(contact_name);
+	if(id < 0) {
+		sprintf(buffer, "User %s does not exist. Contact was not added.\n", contact_name);
+	} else if(id_set_has(&u->contacts, id)) {
+		sprintf(buffer, "Contact %s already exists.\n", contact_name);
+	} else if(!apply_add_contact(u, contact_name)) {
+		sprintf(buffer, "Contact %s was not added.\n", contact_name);
+	} else {
+		seq = journal_append("acontact:%s:%s", cli->name, contact_name);
+		sprintf(buffer, "Contact %s was added to your list.\n", contact_name);
+		added = 1;
+	}
+	pthread_rwlock_unlock(&users_lock);
+	journal_sync(cli, seq);
+
+	if(added) {
+		printf("%s added contact %s\n", cli->name, contact_name);
+	}
+	send_text(cli, buffer);
+}
+
+/* dcontact <name>: remove a contact */
+void cmd_delete_contact(client_t *cli, char *args){
+	char con_name[STR_SIZE];
+	name_arg(args, con_name);
+
+	long seq = 0;
+
+	pthread_rwlock_wrlock(&users_lock);
+	int deleted = apply_delete_contact(cli->user, con_name);
+	if(deleted) {
+		seq = journal_append("dcontact:%s:%s", cli->name, con_name);
+	}
+	pthread_rwlock_unlock(&users_lock);
+	journal_sync(cli, seq);
+
+	if(deleted) {
+		send_text(cli, "Contact deleted.\n");
+	} else {
+		send_text(cli, "Contact does not exist.\n");
+	}
+}
+
+/* clist: list the client's contacts */
+void cmd_contact_list(client_t *cli, char *args){
+	char buffer[BUFFER_SZ];
+
+	send_text(cli, "Your Contact List:\n");
+
+	pthread_rwlock_rdlock(&users_lock);
+	user_t *u = cli->user;
+	int n = 0;
+	for(int i=0; i<u->contacts.cap; i++) {
+		if(u->contacts.slots[i] != 0) {
+			sprintf(buffer, "%d. %s\n", ++n, user_name(u->contacts.slots[i] - 1));
+			send_text(cli, buffer);
+		}
+	}
+	pthread_rwlock_unlock(&users_lock);
+}
+
+/* pm <contact> <message>: send a personal message to a contact */
+void cmd_personal_message(client_t *cli, char *args){
+	char buffer[BUFFER_SZ];
+	char contact_name[STR_SIZE];
+
+	char *message = split_target(args, contact_name);
+
+	int res = send_pm(message, contact_name, cli);
+	if (res == -1) {
+		sprintf(buffer, "User %s is not in your contact list. Message not sent.\n", contact_name);
+		send_text(cli, buffer);
+	} else if (res == 0) {
+		sprintf(buffer, "%s is offline. Message not sent.\n", contact_name);
+		send_text(cli, buffer);
+	} else if (res == 2) {
+		sprintf(buffer, "%s is offline. Message will be delivered at their next login.\n", contact_name);
+		send_text(cli, buffer);
+	}
+}
+
+/* mgroup <group> <message>: send a message to a group the client is in */
+void cmd_group_message(client_t *cli, char *args){
+	char group_name[STR_SIZE];
+
+	char *message = split_target(args, group_name);
+	printf("Message to group %s is: %s\n", group_name,message);
+
+	int res = send_gm(message,group_name,cli);
+	if(res == -1) {
+		send_text(cli, "Group does not exist.\n");
+	} else if(res == -2) {
+		send_text(cli, "You are not a member of the group.\n");
+	} else if(res == -3) {
+		send_text(cli, "The message could not be kept for members who are offline.\n");
+	}
+}
+
+/* history <group> [N | since <seq>]: the last N messages of a group, or the ones after seq.
+ * history @ does the same for the personal messages the client received */
+void cmd_history(client_t *cli, char *args){
+	char group_name[STR_SIZE];
+	char buffer[BUFFER_SZ];
+	uint64_t since = 0;
+	long want = HISTORY_DEFAULT;
+
+	char *rest = split_target(args, group_name);
+	str_trim_lf(rest, strlen(rest));
+	if(strncmp(rest, "since ", 6) == 0) {
+		since = strtoull(rest + 6, NULL, 10);
+		want = HISTORY_MAX;
+	} else if(*rest != '\0') {
+		want = atol(rest);
+	}
+	if(want < 1 || want > HISTORY_MAX) {
+		want = want < 1 ? 1 : HISTORY_MAX;
+	}
+
+	/* Older pages are sent from the segments once the locks are dropped, the newest come from memory */
+	replay_t r;
+	r.page_count = r.page_next = 0;
+	r.recent_count = r.recent_next = 0;
+	r.recent = NULL;
+	uint64_t from = 0, to = 0;
+	int result = -1; // Group name not found in groups
+
+	pthread_rwlock_rdlock(&users_lock);
+	history_t *h = NULL;
+	if(strcmp(group_name, "@") == 0) {
+		result = 0;
+		h = history_personal(cli->user->id);
+	} else {
+		group_t *gr = group_find(group_name);
+		if(gr != NULL && !bitset_test(&cli->user->groups, gr->id)) {
+			result = -2; // User not found in group
+		} else if(gr != NULL) {
+			result = 0;
+			h = history_get(gr);
+		}
+	}
+	if(h != NULL) {
+		pthread_mutex_lock(&h->mutex);
+		uint64_t oldest = history_oldest(h);
+		to = h->next;
+		if(since > 0) {
+			from = since + 1 > oldest ? since + 1 : oldest;
+			if(from > to) {
+				from = to;
+			}
+			if(to - from > (uint64_t)want) {
+				to = from + want;
+			}
+		} else {
+			from = to - oldest > (uint64_t)want ? to - want : oldest;
+		}
+		history_plan(h, from, to, &r);
+		pthread_mutex_unlock(&h->mutex);
+	}
+	pthread_rwlock_unlock(&users_lock);
+
+	if(result == -1) {
+		send_text(cli, "Group does not exist.\n");
+	} else if(result == -2) {
+		send_text(cli, "You are not a member of the group.\n");
+	} else if(from == to) {
+		sprintf(buffer, "No messages in %s%s.\n", group_name, since > 0 ? " after that one" : " yet");
+		send_text(cli, buffer);
+	} else {
+		sprintf(buffer, "History of %s, messages %llu to %llu:\n", group_name,
+			(unsigned long long)from, (unsigned long long)to - 1);
+		send_text(cli, buffer);
+	}
+	catchup_replay(cli, &r);
+}
+
+/* ack: "<conversation> <seq>" lines, the client saw everything up to seq. A later login without
+ * cursors starts there, and from now on the client's logout leaves its user's cursors alone */
+void cmd_ack(client_t *cli, char *args){
+	cli->acking = 1;
+
+	pthread_rwlock_rdlock(&users_lock);
+	for(char *line = args; line != NULL && *line != '\0'; ) {
+		char conv[STR_SIZE + 1];
+		unsigned long long seq;
+
+		if(sscanf(line, "%32s %llu", conv, &seq) == 2) {
+			resume_stats.acks++;
+			if(strcmp(conv, "@") == 0) {
+				user_ack(cli->user, -1, seq);
+			} else if(conv[0] == '#') {
+				group_t *gr = group_find(conv + 1);
+				if(gr != NULL && bitset_test(&cli->user->groups, gr->id)) {
+					user_ack(cli->user, gr->id, seq);
+				}
+			}
+		}
+		line = strchr(line, '\n');
+		if(line != NULL) {
+			line++;
+		}
+	}
+	pthread_rwlock_unlock(&users_lock);
+}
+
+/* Anything else typed is chat for everybody */
+void cmd_chat(client_t *cli, char *args){
+	if(strlen(args) > 0){
+		send_message(args, cli);
+
+		str_trim_lf(args, strlen(args));
+		printf("%s -> %s\n", args, cli->name);
+	}
+}
+
+/* Command handler, args is the frame payload as a string */
+typedef void (*command_fn)(client_t *cli, char *args);
+
+/* Commands by opcode, unknown opcodes are NULL */
+static const command_fn commands[256] = {
+	[OP_CHAT] = cmd_chat,
+	[OP_CREATE_GROUP] = cmd_create_group,
+	[OP_DELETE_GROUP] = cmd_delete_group,
+	[OP_ENTER_GROUP] = cmd_enter_group,
+	[OP_SHOW_GROUPS] = cmd_show_groups,
+	[OP_ADD_CONTACT] = cmd_add_contact,
+	[OP_DELETE_CONTACT] = cmd_delete_contact,
+	[OP_CONTACT_LIST] = cmd_contact_list,
+	[OP_PERSONAL_MESSAGE] = cmd_personal_message,
+	[OP_GROUP_MESSAGE] = cmd_group_message,
+	[OP_HISTORY] = cmd_history,
+	[OP_ACK] = cmd_ack,
+};
+
+/* Announce that a logged in client has left */
+void client_leave(client_t *cli){
+	char buff_out[BUFFER_SZ];
+
+	sprintf(buff_out, "%s has left\n", cli->name);
+	printf("%s", buff_out);
+	send_message(buff_out, cli);
+}
+
+/* Feed complete frames through the login dialogue and command loop */
+int client_process(client_t *cli){
+	char field[BUFFER_SZ + 1];
+	frame_t frame;
+	int ready = 0;
+
+	/* Replies are held and go out together when the batch ends */
+	replying = cli;
+
+	/* Frames after one that parked the client stay in the parser until it goes on */
+	while(!cli->parked && (ready = frame_next(&cli->parser, &frame)) > 0) {
+		memcpy(field, frame.payload, frame.len);
+		field[frame.len] = '\0';
+
+		if(cli->state != STATE_CHAT) {
+			if(handle_field(cli, frame.opcode, field) < 0) {
+				return -1;
 			}
+		} else if(commands[frame.opcode] != NULL) {
+			commands[frame.opcode](cli, field);
+			client_pause(cli);
+		} else {
+			printf("Wrong command input.\n");
+			return -1;
+		}
+	}
+
+	if(ready < 0) {
+		printf("Malformed frame.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Borrow an input buffer for the parser unless it still has one */
+int client_in_take(client_t *cli){
+	if(cli->parser.buf == NULL) {
+		char *buf = (char *)pool_alloc(POOL_INPUT);
+		if(buf == NULL) {
+			return -1;
+		}
+		frame_parser_init(&cli->parser, buf, FRAME_HDR + BUFFER_SZ);
+	}
+	return 0;
+}
+
+/* Give the input buffer back once nothing in it is left to parse, idle clients hold none */
+void client_in_put(client_t *cli){
+	if(cli->parser.buf != NULL && cli->parser.len == 0) {
+		pool_free(POOL_INPUT, cli->parser.buf);
+		cli->parser.buf = NULL;
+	}
+}
+
+/* Read whatever is available and process it, -1 once the client is gone */
+int client_readable(client_t *cli){
+	/* EPOLLIN is off while it is parked, only a hangup or an error gets here */
+	if(cli->parked) {
+		return -1;
+	}
+	if(client_in_take(cli) < 0) {
+		return -1;
+	}
+
+	size_t space;
+	char *dst = frame_space(&cli->parser, &space);
+	int receive = recv(cli->sockfd, dst, space, 0);
+	io_stats.reads++;
+
+	if(receive == 0) {
+		if(cli->state == STATE_CHAT) {
+			client_leave(cli);
+		}
+		return -1;
+	} else if(receive < 0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			client_in_put(cli);
+			return 0;
+		}
+		printf("ERROR: -1\n");
+		return -1;
+	}
+
+	frame_commit(&cli->parser, receive);
+	if(client_process(cli) < 0) {
+		return -1;
+	}
+	client_in_put(cli);
+	return 0;
+}
+
+/* Feed bytes that were received elsewhere through the parser, -1 once the client is gone.
+ * What a parked client cannot take yet waits in parked_in */
+int client_input(client_t *cli, const char *data, size_t len){
+	if(client_in_take(cli) < 0) {
+		return -1;
+	}
+
+	while(len > 0 && !cli->parked) {
+		size_t space;
+		char *dst = frame_space(&cli->parser, &space);
+		size_t n = len < space ? len : space;
+
+		memcpy(dst, data, n);
+		frame_commit(&cli->parser, n);
+		data += n;
+		len -= n;
+		if(client_process(cli) < 0) {
+			return -1;
+		}
+	}
+
+	if(len > 0) {
+		char *grown = (char *)realloc(cli->parked_in, cli->parked_len + len);
+		if(grown == NULL) {
+			return -1;
+		}
+		memcpy(grown + cli->parked_len, data, len);
+		cli->parked_in = grown;
+		cli->parked_len += len;
+	}
+	client_in_put(cli);
+	return 0;
+}
+
+/* io_uring mode: arm a client's receive, defined with the loop further down */
+void uring_recv(client_t *cli);
+
+/* Queue the replies held while the client was parked on its journal record */
+void client_replies(client_t *cli){
+	for(int i=0; i<cli->reply_count; i++) {
+		client_send_msg(cli, cli->replies[i]);
+		msg_unref(cli->replies[i]);
+	}
+	cli->reply_count = 0;
+}
+
+/*
+ * Take a parked client up again on the thread serving it: what it was parked for is checked, and
+ * once nothing holds it any more its input is handled from where it stopped. -1 once it is gone
+ */
+int client_continue(client_t *cli){
+	if((cli->parked & PARK_SYNC) && journal_durable(cli->sync_seq)) {
+		client_unpark(cli, PARK_SYNC);
+		client_replies(cli);
+	}
+	if((cli->parked & PARK_PAUSE) && !client_overflowed(cli)) {
+		client_unpark(cli, PARK_PAUSE);
+	}
+	if(cli->parked & PARK_CATCHUP) {
+		catchup_run(cli);
+	}
+	if(cli->parked) {
+		return 0;
+	}
+
+	/* Frames already in the parser go first, then the bytes received meanwhile */
+	if(client_process(cli) < 0) {
+		return -1;
+	}
+	if(cli->parked_in != NULL && !cli->parked) {
+		char *data = cli->parked_in;
+		size_t len = cli->parked_len;
+		cli->parked_in = NULL;
+		cli->parked_len = 0;
+		int result = client_input(cli, data, len);
+		free(data);
+		if(result < 0) {
+			return -1;
+		}
+	}
+	if(cli->epfd < 0 && !cli->parked && !cli->uring_reading && !cli->uring_closed) {
+		uring_recv(cli);
+	}
+	client_in_put(cli);
+	return 0;
+}
+
+/* Thread mode: wait a while for what a parked client is held by, its thread has nothing else to do */
+void client_park_wait(client_t *cli){
+	/* Nothing this thread holds back may wait with it */
+	client_flush_held();
+
+	if(cli->parked & PARK_SYNC) {
+		pthread_mutex_lock(&persist_mutex);
+		while(persist_durable < cli->sync_seq) {
+			pthread_cond_wait(&durable_cond, &persist_mutex);
+		}
+		pthread_mutex_unlock(&persist_mutex);
+	}
+
+	/* A drain between the check and the wait costs at most one round */
+	if(cli->parked & PARK_PAUSE) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += 10 * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+		pthread_mutex_lock(&drain_mutex);
+		pthread_cond_timedwait(&drain_cond, &drain_mutex, &deadline);
+		pthread_mutex_unlock(&drain_mutex);
+	}
+
+	/* What it is due goes out from here meanwhile, one that cannot take it any more is closing */
+	if(cli->parked & PARK_CATCHUP) {
+		struct pollfd p = { cli->sockfd, POLLOUT, 0 };
+		poll(&p, 1, 100);
+		if(client_flush(cli) < 0) {
+			pthread_mutex_lock(&cli->out_mutex);
+			cli->closing = 1;
+			pthread_mutex_unlock(&cli->out_mutex);
+		}
+	}
+}
+
+/* Set up a newly accepted connection, NULL if it was rejected */
+client_t *client_accept(int connfd, struct sockaddr_in cli_addr, int epfd, uint32_t ev_base){
+	/* Check if max clients is reached */
+	if((cli_count + 1) >= MAX_CLIENTS){
+		printf("Max clients reached. Rejected: ");
+		print_client_addr(cli_addr);
+		printf(":%d\n", cli_addr.sin_port);
+		close(connfd);
+		return NULL;
+	}
+
+	/* Client settings */
+	client_t *cli = (client_t *)pool_alloc(POOL_CLIENT);
+	if(cli == NULL) {
+		close(connfd);
+		return NULL;
+	}
+	memset(cli, 0, sizeof(*cli));
+	cli->address = cli_addr;
+	cli->sockfd = connfd;
+	cli->uid = uid++;
+	cli->state = STATE_ACTION;
+	pthread_mutex_init(&cli->out_mutex, NULL);
+	cli->epfd = epfd;
+	cli->ev_base = ev_base;
+
+	/* Event modes: the loop accepting it serves it, in io_uring mode there is no epoll set either */
+	cli->loop = current_loop;
+
+	/* Corked, writes are already gathered per batch and should leave as soon as the batch ends */
+	if(out_cork) {
+		int option = 1;
+		setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+	}
+
+	/* Registered before anyone can queue frames for it */
+	struct epoll_event ev;
+	ev.events = ev_base;
+	ev.data.ptr = cli;
+	if(epfd >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+		perror("ERROR: epoll_ctl failed");
+		close(connfd);
+		pthread_mutex_destroy(&cli->out_mutex);
+		pool_free(POOL_CLIENT, cli);
+		return NULL;
+	}
+
+	/* Closing the socket also takes it out of the epoll set */
+	if(queue_add(cli) < 0) {
+		printf("Max clients reached.\n");
+		close(connfd);
+		pthread_mutex_destroy(&cli->out_mutex);
+		pool_free(POOL_CLIENT, cli);
+		return NULL;
+	}
+	cli_count++;
+	return cli;
+}
+
+/* Close the socket and free a client nothing refers to any more */
+void client_free(client_t *cli){
+	close(cli->sockfd);
+	pthread_mutex_destroy(&cli->out_mutex);
+	free(cli->out_ring);
+	pool_free(POOL_INPUT, cli->parser.buf);
+	pool_free(POOL_SEND, cli->out_send);
+	free(cli->resume);
+	if(cli->catchup != NULL) {
+		catchup_free(cli->catchup);
+	}
+	for(int i=0; i<cli->reply_count; i++) {
+		msg_unref(cli->replies[i]);
+	}
+	free(cli->replies);
+	free(cli->parked_in);
+	pool_free(POOL_CLIENT, cli);
+}
+
+/* Delete client from queue and release it */
+void client_close(client_t *cli){
+	queue_remove(cli);
+
+	/* Personal and group messages must not find the connection any more */
+	pthread_rwlock_wrlock(&users_lock);
+	if(user_detach(cli) && !cli->acking) {
+		/* Its user's cursors move on without acknowledgements, a later login starts from there */
+		user_ack_all(cli->user);
+	}
+	pthread_rwlock_unlock(&users_lock);
+	session_release(cli);
+
+	/* One last try for replies such as a login error, then nothing is sent any more */
+	pthread_mutex_lock(&cli->out_mutex);
+	if(cli->out_busy == 0) {
+		client_write_locked(cli);
+	}
+	cli->closing = 1;
+	client_out_clear(cli);
+	pthread_mutex_unlock(&cli->out_mutex);
+
+	/* Senders paused on it find it gone */
+	if(cli->congested) {
+		client_drained(cli);
+	}
+
+	cli_count--;
+
+	/* io_uring mode: the shutdown ends what is in flight, the last completion frees the client */
+	if(cli->epfd < 0) {
+		cli->uring_closed = 1;
+		shutdown(cli->sockfd, SHUT_RDWR);
+		return;
+	}
+
+	epoll_ctl(cli->epfd, EPOLL_CTL_DEL, cli->sockfd, NULL);
+
+	/* Thread mode: the flusher may still hold an event for it, so the flusher frees it */
+	if(cli->epfd == flush_epfd) {
+		shutdown(cli->sockfd, SHUT_RDWR);
+		pthread_mutex_lock(&reap_mutex);
+		cli->reap_next = reap_list;
+		reap_list = cli;
+		pthread_mutex_unlock(&reap_mutex);
+		return;
+	}
 
-		} else if(strncmp(buff_out,ENTER_GROUP, strlen(ENTER_GROUP)) == 0) {
-			char group_enter[STR_SIZE];
+	client_free(cli);
+}
 
-			substring(buff_out, group_enter, strlen(ENTER_GROUP)+1, strlen(buff_out));
-			trim_leading(group_enter);
-			str_trim_lf(group_enter,strlen(group_enter));
+/* Thread mode: handle all communication with the client */
+void *handle_client(void *arg){
+	client_t *cli = (client_t *)arg;
 
-			int added = add_to_group(cli,group_enter);
+	pthread_detach(pthread_self());
 
-			if(added == 1) {
-				bzero(buffer,BUFFER_SZ);
-				sprintf(buffer,"%s:%s",cli->name,pswd);
-				int user_start_line = search_in_file("users.txt",buffer,1);
-				int line_index = 1;
+	/* The socket is blocking, so every call waits for more bytes. Each read is one batch */
+	while(1) {
+		batch_begin();
+		int result = client_readable(cli);
+		while(result == 0 && cli->parked) {
+			client_park_wait(cli);
+			result = client_continue(cli);
+		}
+		batch_end();
+		if(result < 0) {
+			break;
+		}
+	}
+	free(held);
 
-				file=fopen("users.txt","r");
-				if(file==NULL) {
-					perror("Error opening users.txt\n");
-				}
-				temp=fopen("temp.txt","a+");
-				if(file==NULL) {
-					perror("Error opening temp.txt\n");
-				}
+	client_close(cli);
+	pool_thread_exit();
+	return NULL;
+}
 
-				while ((read = getline(&line, &len, file)) != -1) {
-					if(line_index != user_start_line +2) {
-						fputs(line,temp);
-					} else {
-						bzero(buffer,BUFFER_SZ);
-						str_trim_lf(line,strlen(line));
-						strcpy(buffer,line);
-						sprintf(buffer + strlen(buffer),":%s\n",group_enter);
-						fputs(buffer,temp);
-					}
-					line_index++;
-				}
+/* Thread mode: write what the client threads could not, and free closed clients */
+void *flush_loop(void *arg){
+	struct epoll_event events[MAX_EVENTS];
+
+	while(1){
+		int n = epoll_wait(flush_epfd, events, MAX_EVENTS, 1000);
+		if(n < 0 && errno != EINTR) {
+			perror("ERROR: epoll_wait failed");
+			break;
+		}
+
+		for(int i=0; i<n; i++) {
+			client_flush((client_t *)events[i].data.ptr);
+		}
+
+		/* Removed from the epoll set before they were listed, no later event refers to them */
+		pthread_mutex_lock(&reap_mutex);
+		client_t *cli = reap_list;
+		reap_list = NULL;
+		pthread_mutex_unlock(&reap_mutex);
+
+		while(cli != NULL) {
+			client_t *next = cli->reap_next;
+			client_free(cli);
+			cli = next;
+		}
+	}
+
+	return NULL;
+}
+
+/* Open a listening socket on the port, one per shard */
+int open_listener(int port){
+	char *ip = "127.0.0.1";
+	int option = 1;
+	struct sockaddr_in serv_addr;
+
+	/* Socket settings */
+	int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+	if(listenfd < 0) {
+		perror("ERROR: Socket creation failed.\n");
+		return -1;
+	}
+	serv_addr.sin_family = AF_INET;
+	serv_addr.sin_addr.s_addr = inet_addr(ip);
+	serv_addr.sin_port = htons(port);
+
+	/* Every shard binds the same port, the kernel balances new connections between them */
+	if(setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, (char*)&option, sizeof(option)) < 0
+		|| setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, (char*)&option, sizeof(option)) < 0){
+		perror("ERROR: setsockopt failed.\n");
+		close(listenfd);
+		return -1;
+	}
+
+	/* Bind */
+	if(bind(listenfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+		perror("ERROR: Socket binding failed.\n");
+		close(listenfd);
+		return -1;
+	}
+
+	/* Listen, with room for a whole reconnect storm */
+	if(listen(listenfd, SOMAXCONN) < 0) {
+		perror("ERROR: Socket listening failed.\n");
+		close(listenfd);
+		return -1;
+	}
+
+	return listenfd;
+}
+
+/* Thread mode: accept on this shard's socket and fork a thread per client */
+void *accept_loop(void *arg){
+	int listenfd = (int)(intptr_t)arg;
+	struct sockaddr_in cli_addr;
+	pthread_t tid;
+
+	while(1){
+		socklen_t clilen = sizeof(cli_addr);
+		int connfd = accept(listenfd, (struct sockaddr*)&cli_addr, &clilen);
+		if(connfd < 0) {
+			continue;
+		}
+
+		client_t *cli = client_accept(connfd, cli_addr, flush_epfd, EPOLLONESHOT);
+		if(cli == NULL) {
+			continue;
+		}
+
+		/* Fork thread */
+		if(pthread_create(&tid, NULL, &handle_client, (void*)cli) != 0) {
+			perror("ERROR: pthread failed");
+			client_close(cli);
+		}
+	}
+
+	return NULL;
+}
+
+/* Thread mode: run one acceptor per shard */
+int run_acceptors(int port, int shards){
+	int listenfd = -1;
+
+	flush_epfd = epoll_create1(0);
+	pthread_t flush_tid;
+	if(flush_epfd < 0 || pthread_create(&flush_tid, NULL, &flush_loop, NULL) != 0) {
+		perror("ERROR: flusher failed");
+		return -1;
+	}
+
+	for(int i=0; i<shards; i++) {
+		listenfd = open_listener(port);
+		if(listenfd < 0) {
+			return -1;
+		}
+
+		if(i == shards - 1) {
+			break;
+		}
 
-				fclose(file);
-				fclose(temp);
+		pthread_t tid;
+		if(pthread_create(&tid, NULL, &accept_loop, (void*)(intptr_t)listenfd) != 0) {
+			perror("ERROR: pthread failed");
+			return -1;
+		}
+	}
+
+	printf("Accepting on %d shards\n", shards);
+
+	accept_loop((void*)(intptr_t)listenfd);
+	return 0;
+}
+
+/* Event mode: accept every pending connection on the loop's own socket */
+void accept_clients(event_loop_t *loop){
+	struct sockaddr_in cli_addr;
 
-				remove("users.txt");
-				rename("temp.txt", "users.txt");
+	while(1){
+		socklen_t clilen = sizeof(cli_addr);
+		int connfd = accept4(loop->listenfd, (struct sockaddr*)&cli_addr, &clilen, SOCK_NONBLOCK);
+		if(connfd < 0) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				perror("ERROR: accept failed");
 			}
+			return;
+		}
+
+		client_accept(connfd, cli_addr, loop->epfd, EPOLLIN);
+	}
+}
 
-			if(added == -2) {
-				write(cli->sockfd,"You are already a member.\n",strlen("You are already a member.\n"));
-			} else if(added == -1) {
-				write(cli->sockfd,"Group name not found.\n",strlen("Group name not found.\n"));
-			} else if(added == 0) {
-				write(cli->sockfd,"Group not entered.Unknown error.\n",
-				strlen("Group not entered.Unknown error.\n"));
+/* Event modes: read the mailbox. In io_uring mode the clients other threads queued frames for are
+ * written, parked ones are noted for loop_continue() */
+void loop_mail(event_loop_t *loop){
+	/* Swap lists so posters never wait on a client lock held here */
+	pthread_mutex_lock(&loop->mail_mutex);
+	client_ref_t *mail = loop->mail;
+	int count = loop->mail_count;
+	int cap = loop->mail_cap;
+	loop->mail = loop->mail_spare;
+	loop->mail_cap = loop->mail_spare_cap;
+	loop->mail_count = 0;
+	loop->mail_spare = mail;
+	loop->mail_spare_cap = cap;
+	pthread_mutex_unlock(&loop->mail_mutex);
+
+	pthread_rwlock_rdlock(&clients_lock);
+	for(int i=0; i<count; i++) {
+		client_t *cli = clients[mail[i].slot];
+		if(cli == NULL || cli->uid != mail[i].uid) {
+			continue;
+		}
+
+		/* Only a flush asked for from another thread is sent from here, a parked client may just be
+		 * posted while its queue is held to the batch end */
+		pthread_mutex_lock(&cli->out_mutex);
+		if(cli->epfd < 0 && cli->out_armed && !cli->closing && cli->out_busy == 0) {
+			if(cli->out_count > 0) {
+				uring_send(cli);
 			} else {
-				write(cli->sockfd,"Entered group successfully.\n",strlen("Entered group successfully.\n"));
+				cli->out_armed = 0;
 			}
+		}
+		pthread_mutex_unlock(&cli->out_mutex);
 
-		} else if(strcmp(buff_out,SHOW_GROUPS) == 0) {
-
-			write(cli->sockfd, "Groups List:\n", strlen("Groups List:\n"));
-			for(int i=0;i<group_count;i++) {
-				sprintf(buffer, "%d. %s\n", i+1, groups[i]->name);
-				write(cli->sockfd, buffer, strlen(buffer));
+		if(!cli->parked) {
+			continue;
+		}
+		if(loop->woken_count == loop->woken_cap) {
+			int grown_cap = loop->woken_cap ? loop->woken_cap * 2 : 64;
+			client_ref_t *grown = (client_ref_t *)realloc(loop->woken, grown_cap * sizeof(client_ref_t));
+			if(grown == NULL) {
+				continue;
 			}
+			loop->woken = grown;
+			loop->woken_cap = grown_cap;
+		}
+		loop->woken[loop->woken_count++] = mail[i];
+	}
+	pthread_rwlock_unlock(&clients_lock);
+}
+
+/* Event modes: take up the parked clients posted to this loop, between events so closing one is safe.
+ * Only this loop frees its clients, so one found under the lock stays valid once it is dropped */
+void loop_continue(event_loop_t *loop){
+	for(int i=0; i<loop->woken_count; i++) {
+		pthread_rwlock_rdlock(&clients_lock);
+		client_t *cli = clients[loop->woken[i].slot];
+		if(cli != NULL && (cli->uid != loop->woken[i].uid || cli->loop != loop)) {
+			cli = NULL;
+		}
+		pthread_rwlock_unlock(&clients_lock);
 
-		} else if(strncmp(buff_out,ADD_CONTACT,strlen(ADD_CONTACT)) == 0) {
-			int duplicate = 0;
-			int i = 0;
-			int found = 1;
+		if(cli == NULL || cli->uring_closed || client_continue(cli) == 0) {
+			continue;
+		}
+		client_close(cli);
+		if(cli->epfd < 0 && cli->uring_ops == 0) {
+			client_free(cli);
+		}
+	}
+	loop->woken_count = 0;
+}
+
+/* Event modes: set up a loop's mailbox, in epoll mode its eventfd is in the loop's epoll set */
+int loop_init(event_loop_t *loop){
+	loop->wake_fd = eventfd(0, EFD_CLOEXEC);
+	if(loop->wake_fd < 0) {
+		return -1;
+	}
+	pthread_mutex_init(&loop->mail_mutex, NULL);
+
+	if(loop->epfd >= 0) {
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = loop;
+		if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wake_fd, &ev) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
 
-			substring(buff_out, contact_name, strlen(ADD_CONTACT)+1, strlen(buff_out));
-			trim_leading(contact_name);
+/* Event mode: multiplex the connections assigned to this loop */
+void *event_loop(void *arg){
+	event_loop_t *loop = (event_loop_t *)arg;
+	struct epoll_event events[MAX_EVENTS];
 
-			while(strcmp(cli->contacts[i],"\0") != 0) {
-				if(strcmp(cli->contacts[i],contact_name) == 0) {
-					sprintf(buffer, "Contact %s already exists.\n", contact_name);
-					write(cli->sockfd, buffer, strlen(buffer));
+	current_loop = loop;
 
-					duplicate = 1;
-					break;
-				}
-				i++;
+	while(1){
+		int n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+		io_stats.waits++;
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
 			}
+			perror("ERROR: epoll_wait failed");
+			break;
+		}
 
-			if(duplicate == 0) {
-				strcpy(cli->contacts[i],contact_name);
-
-				file=fopen("users.txt","r");
-				if(file==NULL) {
-					perror("Error opening users.txt\n");
-				}
-				temp=fopen("temp.txt","a+");
-				if(file==NULL) {
-					perror("Error opening temp.txt\n");
+		/* Everything queued while handling these events goes out once they are all handled */
+		batch_begin();
+		int mail = 0;
+		for(int i=0; i<n; i++) {
+			/* The listening socket is registered without a client, the eventfd with the loop */
+			if(events[i].data.ptr == NULL) {
+				accept_clients(loop);
+				continue;
+			}
+			if(events[i].data.ptr == loop) {
+				if(read(loop->wake_fd, &loop->wake_val, sizeof(loop->wake_val)) < 0) {
+					perror("ERROR: eventfd read failed");
 				}
+				mail = 1;
+				continue;
+			}
 
-				while ((read = getline(&line, &len, file)) != -1) {
+			client_t *cli = (client_t *)events[i].data.ptr;
+			if((events[i].events & EPOLLOUT) && client_flush(cli) < 0) {
+				client_close(cli);
+			} else if((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && client_readable(cli) < 0) {
+				client_close(cli);
+			}
+		}
 
-					if(found == 0) {
-						if(strncmp(line,"contacts",8)==0) {
+		if(mail) {
+			loop_mail(loop);
+		}
+		loop_continue(loop);
+		batch_end();
+	}
 
-							str_trim_lf(line,strlen(line));
-							char new[BUFFER_SZ] = "";
-							sprintf(new, ":%s\n", contact_name);
-							strcat(line,new);
-							printf("New line with contacts is: %s\n", line);
+	return NULL;
+}
 
-							fputs(line, temp);
-							found = 1;
-							continue;
-						}
-					}
+/* Every connection is a descriptor, allow as many as the hard limit */
+void raise_fd_limit(void){
+	struct rlimit rl;
 
-					fputs(line, temp);
-			    char *ptr=strtok(line,":");
-					int i = 0;
-			    char *array[2];
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
 
-			    while (ptr != NULL) {
-			        array[i++] = ptr;
-			        ptr = strtok (NULL, "\n");
-			    }
+/* Event mode: start the loops, each one a shard with its own listening socket */
+int run_event_loops(int port, int workers){
+	raise_fd_limit();
 
-					if(strcmp(array[0],cli->name)==0) {
-						printf("Found user with name: %s\n", cli->name );
-						found = 0;
-					}
-			  }
+	loops = (event_loop_t *)calloc(workers, sizeof(event_loop_t));
+	if(loops == NULL) {
+		return -1;
+	}
 
-				remove("users.txt");
-				rename("temp.txt", "users.txt");
+	for(int i=0; i<workers; i++) {
+		loops[i].epfd = epoll_create1(0);
+		if(loops[i].epfd < 0) {
+			perror("ERROR: epoll_create failed");
+			return -1;
+		}
 
-				sprintf(buffer, "Contact %s was added to your list.\n", contact_name);
-				write(cli->sockfd, buffer, strlen(buffer));
+		loops[i].listenfd = open_listener(port);
+		if(loops[i].listenfd < 0) {
+			return -1;
+		}
+		fcntl(loops[i].listenfd, F_SETFL, fcntl(loops[i].listenfd, F_GETFL, 0) | O_NONBLOCK);
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if(epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].listenfd, &ev) < 0 || loop_init(&loops[i]) < 0) {
+			perror("ERROR: epoll_ctl failed");
+			return -1;
+		}
+	}
 
-				fclose(file);
-				fclose(temp);
-			}
+	printf("Serving with %d event loops\n", workers);
 
-			bzero(buffer,BUFFER_SZ);
+	for(int i=1; i<workers; i++) {
+		if(pthread_create(&loops[i].tid, NULL, &event_loop, &loops[i]) != 0) {
+			perror("ERROR: pthread failed");
+			return -1;
+		}
+	}
 
-		} else if(strncmp(buff_out,DELETE_CONTACT,strlen(DELETE_CONTACT)) == 0) {
-			char con_name[STR_SIZE];
+	event_loop(&loops[0]);
+	return 0;
+}
 
-			substring(buff_out, con_name, strlen(DELETE_CONTACT)+1, strlen(buff_out));
-			trim_leading(con_name);
+/* io_uring mode: hand a receive buffer back to the kernel */
+void uring_buf_put(uring_t *r, unsigned short bid){
+	struct io_uring_buf *b = &r->buf_ring->bufs[r->buf_tail & (URING_BUFS - 1)];
 
-			int exists = contact_exists(con_name,cli);
-			int pos=-1;
+	b->addr = (uintptr_t)(r->bufs + (size_t)bid * URING_BUF_SZ);
+	b->len = URING_BUF_SZ;
+	b->bid = bid;
+	r->buf_tail++;
+	__atomic_store_n(&r->buf_ring->tail, r->buf_tail, __ATOMIC_RELEASE);
+}
 
-			if(exists == 0) {
+/* io_uring mode: whether the kernel has every operation this mode uses. Multishot receives have no bit
+ * of their own, they came with IORING_OP_SEND_ZC in Linux 6.0, so that one stands in for them */
+int uring_probe(int fd){
+	static const int ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_READ,
+		IORING_OP_ASYNC_CANCEL, IORING_OP_SEND_ZC };
+	struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, sizeof(struct io_uring_probe)
+		+ 256 * sizeof(struct io_uring_probe_op));
+	int supported = probe != NULL && syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+
+	for(size_t i=0; supported && i<sizeof(ops) / sizeof(ops[0]); i++) {
+		supported = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+	}
+	free(probe);
+	return supported;
+}
 
-				for(int i=0;i<MAX_CONTACTS;i++) {
-					if(strcmp(cli->contacts[i],con_name)==0) {
-						pos=i;
-					}
-				}
+/* io_uring mode: map a new ring and register its receive buffers, -1 when the kernel lacks what this mode needs */
+int uring_setup(uring_t *r){
+	struct io_uring_params p;
 
-				for(int i=pos;i<MAX_CONTACTS;i++) {
-						strcpy(cli->contacts[i],cli->contacts[i+1]);
-				}
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = URING_ENTRIES * 4;
+	r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if(r->fd < 0) {
+		return -1;
+	}
+	if(!uring_probe(r->fd)) {
+		close(r->fd);
+		return -1;
+	}
 
-				bzero(buffer,BUFFER_SZ);
-				sprintf(buffer,"%s:%s",cli->name,pswd);
-				int user_start_line = search_in_file("users.txt",buffer,1);
-				int line_index = 1;
+	size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	int single = p.features & IORING_FEAT_SINGLE_MMAP;
+	if(single && cq_len > sq_len) {
+		sq_len = cq_len;
+	}
 
-				file = fopen("users.txt","r");
-				temp=fopen("temp.txt","a+");
-				if(file==NULL || temp==NULL) {
-					perror("Error opening file.\n");
-				}
+	char *sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	char *cq = single ? sq : mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		r->fd, IORING_OFF_SQES);
+	if(sq == MAP_FAILED || cq == MAP_FAILED || r->sqes == MAP_FAILED || !(p.features & IORING_FEAT_NODROP)) {
+		close(r->fd);
+		return -1;
+	}
 
-				while ((read = getline(&line, &len, file)) != -1) {
-					if(line_index != user_start_line+1) {
-						fputs(line,temp);
-					} else {
-						char temp_buff[BUFFER_SZ];
-						char new_line[BUFFER_SZ];
-						strcpy(temp_buff,line);
-						str_trim_lf(temp_buff,strlen(temp_buff));
-						char *p=strtok(temp_buff,":");
-
-						strcpy(new_line,"contacts:");
-
-				    while (p != NULL) {
-								p = strtok (NULL, ":");
-								if(p != NULL && strcmp(p,"\0") != 0 && strcmp(p,"\n") != 0
-									&& strncmp(p,con_name,strlen(con_name))!=0 ){
-									sprintf(new_line + strlen(new_line),":%s",p);
-								}
-				    }
-
-						fputs(new_line,temp);
-						fputs("\n",temp);
-					}
-					line_index++;
-				}
+	r->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	r->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	r->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+	r->sq_entries = p.sq_entries;
+	r->sq_local = *r->sq_tail;
+	r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	r->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	/* Buffer group 0, multishot receives pick from it. Needs Linux 5.19 */
+	struct io_uring_buf_reg reg;
+	r->buf_ring = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	r->bufs = (char *)malloc((size_t)URING_BUFS * URING_BUF_SZ);
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)r->buf_ring;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = 0;
+	if(r->buf_ring == MAP_FAILED || r->bufs == NULL
+		|| syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		close(r->fd);
+		return -1;
+	}
+	for(int i=0; i<URING_BUFS; i++) {
+		uring_buf_put(r, i);
+	}
+	return 0;
+}
 
-				remove("users.txt");
-				rename("temp.txt", "users.txt");
+/* io_uring mode: tell the kernel about new entries, waiting up to ts for a completion when wait is set */
+void uring_submit(uring_t *r, int wait, struct __kernel_timespec *ts){
+	struct io_uring_getevents_arg arg;
+	unsigned int flags = wait ? IORING_ENTER_GETEVENTS : 0;
 
-				fclose(temp);
-				fclose(file);
+	__atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+	unsigned int pending = r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	if(pending == 0 && !wait) {
+		return;
+	}
 
-				write(cli->sockfd,"Contact deleted.\n",strlen("Contact deleted.\n"));
+	memset(&arg, 0, sizeof(arg));
+	if(ts != NULL) {
+		arg.ts = (uintptr_t)ts;
+		flags |= IORING_ENTER_EXT_ARG;
+	}
 
-			} else {
-				write(cli->sockfd,"Contact does not exist.\n",strlen("Contact does not exist.\n"));
-			}
+	io_stats.waits++;
+	if(syscall(__NR_io_uring_enter, r->fd, pending, wait ? 1 : 0, flags, ts ? (void *)&arg : NULL, ts ? sizeof(arg) : 0) < 0
+		&& errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+		perror("ERROR: io_uring_enter failed");
+	}
+}
 
-		} else if (strcmp(buff_out,CONTACT_LIST) == 0) {
-			// show contact list
-			int i=0;
-			write(cli->sockfd, "Your Contact List:\n", strlen("Your Contact List:\n"));
-			while(strcmp(cli->contacts[i],"\0") != 0) {
-				sprintf(buffer, "%d. %s\n", i+1, cli->contacts[i]);
-				write(cli->sockfd, buffer, strlen(buffer));
-				i++;
-			}
-			bzero(buffer,BUFFER_SZ);
+/* io_uring mode: accept connections on the loop's socket until told otherwise */
+void uring_accept(event_loop_t *loop){
+	struct io_uring_sqe *sqe = uring_sqe(loop->ring);
 
-		} else if(strncmp(buff_out,PERSONAL_MESSAGE, strlen(PERSONAL_MESSAGE)) == 0) {
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = loop->listenfd;
+	sqe->ioprio = loop->ring->accept_single ? 0 : IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = URING_ACCEPT;
+}
 
-			char message[BUFFER_SZ];
-			substring(buff_out, buff_out, 4, strlen(buff_out));
+/* io_uring mode: receive into the loop's buffers until the connection ends */
+void uring_recv(client_t *cli){
+	struct io_uring_sqe *sqe = uring_sqe(cli->loop->ring);
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = cli->sockfd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->user_data = (uintptr_t)cli | URING_RECV;
+	cli->uring_ops++;
+	cli->uring_reading = 1;
+}
 
-			char temp[BUFFER_SZ];
-			strcpy(temp,buff_out);
-			char *ptr = strtok(temp, " ");
-			strcpy(contact_name,ptr);
+/* io_uring mode: end a parked client's receive, the client arms it again once it goes on */
+void uring_cancel(client_t *cli){
+	struct io_uring_sqe *sqe = uring_sqe(cli->loop->ring);
 
-			trim_leading(contact_name);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uintptr_t)cli | URING_RECV;
+	sqe->user_data = URING_CANCEL;
+}
 
-			substring(buff_out, message, strlen(contact_name)+2, strlen(buff_out));
-			int res = send_pm(message, contact_name, cli);
-			if (res == -1) {
-				sprintf(buffer, "User %s is not in your contact list. Message not sent.\n", contact_name);
-				write(cli->sockfd, buffer, strlen(buffer));
-			} else if (res == 0) {
-				sprintf(buffer, "%s is offline. Message not sent.\n", contact_name);
-				write(cli->sockfd, buffer, strlen(buffer));
-			}
+/* io_uring mode: wait for other threads to post clients */
+void uring_wake(event_loop_t *loop){
+	struct io_uring_sqe *sqe = uring_sqe(loop->ring);
 
-		} else if(strncmp(buff_out,GROUP_MESSAGE,strlen(GROUP_MESSAGE)) == 0) {
-			char message[BUFFER_SZ];
-			char group_name[STR_SIZE];
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = loop->wake_fd;
+	sqe->addr = (uintptr_t)&loop->wake_val;
+	sqe->len = sizeof(loop->wake_val);
+	sqe->user_data = URING_WAKE;
+}
 
-			substring(buff_out, buff_out, strlen(GROUP_MESSAGE)+1, strlen(buff_out));
+/* io_uring mode: a send finished, retire what went out and send the rest */
+void uring_sent(client_t *cli, int res){
+	pthread_mutex_lock(&cli->out_mutex);
+	cli->out_busy = 0;
+	cli->uring_ops--;
+	if(cli->closing) {
+		client_out_clear(cli);
+	} else if(res < 0) {
+		/* The receive sees the shutdown and closes the connection as usual */
+		cli->closing = 1;
+		client_out_clear(cli);
+		shutdown(cli->sockfd, SHUT_RDWR);
+	} else {
+		client_out_sent(cli, res);
+		if(cli->out_count > 0) {
+			uring_send(cli);
+		} else {
+			cli->out_armed = 0;
+		}
+	}
 
-			char temp[BUFFER_SZ];
-			strcpy(temp,buff_out);
-			char *ptr = strtok(temp, " ");
-			strcpy(group_name,ptr);
+	/* The header is only needed while a send is in flight */
+	if(cli->out_busy == 0) {
+		pool_free(POOL_SEND, cli->out_send);
+		cli->out_send = NULL;
+	}
+	pthread_mutex_unlock(&cli->out_mutex);
+}
 
-			trim_leading(group_name);
+/* io_uring mode: bytes arrived, or the connection ended when res is 0 or an error */
+void uring_received(uring_t *r, client_t *cli, struct io_uring_cqe *cqe){
+	int more = cqe->flags & IORING_CQE_F_MORE;
+	int result = 0;
+	char *data = NULL;
+	unsigned short bid = 0;
 
-			substring(buff_out, message, strlen(group_name)+2, strlen(buff_out));
-			printf("Message to group %s is: %s\n", group_name,message);
+	if(!more) {
+		cli->uring_ops--;
+		cli->uring_reading = 0;
+	}
+	if(cqe->flags & IORING_CQE_F_BUFFER) {
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		data = r->bufs + (size_t)bid * URING_BUF_SZ;
+	}
 
-			int res = send_gm(message,group_name,cli);
-			if(res == -1) {
-				write(cli->sockfd, "Group does not exist.\n", strlen("Group does not exist.\n"));
-			} else if(res == -2) {
-				write(cli->sockfd, "You are not a member of the group.\n", strlen("You are not a member of the group.\n"));
-			}
+	if(cli->uring_closed) {
+		result = -1;
+	} else if(cqe->res > 0) {
+		io_stats.reads++;
+		result = client_input(cli, data, cqe->res);
+		if(result < 0) {
+			client_close(cli);
+		}
+	} else if(cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+		if(cqe->res == 0 && cli->state == STATE_CHAT) {
+			client_leave(cli);
+		} else if(cqe->res < 0) {
+			printf("ERROR: -1\n");
+		}
+		client_close(cli);
+		result = -1;
+	}
 
-		} else if (receive > 0){
-			if(strlen(buff_out) > 0){
-				send_message(buff_out, cli->uid);
+	if(data != NULL) {
+		uring_buf_put(r, bid);
+	}
+	/* A parked client is read again once it goes on */
+	if(result == 0 && !more && !cli->parked) {
+		uring_recv(cli);
+	}
+}
 
-				str_trim_lf(buff_out, strlen(buff_out));
-				printf("%s -> %s\n", buff_out, cli->name);
+/* io_uring mode: handle one completion */
+void uring_complete(event_loop_t *loop, struct io_uring_cqe *cqe){
+	int kind = cqe->user_data & URING_KIND;
+	client_t *cli = (client_t *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_KIND);
+
+	if(kind == URING_ACCEPT) {
+		if(cqe->res >= 0) {
+			struct sockaddr_in cli_addr;
+			socklen_t clilen = sizeof(cli_addr);
+			memset(&cli_addr, 0, sizeof(cli_addr));
+			getpeername(cqe->res, (struct sockaddr *)&cli_addr, &clilen);
+
+			client_t *new_cli = client_accept(cqe->res, cli_addr, -1, 0);
+			if(new_cli != NULL) {
+				uring_recv(new_cli);
 			}
-		} else if (receive == 0 || strcmp(buff_out, "exit") == 0){
-			sprintf(buff_out, "%s has left\n", cli->name);
-			printf("%s", buff_out);
-			send_message(buff_out, cli->uid);
-			leave_flag = 1;
 		} else {
-			printf("ERROR: -1\n");
-			leave_flag = 1;
+			printf("ERROR: accept failed: %s\n", strerror(-cqe->res));
 		}
 
-		bzero(buff_out, BUFFER_SZ);
+		/* Accepting goes on after every error. A multishot accept turned down makes way for single ones,
+		 * only a single one turned down too means the listener is unusable */
+		if(!(cqe->flags & IORING_CQE_F_MORE)) {
+			if(cqe->res != -EINVAL || !loop->ring->accept_single) {
+				loop->ring->accept_single |= cqe->res == -EINVAL;
+				uring_accept(loop);
+			} else {
+				printf("ERROR: no more connections are accepted on this loop\n");
+			}
+		}
+	} else if(kind == URING_RECV) {
+		uring_received(loop->ring, cli, cqe);
+	} else if(kind == URING_SEND) {
+		uring_sent(cli, cqe->res);
+	} else if(kind == URING_WAKE) {
+		uring_wake(loop);
+		loop_mail(loop);
 	}
 
-  /* Delete client from queue and yield thread */
-	EXIT:
-	close(cli->sockfd);
-	memset(cli->contacts, '\0', sizeof cli->contacts);
-  queue_remove(cli->uid);
-  free(cli);
-  cli_count--;
-  pthread_detach(pthread_self());
+	if(cli != NULL && cli->uring_closed && cli->uring_ops == 0) {
+		client_free(cli);
+	}
+}
+
+/* io_uring mode: handle every completion that is ready */
+void uring_reap(event_loop_t *loop){
+	uring_t *r = loop->ring;
+
+	while(1) {
+		unsigned int head = *r->cq_head;
+		if(head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+		struct io_uring_cqe cqe = r->cqes[head & r->cq_mask];
+		__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+		uring_complete(loop, &cqe);
+	}
+}
+
+/* io_uring mode: one loop per shard, every accept, receive and send goes through its ring */
+void *uring_loop(void *arg){
+	event_loop_t *loop = (event_loop_t *)arg;
+	uring_t *r = loop->ring;
+
+	current_loop = loop;
+	uring_accept(loop);
+	uring_wake(loop);
+
+	while(1){
+		uring_submit(r, 1, NULL);
+
+		/* Sends queued while handling these completions go out with the next submission */
+		batch_begin();
+		uring_reap(loop);
+		loop_continue(loop);
+		batch_end();
+	}
 
 	return NULL;
 }
 
-int main(int argc, char **argv){
-	if(argc != 2){
-		printf("Usage: %s <port>\n", argv[0]);
-		return EXIT_FAILURE;
+/* io_uring mode: start the loops, 1 when io_uring is not available and nothing was started */
+int run_uring_loops(int port, int workers){
+	raise_fd_limit();
+
+	loops = (event_loop_t *)calloc(workers, sizeof(event_loop_t));
+	if(loops == NULL) {
+		return -1;
 	}
 
-	char *ip = "127.0.0.1";
-	int port = atoi(argv[1]);
-	int option = 1;
-	int listenfd = 0, connfd = 0;
-  struct sockaddr_in serv_addr;
-  struct sockaddr_in cli_addr;
-  pthread_t tid;
+	for(int i=0; i<workers; i++) {
+		loops[i].epfd = -1;
+		loops[i].ring = (uring_t *)calloc(1, sizeof(uring_t));
+		if(loops[i].ring == NULL) {
+			return -1;
+		}
+		if(uring_setup(loops[i].ring) < 0 || loop_init(&loops[i]) < 0) {
+			if(i == 0) {
+				free(loops[i].ring);
+				free(loops);
+				return 1;
+			}
+			perror("ERROR: io_uring setup failed");
+			return -1;
+		}
 
-	FILE *groups_file;
-	char *line = NULL;
-  size_t len = 0;
-  ssize_t read;
+		loops[i].listenfd = open_listener(port);
+		if(loops[i].listenfd < 0) {
+			return -1;
+		}
+	}
 
-  /* Socket settings */
-  listenfd = socket(AF_INET, SOCK_STREAM, 0);
-  serv_addr.sin_family = AF_INET;
-  serv_addr.sin_addr.s_addr = inet_addr(ip);
-  serv_addr.sin_port = htons(port);
+	printf("Serving with %d io_uring loops\n", workers);
 
-  /* Ignore pipe signals */
-	signal(SIGPIPE, SIG_IGN);
+	for(int i=1; i<workers; i++) {
+		if(pthread_create(&loops[i].tid, NULL, &uring_loop, &loops[i]) != 0) {
+			perror("ERROR: pthread failed");
+			return -1;
+		}
+	}
 
-	if(setsockopt(listenfd, SOL_SOCKET,(SO_REUSEPORT | SO_REUSEADDR),(char*)&option,sizeof(option)) < 0){
-		perror("ERROR: setsockopt failed.\n");
-    return EXIT_FAILURE;
+	uring_loop(&loops[0]);
+	return 0;
+}
+
+/* Resident set size in bytes, 0 if it cannot be read */
+long rss_bytes(void){
+	long pages = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if(f != NULL) {
+		if(fscanf(f, "%*s %ld", &pages) != 1) {
+			pages = 0;
+		}
+		fclose(f);
 	}
+	return pages * sysconf(_SC_PAGESIZE);
+}
 
-	/* Bind */
-  if(bind(listenfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-    perror("ERROR: Socket binding failed.\n");
-    return EXIT_FAILURE;
-  }
+/* Print the server counters */
+void print_stats(void){
+	pthread_mutex_lock(&persist_mutex);
+	unsigned long records = persist_stats.records;
+	unsigned long batches = persist_stats.batches;
+	unsigned long max_batch = persist_stats.max_batch;
+	unsigned long syncs = persist_stats.syncs;
+	unsigned long sync_us_total = persist_stats.sync_us_total;
+	unsigned long sync_us_max = persist_stats.sync_us_max;
+	pthread_mutex_unlock(&persist_mutex);
+
+	printf("=== SERVER STATS ===\n");
+	printf("Clients online: %u\n", cli_count);
+	printf("Journal: %lu records in %lu batches (avg batch %.1f, max batch %lu)\n",
+		records, batches, batches ? (double)records / batches : 0.0, max_batch);
+	printf("Journal syncs: %lu (avg %lu us, max %lu us)\n",
+		syncs, syncs ? sync_us_total / syncs : 0, sync_us_max);
+	unsigned long sends = out_stats.writes + io_stats.ring_sends;
+	printf("Outbound writes: %lu sendmsg calls, %lu clients held to the batch end (%.2f frames per write)\n",
+		out_stats.writes, out_stats.held, sends ? (double)out_stats.frames / sends : 0.0);
+	printf("Resume: %lu logins with cursors, %lu messages replayed, %lu no longer kept, %lu acknowledgements\n",
+		resume_stats.logins, resume_stats.replayed, resume_stats.lost, resume_stats.acks);
+	pthread_mutex_lock(&session_mutex);
+	printf("Sessions: %lu tokens issued, %lu reconnects, %lu rejected, %lu cached\n", session_stats.issued,
+		session_stats.reconnects, session_stats.rejected, session_stats.cached);
+	pthread_mutex_unlock(&session_mutex);
+	printf("Zero-copy replay: %lu sendfile calls, %lu bytes\n", out_stats.sendfiles, out_stats.file_bytes);
+	printf("I/O: %lu epoll_wait or io_uring_enter calls, %lu reads, %lu io_uring sends, %lu cross-loop wakeups\n",
+		io_stats.waits, io_stats.reads, io_stats.ring_sends, io_stats.wakeups);
+	printf("Outbound: %lu frames, %lu left for EPOLLOUT, %lu dropped, %lu slow clients disconnected, %lu senders paused\n",
+		out_stats.frames, out_stats.deferred, out_stats.dropped, out_stats.disconnected, out_stats.paused);
+	for(int i=0; i<POOL_COUNT; i++) {
+		pool_t *p = &pools[i];
+		pthread_mutex_lock(&p->mutex);
+		unsigned long carved = p->carved;
+		unsigned long slabs = p->slabs;
+		size_t bytes = p->bytes;
+		pthread_mutex_unlock(&p->mutex);
+		long live = p->live;
+		printf("Pool %s: %ld live of %lu carved in %lu slabs (%.0f%% used, %zu KiB)\n", p->name, live, carved, slabs,
+			carved ? 100.0 * live / carved : 0.0, bytes / 1024);
+	}
+	printf("Messages over the pool sizes: %ld live\n", (long)msg_heap_live);
+	long rss = rss_bytes();
+	unsigned int online = cli_count;
+	printf("Memory: %ld KiB resident, %ld bytes per connection since startup\n",
+		rss / 1024, online ? (rss - rss_base) / (long)online : 0);
+	fflush(stdout);
+}
+
+/* Print the stats whenever SIGUSR1 arrives, the signal is blocked in every other thread */
+void *stats_loop(void *arg){
+	sigset_t *set = (sigset_t *)arg;
+	int sig;
+
+	while(sigwait(set, &sig) == 0) {
+		print_stats();
+	}
 
-  /* Listen */
-  if (listen(listenfd, 10) < 0) {
-    perror("ERROR: Socket listening failed.\n");
-    return EXIT_FAILURE;
+	return NULL;
+}
+
+int main(int argc, char **argv){
+	char *mode = "thread";
+	int convert = 0;
+	int usage = 0;
+	int workers = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+
+	while((opt = getopt(argc, argv, "m:w:d:i:n:co:q:k")) != -1) {
+		switch(opt) {
+			case 'm':
+				mode = optarg;
+				break;
+			case 'w':
+				workers = atoi(optarg);
+				break;
+			case 'd':
+				if(strcmp(optarg, "none") == 0) {
+					sync_mode = SYNC_NONE;
+				} else if(strcmp(optarg, "batch") == 0) {
+					sync_mode = SYNC_BATCH;
+				} else if(strcmp(optarg, "strict") == 0) {
+					sync_mode = SYNC_STRICT;
+				} else {
+					usage = 1;
+				}
+				break;
+			case 'i':
+				sync_interval_ms = atoi(optarg);
+				break;
+			case 'n':
+				sync_records = atoi(optarg);
+				break;
+			case 'c':
+				convert = 1;
+				break;
+			case 'o':
+				if(strcmp(optarg, "drop") == 0) {
+					out_policy = OUT_DROP;
+				} else if(strcmp(optarg, "disconnect") == 0) {
+					out_policy = OUT_DISCONNECT;
+				} else if(strcmp(optarg, "pause") == 0) {
+					out_policy = OUT_PAUSE;
+				} else {
+					usage = 1;
+				}
+				break;
+			case 'q':
+				out_limit = atol(optarg) * 1024;
+				break;
+			case 'k':
+				out_cork = 1;
+				break;
+			default:
+				usage = 1;
+		}
 	}
 
-	/* Initialize groups */
-	if((groups_file = fopen("groups.txt", "r")) == NULL) {
-		perror("ERROR: Opening groups file failed.\n");
+	if(usage || optind != argc - !convert || workers < 1 || sync_interval_ms < 0 || sync_records < 1 || out_limit == 0
+		|| (strcmp(mode, MODE_THREAD) != 0 && strcmp(mode, MODE_EPOLL) != 0 && strcmp(mode, MODE_URING) != 0)){
+		printf("Usage: %s [-m thread|epoll|uring] [-w workers] [-d none|batch|strict] [-i sync_ms] [-n sync_records]\n"
+			"       [-o drop|disconnect|pause] [-q queue_kb] [-k] <port>\n", argv[0]);
+		printf("       %s -c    convert users.txt and groups.txt to %s\n", argv[0], SNAPSHOT_FILE);
 		return EXIT_FAILURE;
 	}
 
-	printf("Initializing groups...\n");
+	int port = convert ? 0 : atoi(argv[optind]);
+
+  /* Ignore pipe signals */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* SIGUSR1 prints the stats, only the stats thread takes it */
+	static sigset_t stats_signals;
+	sigemptyset(&stats_signals);
+	sigaddset(&stats_signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &stats_signals, NULL);
 
-	while ((read = getline(&line, &len, groups_file)) != -1) {
+	pthread_t stats_tid, session_tid;
+	if(pthread_create(&stats_tid, NULL, &stats_loop, &stats_signals) != 0
+		|| pthread_create(&session_tid, NULL, &session_loop, NULL) != 0) {
+		perror("ERROR: pthread failed");
+		return EXIT_FAILURE;
+	}
 
-		char temp[BUFFER_SZ];
-		strcpy(temp,line);
-		char *ptr=strtok(temp,":");
-		char *array[2];
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-		int j=0;
-		while (ptr != NULL) {
-				array[j++] = ptr;
-				ptr = strtok (NULL, "\n");
+	/* Initialize users and groups, the directory is authoritative from here on */
+	if(!convert && access(SNAPSHOT_FILE, F_OK) == 0) {
+		printf("Mapping snapshot...\n");
+		if(snapshot_open(SNAPSHOT_FILE) < 0) {
+			printf("ERROR: Loading snapshot failed.\n");
+			return EXIT_FAILURE;
+		}
+	} else {
+		/* Groups first, users refer to them by id */
+		printf("Initializing groups...\n");
+		if(load_groups("groups.txt") < 0) {
+			printf("ERROR: Opening groups file failed.\n");
+			return EXIT_FAILURE;
 		}
 
-		if((group_count + 1) == MAX_GROUPS) {
-				printf("Max groups reached. Rejecting the rest...\n");
-				break;
+		printf("Loading users...\n");
+		if(load_users("users.txt") < 0) {
+			printf("ERROR: Loading users file failed.\n");
+			return EXIT_FAILURE;
 		}
+	}
+
+	printf("Total users %d, groups %d, loaded in %ld us\n", user_count, group_count, elapsed_us(&start));
 
-		group_t *gr = (group_t *)malloc(sizeof(group_t));
-		strcpy(gr->name,array[0]);
-		str_trim_lf(array[1],strlen(array[1]));
-		strcpy(gr->admin,array[1]);
-		queue_add_group(gr);
-		group_count++;
+	/* Converting writes the snapshot and stops, the next start maps it */
+	if(convert) {
+		char *buf;
+		size_t len;
+
+		if(snapshot_build(&buf, &len) < 0 || write_file(SNAPSHOT_FILE, buf, len) < 0) {
+			printf("ERROR: Writing snapshot failed.\n");
+			return EXIT_FAILURE;
+		}
+		sync_dir();
+		free(buf);
+		printf("Wrote %s, %zu bytes\n", SNAPSHOT_FILE, len);
+		return EXIT_SUCCESS;
 	}
 
-	printf("Total groups %d\n", group_count);
+	/* Apply the mutations logged since the files were last written */
+	if(journal_open() < 0) {
+		printf("ERROR: Opening journal failed.\n");
+		return EXIT_FAILURE;
+	}
 
-	fclose(groups_file);
+	if(history_open() < 0) {
+		printf("ERROR: Opening history failed.\n");
+		return EXIT_FAILURE;
+	}
 
 	printf("=== WELCOME TO THE CHATROOM ===\n");
+	rss_base = rss_bytes();
 
-	while(1){
-		socklen_t clilen = sizeof(cli_addr);
-		connfd = accept(listenfd, (struct sockaddr*)&cli_addr, &clilen);
-
-		/* Check if max clients is reached */
-		if((cli_count + 1) == MAX_CLIENTS){
-			printf("Max clients reached. Rejected: .\n");
-			print_client_addr(cli_addr);
-			printf(":%d\n", cli_addr.sin_port);
-			close(connfd);
-			continue;
+	if(strcmp(mode, MODE_URING) == 0) {
+		int result = run_uring_loops(port, workers);
+		if(result <= 0) {
+			return result < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 		}
+		printf("io_uring is not available, serving with epoll instead\n");
+		mode = (char *)MODE_EPOLL;
+	}
 
-		/* Client settings */
-		client_t *cli = (client_t *)malloc(sizeof(client_t));
-		cli->address = cli_addr;
-		cli->sockfd = connfd;
-		cli->uid = uid++;
-
-		/* Add client to the queue and fork thread */
-		queue_add(cli);
-		pthread_create(&tid, NULL, &handle_client, (void*)cli);
-
-		/* Reduce CPU usage */
-		sleep(1);
+	if(strcmp(mode, MODE_EPOLL) == 0) {
+		return run_event_loops(port, workers) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 	}
 
-	return EXIT_SUCCESS;
+	return run_acceptors(port, workers) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,379 @@
+/* Fan-out with members that stop reading, checked against stated bounds. Starts ./server in thread,
+ * epoll and uring mode in turn, each in a scratch directory under /tmp, with a small -q:
+ *  -o drop and -o disconnect: group messages go out one at a time and are timed until every member
+ *  that reads has them. The p99 once STALLED members that never read have joined may be at most
+ *  P99_FACTOR times the p99 before plus P99_SLACK_US, and every message has to arrive.
+ *  -o pause: the stalled members only start reading after STALL_MS. Every member, stalled or not,
+ *  has to get every message, in order, and the server has to have paused the sender.
+ * Exits with failure if any check does not hold. Build and run with make check */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "../protocol.h"
+
+#define RECV_TIMEOUT_S 5
+#define QUEUE_KB "64"       /* -q for the server, small so the stalled members overflow soon */
+#define MEMBERS 10          /* members that read */
+#define STALLED 4           /* members that do not */
+#define MESSAGES 1000       /* timed messages before and after the stalled members join */
+#define PAUSE_MESSAGES 6000 /* messages sent under -o pause, more than a socket buffer takes (4 MB) */
+#define STALL_MS 1000       /* how long the stalled members hold off reading under -o pause */
+#define P99_FACTOR 2
+#define P99_SLACK_US 2000.0
+
+typedef struct {
+	int fd;
+	int got;    /* messages received in order */
+	int wrong;  /* messages out of order */
+	int delay_ms;
+	frame_parser_t parser;
+	char buf[FRAME_HDR + FRAME_MAX_PAYLOAD];
+} conn_t;
+
+static const char *modes[] = { "thread", "epoll", "uring" };
+
+int port;
+int failures = 0;
+
+double now_us(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Connect and register a member of the default group, retrying while the server starts up. A stalled
+ * one gets a small receive buffer */
+int conn_open(conn_t *c, const char *name, int stalled){
+	struct sockaddr_in addr;
+	struct timeval tv = { RECV_TIMEOUT_S, 0 };
+	frame_t f;
+
+	memset(c, 0, sizeof(*c));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+	for(int tries=0; ; tries++) {
+		c->fd = socket(AF_INET, SOCK_STREAM, 0);
+		if(stalled) {
+			int size = 4096;
+			setsockopt(c->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+		}
+		setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		if(connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+			break;
+		}
+		close(c->fd);
+		if(tries == 50) {
+			perror("ERROR: connect");
+			return -1;
+		}
+		usleep(100000);
+	}
+	frame_parser_init(&c->parser, c->buf, sizeof(c->buf));
+
+	if(frame_send(c->fd, OP_REGISTER, "", 0) < 0 || frame_send(c->fd, OP_NAME, name, strlen(name)) < 0
+		|| frame_send(c->fd, OP_PASSWORD, "pswd", 4) < 0 || frame_recv(c->fd, &c->parser, &f) <= 0
+		|| frame_send(c->fd, OP_GROUPS, "default", 7) < 0 || frame_recv(c->fd, &c->parser, &f) <= 0
+		|| f.opcode != OP_OK) {
+		fprintf(stderr, "ERROR: %s could not register\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+/* The number a group message was sent with, -1 if the frame is not one */
+int frame_mark(const frame_t *f){
+	char *mark = f->opcode == OP_SEQ_TEXT ? memmem(f->payload, f->len, " <", 2) : NULL;
+	return mark != NULL ? atoi(mark + 2) : -1;
+}
+
+/* Send group message n, about 1 KB */
+int send_mark(conn_t *sender, int n){
+	char text[1100];
+
+	int len = snprintf(text, sizeof(text), "default <%d> ", n);
+	memset(text + len, 'x', 1000);
+	return frame_send(sender->fd, OP_GROUP_MESSAGE, text, len + 1000);
+}
+
+/* Read until group message n arrives, -1 if it did not within RECV_TIMEOUT_S */
+int conn_wait(conn_t *c, int n){
+	frame_t f;
+
+	while(frame_recv(c->fd, &c->parser, &f) > 0) {
+		if(frame_mark(&f) == n) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int cmp_double(const void *a, const void *b){
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Send messages one at a time and time each until every member has it. The p99, -1 if one did not
+ * reach every member */
+double timed_run(conn_t *sender, conn_t *members, int *next){
+	double *lat = (double *)malloc(MESSAGES * sizeof(double));
+	double p99 = -1;
+	int done;
+
+	for(done=0; done<MESSAGES; done++) {
+		int n = (*next)++;
+		double start = now_us();
+		send_mark(sender, n);
+		int i;
+		for(i=0; i<MEMBERS && conn_wait(&members[i], n) == 0; i++);
+		if(i < MEMBERS) {
+			break;
+		}
+		lat[done] = now_us() - start;
+	}
+	if(done == MESSAGES) {
+		qsort(lat, done, sizeof(double), cmp_double);
+		p99 = lat[done * 99 / 100];
+	}
+	free(lat);
+	return p99;
+}
+
+/* Under -o pause: all of the messages, in order, after holding off for delay_ms */
+void *reader(void *arg){
+	conn_t *c = (conn_t *)arg;
+	frame_t f;
+
+	usleep(c->delay_ms * 1000);
+	while(c->got + c->wrong < PAUSE_MESSAGES && frame_recv(c->fd, &c->parser, &f) > 0) {
+		int n = frame_mark(&f);
+		if(n == c->got) {
+			c->got++;
+		} else if(n >= 0) {
+			c->wrong++;
+		}
+	}
+	return NULL;
+}
+
+/* Under -o pause the sender blocks whenever the server stops reading it */
+void *sender(void *arg){
+	conn_t *c = (conn_t *)arg;
+
+	for(int n=0; n<PAUSE_MESSAGES; n++) {
+		if(send_mark(c, n) < 0) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Start the server in a scratch directory, its output goes to server.log there */
+pid_t server_start(const char *server, const char *mode, const char *policy, char *dir){
+	strcpy(dir, "/tmp/chatroom-fanout-XXXXXX");
+	if(mkdtemp(dir) == NULL) {
+		return -1;
+	}
+
+	pid_t pid = fork();
+	if(pid == 0) {
+		char port_arg[16];
+		snprintf(port_arg, sizeof(port_arg), "%d", port);
+		if(chdir(dir) < 0) {
+			_exit(1);
+		}
+		FILE *f = fopen("groups.txt", "w");
+		fputs("default:admin\n", f);
+		fclose(f);
+		close(creat("users.txt", 0644));
+		int log = creat("server.log", 0644);
+		dup2(log, STDOUT_FILENO);
+		dup2(log, STDERR_FILENO);
+		execl(server, server, "-m", mode, "-w", "2", "-q", QUEUE_KB, "-o", policy, port_arg, (char *)NULL);
+		_exit(1);
+	}
+	return pid;
+}
+
+/* Stop the server and tell how many times it paused a sender */
+long server_stop(pid_t pid, const char *dir){
+	char path[PATH_MAX], line[256];
+	long paused = 0;
+
+	/* The stats flush the server's output, which goes to a file */
+	kill(pid, SIGUSR1);
+	usleep(200000);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+
+	snprintf(path, sizeof(path), "%s/server.log", dir);
+	FILE *f = fopen(path, "r");
+	while(f != NULL && fgets(line, sizeof(line), f) != NULL) {
+		char *at = strstr(line, " senders paused");
+		if(strncmp(line, "Outbound:", 9) == 0 && at != NULL) {
+			while(at > line && at[-1] >= '0' && at[-1] <= '9') {
+				at--;
+			}
+			paused = atol(at);
+		}
+	}
+	if(f != NULL) {
+		fclose(f);
+	}
+
+	char cmd[PATH_MAX + 16];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	if(system(cmd) != 0) {
+		fprintf(stderr, "ERROR: could not remove %s\n", dir);
+	}
+	return paused;
+}
+
+void check(int ok, const char *mode, const char *policy, const char *what){
+	printf("%-6s %-10s %-4s %s\n", mode, policy, ok ? "ok" : "FAIL", what);
+	failures += !ok;
+}
+
+/* -o drop or -o disconnect: the members that read are as fast with stalled members as without */
+void run_bounded(const char *server, const char *mode, const char *policy){
+	char dir[64], name[32], what[160];
+	conn_t *sender = (conn_t *)malloc(sizeof(conn_t));
+	conn_t *members = (conn_t *)malloc((MEMBERS + STALLED) * sizeof(conn_t));
+	int next = 0, opened = 0;
+
+	pid_t pid = server_start(server, mode, policy, dir);
+	if(pid < 0 || conn_open(sender, "sender", 0) < 0) {
+		check(0, mode, policy, "server did not come up");
+		goto out;
+	}
+	for(; opened<MEMBERS; opened++) {
+		snprintf(name, sizeof(name), "m%d", opened);
+		if(conn_open(&members[opened], name, 0) < 0) {
+			check(0, mode, policy, "member could not register");
+			goto out;
+		}
+	}
+
+	double before = timed_run(sender, members, &next);
+	for(; opened<MEMBERS + STALLED; opened++) {
+		snprintf(name, sizeof(name), "s%d", opened);
+		if(conn_open(&members[opened], name, 1) < 0) {
+			check(0, mode, policy, "stalled member could not register");
+			goto out;
+		}
+	}
+	double after = timed_run(sender, members, &next);
+
+	double bound = P99_FACTOR * before + P99_SLACK_US;
+	snprintf(what, sizeof(what), "p99 %.1f us before, %.1f us with %d stalled, bound %.1f us",
+		before, after, STALLED, bound);
+	check(before >= 0 && after >= 0 && after <= bound, mode, policy, what);
+
+out:
+	for(int i=0; i<opened; i++) {
+		close(members[i].fd);
+	}
+	close(sender->fd);
+	if(pid > 0) {
+		server_stop(pid, dir);
+	}
+	free(members);
+	free(sender);
+	port++;
+}
+
+/* -o pause: nothing is lost, the sender is held back instead */
+void run_pause(const char *server, const char *mode){
+	char dir[64], name[32], what[160];
+	conn_t *sender_conn = (conn_t *)malloc(sizeof(conn_t));
+	conn_t *members = (conn_t *)malloc((MEMBERS + STALLED) * sizeof(conn_t));
+	pthread_t threads[MEMBERS + STALLED + 1];
+	int opened = 0;
+
+	pid_t pid = server_start(server, mode, "pause", dir);
+	if(pid < 0 || conn_open(sender_conn, "sender", 0) < 0) {
+		check(0, mode, "pause", "server did not come up");
+		goto out;
+	}
+	for(; opened<MEMBERS + STALLED; opened++) {
+		int stalled = opened >= MEMBERS;
+		snprintf(name, sizeof(name), "%c%d", stalled ? 's' : 'm', opened);
+		if(conn_open(&members[opened], name, stalled) < 0) {
+			check(0, mode, "pause", "member could not register");
+			goto out;
+		}
+		members[opened].delay_ms = stalled ? STALL_MS : 0;
+	}
+
+	for(int i=0; i<opened; i++) {
+		pthread_create(&threads[i], NULL, reader, &members[i]);
+	}
+	pthread_create(&threads[opened], NULL, sender, sender_conn);
+	for(int i=0; i<=opened; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	int least = PAUSE_MESSAGES, wrong = 0;
+	for(int i=0; i<opened; i++) {
+		least = members[i].got < least ? members[i].got : least;
+		wrong += members[i].wrong;
+	}
+	snprintf(what, sizeof(what), "every member got at least %d of %d in order, %d out of order",
+		least, PAUSE_MESSAGES, wrong);
+	check(least == PAUSE_MESSAGES && wrong == 0, mode, "pause", what);
+
+out:
+	for(int i=0; i<opened; i++) {
+		close(members[i].fd);
+	}
+	close(sender_conn->fd);
+	if(pid > 0) {
+		long paused = server_stop(pid, dir);
+		if(opened == MEMBERS + STALLED) {
+			snprintf(what, sizeof(what), "the sender was paused %ld times", paused);
+			check(paused > 0, mode, "pause", what);
+		}
+	}
+	free(members);
+	free(sender_conn);
+	port++;
+}
+
+int main(int argc, char **argv){
+	char server[PATH_MAX];
+
+	if(argc > 1) {
+		printf("Usage: %s, from the directory holding the server\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if(realpath("./server", server) == NULL) {
+		perror("ERROR: ./server");
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	port = 20000 + getpid() % 20000;
+	printf("%d members that read, %d that stall, -q %s\n", MEMBERS, STALLED, QUEUE_KB);
+	for(size_t i=0; i<sizeof(modes) / sizeof(modes[0]); i++) {
+		run_bounded(server, modes[i], "drop");
+		run_bounded(server, modes[i], "disconnect");
+		run_pause(server, modes[i]);
+	}
+	printf("%s\n", failures ? "FAILED" : "PASSED");
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}